@@ -0,0 +1,347 @@
+/* Microbenchmark of the skiplist alone, without the Lua binding.
+ *
+ * Every (size, distribution) case runs in a child process so that its peak
+ * RSS is its own. Each operation is timed on its own and the results are
+ * printed as JSON on stdout:
+ *
+ *   ./bench [-n sizes] [-d distributions] [-o ops] [-s seed]
+ *
+ * sizes is a comma separated list of set sizes, distributions a comma
+ * separated list of uniform, sequential, zipf and dup. ops is the number of
+ * operations timed for every operation but insert, which is timed for the
+ * whole set. */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "skiplist.h"
+
+#define BENCH_RANGE 100 /* elements read or removed by a range operation */
+
+typedef struct bench_case {
+    unsigned long size;
+    const char *dist;
+    unsigned long ops;
+    unsigned int seed;
+} bench_case;
+
+/* xorshift64*, random() is too slow and too short for 1e7 elements */
+static uint64_t bench_state = 88172645463325252ULL;
+
+static uint64_t bench_rand(void) {
+    bench_state ^= bench_state >> 12;
+    bench_state ^= bench_state << 25;
+    bench_state ^= bench_state >> 27;
+
+    return bench_state * 2685821657736338717ULL;
+}
+
+static double bench_rand01(void) {
+    return (bench_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Zipfian ranks in [0, n) with theta 0.99, as generated by YCSB (Gray et
+ * al., "Quickly Generating Billion-Record Synthetic Databases"). */
+typedef struct bench_zipf {
+    unsigned long n;
+    double theta, alpha, zetan, eta;
+} bench_zipf;
+
+static void bench_zipf_init(bench_zipf *z, unsigned long n) {
+    double zeta2 = 0;
+    unsigned long i;
+
+    z->n = n;
+    z->theta = 0.99;
+    z->alpha = 1 / (1 - z->theta);
+    z->zetan = 0;
+    for (i = 1; i <= n; i++) {
+        z->zetan += 1 / pow(i, z->theta);
+        if (i == 2) {
+            zeta2 = z->zetan;
+        }
+    }
+    z->eta = (1 - pow(2.0 / n, 1 - z->theta)) / (1 - zeta2 / z->zetan);
+}
+
+static double bench_zipf_next(bench_zipf *z) {
+    double u = bench_rand01();
+    double uz = u * z->zetan;
+
+    if (uz < 1) {
+        return 0;
+    }
+
+    if (uz < 1 + pow(0.5, z->theta)) {
+        return 1;
+    }
+
+    return (unsigned long)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+}
+
+static const char *bench_dists[] = {"uniform", "sequential", "zipf", "dup",
+                                    NULL};
+
+static int bench_valid_dist(const char *dist) {
+    int i;
+
+    for (i = 0; bench_dists[i]; i++) {
+        if (strcmp(dist, bench_dists[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static double bench_score(const bench_case *c, bench_zipf *z,
+                          unsigned long i) {
+    if (strcmp(c->dist, "sequential") == 0) {
+        return i;
+    } else if (strcmp(c->dist, "zipf") == 0) {
+        return bench_zipf_next(z);
+    } else if (strcmp(c->dist, "dup") == 0) {
+        return bench_rand() % 16;
+    }
+
+    return bench_rand01() * c->size;
+}
+
+static int bench_compare(const void *a, const void *b) {
+    const double *n1 = a, *n2 = b;
+
+    return (*n1 < *n2) ? -1 : (*n1 > *n2);
+}
+
+static unsigned int bench_hash(const void *a) {
+    uint64_t u;
+
+    memcpy(&u, a, sizeof(u));
+    u ^= u >> 33;
+    u *= 0xff51afd7ed558ccdULL;
+    u ^= u >> 33;
+
+    return (unsigned int)u;
+}
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Print the timings of n operations and reset them. */
+static void bench_report(const char *op, uint32_t *ns, unsigned long n,
+                         int *first) {
+    uint64_t total = 0;
+    unsigned long i;
+
+    if (n == 0) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        total += ns[i];
+    }
+
+    qsort(ns, n, sizeof(*ns), bench_compare_u32);
+
+    printf("%s\n        \"%s\": {\"ops\": %lu, \"ns_per_op\": %.1f, "
+           "\"p50\": %u, \"p90\": %u, \"p99\": %u, \"p999\": %u, "
+           "\"max\": %u}",
+           *first ? "" : ",", op, n, (double)total / n, ns[n / 2],
+           ns[n * 9 / 10], ns[n * 99 / 100], ns[n * 999 / 1000], ns[n - 1]);
+
+    *first = 0;
+}
+
+#define BENCH_TIME(ns, expr)                          \
+    do {                                              \
+        uint64_t t0 = bench_now();                    \
+        expr;                                         \
+        *(ns) = (uint32_t)(bench_now() - t0);         \
+    } while (0)
+
+static void bench_run(const bench_case *c) {
+    unsigned long n = c->size, ops = c->ops < n ? c->ops : n, i, j;
+    double *scores = malloc(n * sizeof(double));
+    double **objs = malloc(n * sizeof(double *));
+    unsigned long *perm = malloc(n * sizeof(unsigned long));
+    uint32_t *ns = malloc(n * sizeof(uint32_t));
+    skiplist *sl = skiplistCreate(bench_compare, free);
+    skiplistNode *x;
+    bench_zipf z;
+    int first = 1;
+    struct rusage ru;
+
+    bench_state ^= c->seed * 0x9e3779b97f4a7c15ULL;
+    skiplistEnableIndex(sl, bench_hash);
+    if (strcmp(c->dist, "zipf") == 0) {
+        bench_zipf_init(&z, n);
+    }
+
+    for (i = 0; i < n; i++) {
+        scores[i] = bench_score(c, &z, i);
+        objs[i] = malloc(sizeof(double));
+        *objs[i] = i;
+        perm[i] = i;
+    }
+
+    /* Fisher-Yates, the order in which elements are probed and deleted */
+    for (i = n - 1; i > 0; i--) {
+        j = bench_rand() % (i + 1);
+        unsigned long tmp = perm[i];
+        perm[i] = perm[j];
+        perm[j] = tmp;
+    }
+
+    printf("    {\"size\": %lu, \"dist\": \"%s\", \"results\": {", n, c->dist);
+
+    for (i = 0; i < n; i++) {
+        BENCH_TIME(&ns[i], skiplistInsert(sl, scores[i], objs[i]));
+    }
+    bench_report("insert", ns, n, &first);
+
+    for (i = 0; i < ops; i++) {
+        j = perm[i];
+        BENCH_TIME(&ns[i], skiplistGetRank(sl, scores[j], objs[j]));
+    }
+    bench_report("rank", ns, ops, &first);
+
+    for (i = 0; i < ops; i++) {
+        unsigned long rank = bench_rand() % n + 1;
+        BENCH_TIME(&ns[i], skiplistGetNodeByRank(sl, rank));
+    }
+    bench_report("at", ns, ops, &first);
+
+    for (i = 0; i < ops; i++) {
+        double min = scores[perm[i]];
+        BENCH_TIME(&ns[i], {
+            x = skiplistFirstInRange(sl, min, HUGE_VAL, 0, 0);
+            for (j = 0; x && j < BENCH_RANGE; j++) {
+                x = x->level[0].forward;
+            }
+        });
+    }
+    bench_report("range", ns, ops, &first);
+
+    for (i = 0; i < ops; i++) {
+        j = perm[i];
+        double score = bench_score(c, &z, j);
+        BENCH_TIME(&ns[i], skiplistUpdateScore(sl, scores[j], objs[j], score));
+        scores[j] = score;
+    }
+    bench_report("update", ns, ops, &first);
+
+    for (i = 0; i < ops; i++) {
+        j = perm[i];
+        BENCH_TIME(&ns[i], skiplistDelete(sl, scores[j], objs[j]));
+    }
+    bench_report("delete", ns, ops, &first);
+
+    /* put the deleted elements back, small sets would be empty otherwise */
+    for (i = 0; i < ops; i++) {
+        j = perm[i];
+        objs[j] = malloc(sizeof(double));
+        *objs[j] = j;
+        skiplistInsert(sl, scores[j], objs[j]);
+    }
+
+    for (i = 0; i < ops && sl->length > 0; i++) {
+        unsigned int start = bench_rand() % sl->length + 1;
+        BENCH_TIME(&ns[i], skiplistDeleteRangeByRank(
+                               sl, start, start + BENCH_RANGE - 1, NULL, NULL));
+    }
+    bench_report("delete_range", ns, i, &first);
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("\n    }, \"peak_rss_kb\": %ld}", ru.ru_maxrss);
+    fflush(stdout);
+
+    skiplistFree(sl);
+    free(scores);
+    free(objs);
+    free(perm);
+    free(ns);
+}
+
+int main(int argc, char **argv) {
+    const char *sizes = "1000,10000,100000,1000000,10000000";
+    const char *dists = "uniform,sequential,zipf,dup";
+    bench_case c = {0, NULL, 100000, 1};
+    char *s, *d, *sizes_copy, *dists_copy, *p, *q;
+    int opt, first = 1;
+
+    while ((opt = getopt(argc, argv, "n:d:o:s:")) != -1) {
+        switch (opt) {
+        case 'n': sizes = optarg; break;
+        case 'd': dists = optarg; break;
+        case 'o': c.ops = strtoul(optarg, NULL, 10); break;
+        case 's': c.seed = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-n sizes] [-d dists] [-o ops] "
+                            "[-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    dists_copy = strdup(dists);
+    for (d = strtok_r(dists_copy, ",", &q); d; d = strtok_r(NULL, ",", &q)) {
+        if (!bench_valid_dist(d)) {
+            fprintf(stderr, "%s: unknown distribution %s, expected uniform, "
+                            "sequential, zipf or dup\n", argv[0], d);
+            return 1;
+        }
+    }
+    free(dists_copy);
+
+    printf("{\"ops\": %lu, \"seed\": %u, \"cases\": [\n", c.ops, c.seed);
+    fflush(stdout);
+
+    sizes_copy = strdup(sizes);
+    for (s = strtok_r(sizes_copy, ",", &p); s; s = strtok_r(NULL, ",", &p)) {
+        c.size = strtoul(s, NULL, 10);
+        if (c.size == 0) {
+            continue;
+        }
+
+        dists_copy = strdup(dists);
+        for (d = strtok_r(dists_copy, ",", &q); d;
+             d = strtok_r(NULL, ",", &q)) {
+            c.dist = d;
+            if (!first) {
+                printf(",\n");
+            }
+            first = 0;
+            fflush(stdout);
+
+            pid_t pid = fork();
+            if (pid == 0) {
+                bench_run(&c);
+                _exit(0);
+            }
+            waitpid(pid, NULL, 0);
+        }
+        free(dists_copy);
+    }
+    free(sizes_copy);
+
+    printf("\n]}\n");
+
+    return 0;
+}
@@ -0,0 +1,294 @@
+-- Benchmark of the Lua side: lzset.string called directly, zset.lua and a
+-- pure Lua sorted array, runs under Lua 5.x and LuaJIT:
+--
+--   lua bench.lua [size1,size2,...] [ops]
+--
+-- For every method it prints the time per call and the memory allocated
+-- per call, measured with collectgarbage("count") while the GC is stopped.
+
+local lzset_string = require "lzset.string"
+local zset = require "zset"
+
+
+local clock = os.clock
+local floor = math.floor
+local random = math.random
+local tinsert = table.insert
+local tremove = table.remove
+
+
+local sizes = {}
+for size in (arg[1] or "1000,10000,100000"):gmatch("%d+") do
+    sizes[#sizes + 1] = tonumber(size)
+end
+local OPS = tonumber(arg[2]) or 100000
+local RANGE = 100         -- rows read by the range methods
+local BASELINE_MAX = 20000 -- the sorted array inserts in O(n)
+
+
+-- pure Lua baseline: an array sorted by (score, key) plus a key -> score map
+local sorted = {}
+local sorted_mt = { __index = sorted }
+
+function sorted.new()
+    return setmetatable({ scores = {}, keys = {}, dict = {} }, sorted_mt)
+end
+
+-- first position whose element is not less than (score, key)
+function sorted:_search(score, key)
+    local scores, keys = self.scores, self.keys
+    local lo, hi = 1, #scores + 1
+    while lo < hi do
+        local mid = floor((lo + hi) / 2)
+        local s = scores[mid]
+        if s < score or (s == score and keys[mid] < key) then
+            lo = mid + 1
+        else
+            hi = mid
+        end
+    end
+    return lo
+end
+
+function sorted:insert(score, key)
+    if self.dict[key] then
+        return false
+    end
+    local i = self:_search(score, key)
+    tinsert(self.scores, i, score)
+    tinsert(self.keys, i, key)
+    self.dict[key] = score
+    return true
+end
+
+function sorted:delete(score, key)
+    if self.dict[key] ~= score then
+        return false
+    end
+    local i = self:_search(score, key)
+    tremove(self.scores, i)
+    tremove(self.keys, i)
+    self.dict[key] = nil
+    return true
+end
+
+function sorted:score(key)
+    return self.dict[key]
+end
+
+function sorted:get_rank(score, key)
+    if self.dict[key] ~= score then
+        return
+    end
+    return self:_search(score, key)
+end
+
+function sorted:at(rank)
+    return self.scores[rank], self.keys[rank]
+end
+
+function sorted:get_range_by_rank(r1, r2)
+    local t, keys = {}, self.keys
+    for i = r1, r2 do
+        t[#t + 1] = keys[i]
+    end
+    return t
+end
+
+function sorted:get_range_by_score(s1, s2)
+    local t, scores, keys = {}, self.scores, self.keys
+    local i = self:_search(s1, "")
+    while scores[i] and scores[i] <= s2 do
+        t[#t + 1] = keys[i]
+        i = i + 1
+    end
+    return t
+end
+
+
+local function measure(size, impl, method, n, f)
+    if n < 1 then
+        return
+    end
+
+    collectgarbage("collect")
+    collectgarbage("stop")
+    local kb = collectgarbage("count")
+    local t0 = clock()
+    for i = 1, n do
+        f(i)
+    end
+    local elapsed = clock() - t0
+    local alloc = collectgarbage("count") - kb
+    collectgarbage("restart")
+
+    print(("%-8d %-9s %-20s %8d %12.1f %12.3f"):format(
+        size, impl, method, n, elapsed * 1e9 / n, alloc * 1024 / n))
+end
+
+
+local function run(size)
+    local ops = OPS < size and OPS or size
+    local keys, scores, probes = {}, {}, {}
+    for i = 1, size do
+        keys[i] = "k" .. i
+        scores[i] = random(size)
+    end
+    for i = 1, ops do
+        probes[i] = random(size)
+    end
+
+    -- lzset.string, every method with a single Lua -> C call
+    local zs = lzset_string()
+    measure(size, "lzset", "insert", size, function(i)
+        zs:insert(scores[i], keys[i])
+    end)
+    measure(size, "lzset", "score", ops, function(i)
+        zs:score(keys[probes[i]])
+    end)
+    measure(size, "lzset", "get_rank", ops, function(i)
+        local j = probes[i]
+        zs:get_rank(scores[j], keys[j])
+    end)
+    measure(size, "lzset", "get_score_rank", ops, function(i)
+        zs:get_score_rank(scores[probes[i]], true)
+    end)
+    measure(size, "lzset", "at", ops, function(i)
+        zs:at(probes[i])
+    end)
+    measure(size, "lzset", "get_range_by_rank", ops, function(i)
+        zs:get_range_by_rank(probes[i], probes[i] + RANGE - 1)
+    end)
+    measure(size, "lzset", "get_range_by_score", ops, function(i)
+        zs:get_range_by_score(scores[probes[i]], scores[probes[i]] + 1)
+    end)
+    measure(size, "lzset", "count_by_score", ops, function(i)
+        zs:count_by_score(scores[probes[i]], scores[probes[i]] + 1)
+    end)
+
+    local batch = {}
+    for i = 1, RANGE do
+        batch[i] = keys[probes[(i - 1) % ops + 1]]
+    end
+    measure(size, "lzset", "get_ranks(100)", floor(ops / RANGE), function()
+        zs:get_ranks(batch)
+    end)
+    for i = 1, RANGE do
+        batch[i] = probes[(i - 1) % ops + 1]
+    end
+    measure(size, "lzset", "at_many(100)", floor(ops / RANGE), function()
+        zs:at_many(batch)
+    end)
+    measure(size, "lzset", "quantiles(3)", ops, function()
+        zs:quantiles({ 0.5, 0.9, 0.99 })
+    end)
+    measure(size, "lzset", "around(10,10)", ops, function(i)
+        zs:around(keys[probes[i]], 10, 10)
+    end)
+    measure(size, "lzset", "update", ops, function(i)
+        local j = probes[i]
+        local score = random(size)
+        if zs:update(scores[j], keys[j], score) then
+            scores[j] = score
+        end
+    end)
+    measure(size, "lzset", "incrby", ops, function(i)
+        local j = probes[i]
+        scores[j] = zs:incrby(keys[j], 1)
+    end)
+    measure(size, "lzset", "stats", ops, function()
+        zs:stats()
+    end)
+    measure(size, "lzset", "delete", ops, function(i)
+        local j = probes[i]
+        zs:delete(scores[j], keys[j])
+    end)
+    measure(size, "lzset", "pop_min", floor(#zs / 2), function()
+        zs:pop_min(1)
+    end)
+    measure(size, "lzset", "delete_range_by_rank", floor(#zs / RANGE),
+            function()
+        zs:delete_range_by_rank(1, RANGE, function() end)
+    end)
+
+    -- zset.lua, the same set behind the _dict mirror
+    for i = 1, size do
+        scores[i] = random(size)
+    end
+    zs = zset.new(zset.TYPE_STRING)
+    measure(size, "zset", "insert", size, function(i)
+        zs:insert(scores[i], keys[i])
+    end)
+    measure(size, "zset", "score", ops, function(i)
+        zs:score(keys[probes[i]])
+    end)
+    measure(size, "zset", "rank", ops, function(i)
+        zs:rank(keys[probes[i]])
+    end)
+    measure(size, "zset", "at", ops, function(i)
+        zs:at(probes[i])
+    end)
+    measure(size, "zset", "get_range_by_rank", ops, function(i)
+        zs:get_range_by_rank(probes[i], probes[i] + RANGE - 1)
+    end)
+    measure(size, "zset", "get_range_by_score", ops, function(i)
+        zs:get_range_by_score(scores[probes[i]], scores[probes[i]] + 1)
+    end)
+    measure(size, "zset", "incrby", ops, function(i)
+        zs:incrby(keys[probes[i]], 1)
+    end)
+    measure(size, "zset", "insert(update)", ops, function(i)
+        zs:insert(random(size), keys[probes[i]])
+    end)
+    measure(size, "zset", "delete", ops, function(i)
+        zs:delete(keys[probes[i]])
+    end)
+    measure(size, "zset", "limit_front", 1, function()
+        zs:limit_front(floor(zs:count() / 2))
+    end)
+    measure(size, "zset", "remove_lt", 1, function()
+        zs:remove_lt(size / 4)
+    end)
+
+    if size > BASELINE_MAX then
+        return
+    end
+
+    -- pure Lua sorted array
+    for i = 1, size do
+        scores[i] = random(size)
+    end
+    local st = sorted.new()
+    measure(size, "lua", "insert", size, function(i)
+        st:insert(scores[i], keys[i])
+    end)
+    measure(size, "lua", "score", ops, function(i)
+        st:score(keys[probes[i]])
+    end)
+    measure(size, "lua", "get_rank", ops, function(i)
+        local j = probes[i]
+        st:get_rank(scores[j], keys[j])
+    end)
+    measure(size, "lua", "at", ops, function(i)
+        st:at(probes[i])
+    end)
+    measure(size, "lua", "get_range_by_rank", ops, function(i)
+        st:get_range_by_rank(probes[i], probes[i] + RANGE - 1)
+    end)
+    measure(size, "lua", "get_range_by_score", ops, function(i)
+        st:get_range_by_score(scores[probes[i]], scores[probes[i]] + 1)
+    end)
+    measure(size, "lua", "delete", ops, function(i)
+        local j = probes[i]
+        st:delete(scores[j], keys[j])
+    end)
+end
+
+
+print(("%s, %d ops per method, GC stopped while measuring"):format(
+    jit and jit.version or _VERSION, OPS))
+print(("%-8s %-9s %-20s %8s %12s %12s"):format(
+    "size", "impl", "method", "calls", "ns/call", "bytes/call"))
+for _, size in ipairs(sizes) do
+    run(size)
+end
@@ -1,13 +1,37 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "lauxlib.h"
 #include "lua.h"
 #include "skiplist.h"
+#include "skiplist_compact.h"
+#include "skiplist_shard.h"
 
-#define lzset_lua_newlibtable(L, l) \
-    lua_createtable(L, 0, sizeof(l) / sizeof((l)[0]) - 1)
+#if LUA_VERSION_NUM >= 502
+#define lzset_lua_rawlen lua_rawlen
+#else
+#define lzset_lua_rawlen lua_objlen
+#endif
+
+/* Every member type provides the following functions, used by
+ * lzset_impl.h to generate the methods of its sets:
+ *
+ *   compare, hash, size,  the callbacks of the skiplist
+ *   move
+ *   prefix                the node prefix of a member, see
+ *                         skiplistEnablePrefix()
+ *   release               free a member owned by the set
+ *   check                 read the member argument into a key, or raise
+ *   to                    the same, returning 0 instead of raising
+ *   copy                  make a member owned by the set out of a key
+ *   push_member           push a member
+ *   print_node            print an element, for dump()
+ *
+ * A key is the member as found on the Lua stack, it is only valid as long
+ * as the value is on the stack. */
 
 typedef struct lzset_string {
     size_t len;
@@ -26,7 +50,7 @@ static lzset_string *lzset_string_create(const char *data, size_t len) {
     return s;
 }
 
-static void lzset_string_free(void *s) {
+static void lzset_string_release(void *s) {
     free(((lzset_string *)s)->data);
     free(s);
 }
@@ -34,208 +58,553 @@ static void lzset_string_free(void *s) {
 static int lzset_string_compare(const void *a, const void *b) {
     const lzset_string *s1 = a, *s2 = b;
 
+    skiplistMetricsAdd(compares, 1);
+
     int cmp =
         memcmp(s1->data, s2->data, s1->len <= s2->len ? s1->len : s2->len);
 
     return cmp ? cmp : s1->len - s2->len;
 }
 
+/* FNV-1a, good enough for the member index. */
+static unsigned int lzset_string_hash(const void *a) {
+    const lzset_string *s = a;
+    unsigned int h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < s->len; i++) {
+        h ^= (unsigned char)s->data[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* The first 8 bytes of the string as a big-endian integer, zero padded, so
+ * that prefixes order as memcmp() does. Strings sharing them, or differing
+ * only by trailing zero bytes within them, are told apart by the full
+ * comparison. */
+static uint64_t lzset_string_prefix(const void *a) {
+    const lzset_string *s = a;
+    uint64_t p = 0;
+    size_t i;
+
+    for (i = 0; i < 8; i++) {
+        p = (p << 8) | (i < s->len ? (unsigned char)s->data[i] : 0);
+    }
+
+    return p;
+}
+
+static size_t lzset_string_size(const void *a) {
+    const lzset_string *s = a;
+
+    return sizeof(*s) + s->len + 1;
+}
+
+/* Copy a member to lzset_string_size() bytes at dst, its data right after
+ * it. */
+static void lzset_string_move(void *dst, const void *obj) {
+    const lzset_string *s = obj;
+    lzset_string *copy = dst;
+
+    copy->len = s->len;
+    copy->data = (char *)(copy + 1);
+    memcpy(copy->data, s->data, s->len + 1);
+}
+
+static void lzset_string_check(lua_State *L, int idx, lzset_string *key) {
+    luaL_checktype(L, idx, LUA_TSTRING);
+    key->data = (char *)lua_tolstring(L, idx, &key->len);
+}
+
+static int lzset_string_to(lua_State *L, int idx, lzset_string *key) {
+    if (lua_type(L, idx) != LUA_TSTRING) {
+        return 0;
+    }
+
+    key->data = (char *)lua_tolstring(L, idx, &key->len);
+
+    return 1;
+}
+
+static void *lzset_string_copy(const lzset_string *key) {
+    return lzset_string_create(key->data, key->len);
+}
+
+static void lzset_string_push_member(lua_State *L, const void *obj) {
+    const lzset_string *s = obj;
+    lua_pushlstring(L, s->data, s->len);
+}
+
+static int lzset_string_print_node(void *ctx, int index, double score,
+                                   void *obj) {
+    printf("(%d, %f, %s)\n", index, score, ((lzset_string *)obj)->data);
+
+    return 1;
+}
+
+static void lzset_number_release(void *obj) {
+    free(obj);
+}
+
 static int lzset_number_compare(const void *a, const void *b) {
     const double *n1 = (const double *)a;
     const double *n2 = (const double *)b;
 
+    skiplistMetricsAdd(compares, 1);
+
     return (*n1 < *n2) ? -1 : (*n1 > *n2);
 }
 
-static int lzset_number_insert(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    double score = luaL_checknumber(L, 2);
-    double d = luaL_checknumber(L, 3);
+static unsigned int lzset_number_hash(const void *a) {
+    double d = *(const double *)a;
+    uint64_t u;
 
-    double *p = malloc(sizeof(double));
-    *p = d;
+    /* 0.0 and -0.0 compare equal, so they must hash equal too. */
+    if (d == 0) {
+        d = 0;
+    }
 
-    skiplistInsert(sl, score, p);
+    memcpy(&u, &d, sizeof(u));
+    u ^= u >> 33;
+    u *= 0xff51afd7ed558ccdULL;
+    u ^= u >> 33;
 
-    return 0;
+    return (unsigned int)u;
 }
 
-static int lzset_string_insert(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    double score = luaL_checknumber(L, 2);
-    luaL_checktype(L, 3, LUA_TSTRING);
+/* The bits of the double mapped to an unsigned integer of the same order,
+ * -0.0 as 0.0: negative numbers get all their bits flipped, the others
+ * their sign bit set. The prefix is the whole member. */
+static uint64_t lzset_number_prefix(const void *a) {
+    double d = *(const double *)a;
+    uint64_t u;
 
-    size_t len;
-    const char *data = lua_tolstring(L, 3, &len);
-    lzset_string *s = lzset_string_create(data, len);
+    if (d == 0) {
+        d = 0;
+    }
 
-    skiplistInsert(sl, score, s);
+    memcpy(&u, &d, sizeof(u));
 
-    return 0;
+    return (u >> 63) ? ~u : u | 0x8000000000000000ULL;
 }
 
-static int lzset_number_delete(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    double score = luaL_checknumber(L, 2);
-    double d = luaL_checknumber(L, 3);
+static size_t lzset_number_size(const void *a) {
+    (void)a;
+
+    return sizeof(double);
+}
+
+static void lzset_number_move(void *dst, const void *obj) {
+    memcpy(dst, obj, sizeof(double));
+}
+
+static void lzset_number_check(lua_State *L, int idx, double *key) {
+    *key = luaL_checknumber(L, idx);
+}
 
-    lua_pushboolean(L, skiplistDelete(sl, score, &d));
+static int lzset_number_to(lua_State *L, int idx, double *key) {
+    if (lua_type(L, idx) != LUA_TNUMBER) {
+        return 0;
+    }
+
+    *key = lua_tonumber(L, idx);
 
     return 1;
 }
 
-static int lzset_string_delete(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    double score = luaL_checknumber(L, 2);
-    luaL_checktype(L, 3, LUA_TSTRING);
+static void *lzset_number_copy(const double *key) {
+    double *p = malloc(sizeof(double));
+    *p = *key;
+
+    return p;
+}
 
-    lzset_string s;
-    s.data = (char *)lua_tolstring(L, 3, &s.len);
+static void lzset_number_push_member(lua_State *L, const void *obj) {
+    lua_pushnumber(L, *(const double *)obj);
+}
 
-    lua_pushboolean(L, skiplistDelete(sl, score, &s));
+static int lzset_number_print_node(void *ctx, int index, double score,
+                                   void *obj) {
+    printf("(%d, %f, %f)\n", index, score, *(double *)obj);
 
     return 1;
 }
 
-static int lzset_number_update(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    double curscore = luaL_checknumber(L, 2);
-    double d = luaL_checknumber(L, 3);
-    double newscore = luaL_checknumber(L, 4);
+static void lzset_integer_release(void *obj) {
+    free(obj);
+}
 
-    skiplistUpdateScore(sl, curscore, &d, newscore);
+static int lzset_integer_compare(const void *a, const void *b) {
+    const int64_t *n1 = (const int64_t *)a;
+    const int64_t *n2 = (const int64_t *)b;
 
-    return 0;
+    skiplistMetricsAdd(compares, 1);
+
+    return (*n1 < *n2) ? -1 : (*n1 > *n2);
 }
 
-static int lzset_string_update(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    double curscore = luaL_checknumber(L, 2);
-    luaL_checktype(L, 3, LUA_TSTRING);
-    double newscore = luaL_checknumber(L, 4);
+static unsigned int lzset_integer_hash(const void *a) {
+    uint64_t u = *(const int64_t *)a;
 
-    lzset_string s;
-    s.data = (char *)lua_tolstring(L, 3, &s.len);
+    u ^= u >> 33;
+    u *= 0xff51afd7ed558ccdULL;
+    u ^= u >> 33;
 
-    skiplistUpdateScore(sl, curscore, &s, newscore);
+    return (unsigned int)u;
+}
 
-    return 0;
+/* The integer with its sign bit flipped, ordered as an unsigned one. */
+static uint64_t lzset_integer_prefix(const void *a) {
+    return (uint64_t)*(const int64_t *)a ^ 0x8000000000000000ULL;
 }
 
-static int lzset_number_at(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    unsigned int rank = luaL_checkinteger(L, 2);
-    skiplistNode *node = skiplistGetNodeByRank(sl, rank);
+static size_t lzset_integer_size(const void *a) {
+    (void)a;
 
-    if (node) {
-        lua_pushnumber(L, node->score);
-        lua_pushnumber(L, *(double *)(node->obj));
-        return 2;
-    }
+    return sizeof(int64_t);
+}
 
-    return 0;
+static void lzset_integer_move(void *dst, const void *obj) {
+    memcpy(dst, obj, sizeof(int64_t));
 }
 
-static int lzset_string_at(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    unsigned int rank = luaL_checkinteger(L, 2);
-    skiplistNode *node = skiplistGetNodeByRank(sl, rank);
+/* LuaJIT boxes 64-bit integers in cdata, a type its lua.h does not name. */
+#define LZSET_LUA_TCDATA 10
 
-    if (node) {
-        lzset_string *s = node->obj;
-        lua_pushnumber(L, node->score);
-        lua_pushlstring(L, s->data, s->len);
-        return 2;
+#if LUA_VERSION_NUM < 503
+/* Registry keys of the function making an int64_t cdata out of its high and
+ * low 32 bits and of the function telling whether a cdata is an int64_t or
+ * a uint64_t, set by luaopen_lzset_integer when the ffi module exists. */
+static char lzset_integer_box_key;
+static char lzset_integer_is64_key;
+
+/* Whether the cdata at the given index is an int64_t or a uint64_t, the
+ * only ones whose payload is read as a member. */
+static int lzset_integer_is64(lua_State *L, int idx) {
+    int is64;
+
+    if (idx < 0) {
+        idx = lua_gettop(L) + idx + 1;
     }
 
-    return 0;
+    lua_pushlightuserdata(L, &lzset_integer_is64_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 1);
+    is64 = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    return is64;
 }
+#endif
 
-static void lzset_number_delete_rank_cb(void *ctx, void *obj) {
-    lua_State *L = (lua_State *)ctx;
-    double *p = obj;
+/* Read the integer member at the given index: a Lua 5.3 integer, an
+ * int64_t (or uint64_t) cdata on LuaJIT, or a number with an integral
+ * value that fits. Returns 0 if the value is none of them. */
+static int lzset_integer_to(lua_State *L, int idx, int64_t *key) {
+    int type = lua_type(L, idx);
 
-    lua_pushvalue(L, 4);
-    lua_pushnumber(L, *p);
+#if LUA_VERSION_NUM < 503
+    if (type == LZSET_LUA_TCDATA) {
+        if (!lzset_integer_is64(L, idx)) {
+            return 0;
+        }
+        memcpy(key, lua_topointer(L, idx), sizeof(*key));
+        return 1;
+    }
+#endif
+
+    if (type != LUA_TNUMBER) {
+        return 0;
+    }
 
-    lua_call(L, 1, 0);
+#if LUA_VERSION_NUM >= 503
+    int isnum;
+    lua_Integer i = lua_tointegerx(L, idx, &isnum);
+    if (!isnum) {
+        return 0;
+    }
+    *key = i;
+#else
+    lua_Number d = lua_tonumber(L, idx);
+    if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0) ||
+        (lua_Number)(int64_t)d != d) {
+        return 0;
+    }
+    *key = (int64_t)d;
+#endif
+
+    return 1;
 }
 
-static void lzset_string_delete_rank_cb(void *ctx, void *obj) {
-    lua_State *L = (lua_State *)ctx;
-    lzset_string *s = obj;
+static void lzset_integer_check(lua_State *L, int idx, int64_t *key) {
+    if (!lzset_integer_to(L, idx, key)) {
+        luaL_argerror(L, idx, "integer expected");
+    }
+}
 
-    lua_pushvalue(L, 4);
-    lua_pushlstring(L, s->data, s->len);
+static void *lzset_integer_copy(const int64_t *key) {
+    int64_t *p = malloc(sizeof(int64_t));
+    *p = *key;
 
-    lua_call(L, 1, 0);
+    return p;
 }
 
-static int lzset_number_delete_range_by_rank(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    unsigned int start = luaL_checkinteger(L, 2);
-    unsigned int end = luaL_checkinteger(L, 3);
-    luaL_checktype(L, 4, LUA_TFUNCTION);
+/* Push an integer member. Before Lua 5.3 it is a number when exact, that
+ * is up to 2^53, and an int64_t cdata beyond if the ffi module exists. */
+static void lzset_integer_push(lua_State *L, int64_t v) {
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, v);
+#else
+    if (v >= -9007199254740992LL && v <= 9007199254740992LL) {
+        lua_pushnumber(L, (lua_Number)v);
+        return;
+    }
 
-    if (start > end) {
-        unsigned int tmp = start;
-        start = end;
-        end = tmp;
+    lua_pushlightuserdata(L, &lzset_integer_box_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushnumber(L, (lua_Number)v);
+        return;
     }
 
-    lua_pushinteger(L, skiplistDeleteRangeByRank(
-                           sl, start, end, lzset_number_delete_rank_cb, L));
+    lua_pushnumber(L, (lua_Number)(v >> 32));
+    lua_pushnumber(L, (lua_Number)(uint32_t)v);
+    lua_call(L, 2, 1);
+#endif
+}
+
+static void lzset_integer_push_member(lua_State *L, const void *obj) {
+    lzset_integer_push(L, *(const int64_t *)obj);
+}
+
+static int lzset_integer_print_node(void *ctx, int index, double score,
+                                    void *obj) {
+    printf("(%d, %f, %lld)\n", index, score, (long long)*(int64_t *)obj);
 
     return 1;
 }
 
-static int lzset_string_delete_range_by_rank(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    unsigned int start = luaL_checkinteger(L, 2);
-    unsigned int end = luaL_checkinteger(L, 3);
-    luaL_checktype(L, 4, LUA_TFUNCTION);
+typedef struct lzset_options {
+    unsigned long max_size;
+    int evict;
+    int sum;
+    unsigned long shard_size; // 0 for a set made of a single skiplist
+    int threads;
+    int compact; // whether the set is a skiplistCompact
+    int queue; // whether the set is a queue, see skiplistEnableQueue()
+} lzset_options;
+
+/* Read the constructor options table at the given index. It is parsed before
+ * the userdata is created, so that a bad option never leaves an
+ * uninitialized set behind for the __gc metamethod. */
+static void lzset_check_options(lua_State *L, int idx, lzset_options *opts) {
+    opts->max_size = 0;
+    opts->evict = SKIPLIST_EVICT_MIN;
+    opts->sum = 0;
+    opts->shard_size = 0;
+    opts->threads = 0;
+    opts->compact = 0;
+    opts->queue = 0;
+
+    if (lua_isnoneornil(L, idx)) {
+        return;
+    }
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    lua_getfield(L, idx, "max_size");
+    if (!lua_isnil(L, -1)) {
+        lua_Number n = lua_tonumber(L, -1);
+        if (!lua_isnumber(L, -1) || n < 0) {
+            luaL_error(L, "max_size must be a non-negative number");
+        }
+        opts->max_size = (unsigned long)n;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "evict");
+    if (!lua_isnil(L, -1)) {
+        const char *evict = lua_tostring(L, -1);
+        if (evict && strcmp(evict, "min") == 0) {
+            opts->evict = SKIPLIST_EVICT_MIN;
+        } else if (evict && strcmp(evict, "max") == 0) {
+            opts->evict = SKIPLIST_EVICT_MAX;
+        } else {
+            luaL_error(L, "evict must be \"min\" or \"max\"");
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "sum");
+    opts->sum = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "shard_size");
+    if (!lua_isnil(L, -1)) {
+        lua_Number n = lua_tonumber(L, -1);
+        if (!lua_isnumber(L, -1) || n < 0) {
+            luaL_error(L, "shard_size must be a non-negative number");
+        }
+        opts->shard_size = (unsigned long)n;
+    }
+    lua_pop(L, 1);
 
-    if (start > end) {
-        unsigned int tmp = start;
-        start = end;
-        end = tmp;
+    lua_getfield(L, idx, "threads");
+    if (!lua_isnil(L, -1)) {
+        lua_Number n = lua_tonumber(L, -1);
+        if (!lua_isnumber(L, -1) || n < 0 || n > 256) {
+            luaL_error(L, "threads must be a number between 0 and 256");
+        }
+        opts->threads = (int)n;
     }
+    lua_pop(L, 1);
 
-    lua_pushinteger(L, skiplistDeleteRangeByRank(
-                           sl, start, end, lzset_string_delete_rank_cb, L));
+    lua_getfield(L, idx, "compact");
+    opts->compact = lua_toboolean(L, -1);
+    lua_pop(L, 1);
 
-    return 1;
+    lua_getfield(L, idx, "queue");
+    opts->queue = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    if (opts->shard_size && (opts->max_size || opts->sum)) {
+        luaL_error(L, "shard_size cannot be combined with max_size or sum");
+    }
+
+    if (opts->compact && (opts->max_size || opts->sum || opts->shard_size)) {
+        luaL_error(L,
+                   "compact cannot be combined with max_size, sum or shard_size");
+    }
+
+    if (opts->queue && (opts->max_size || opts->sum || opts->shard_size ||
+                        opts->compact)) {
+        luaL_error(L, "queue cannot be combined with max_size, sum, "
+                      "shard_size or compact");
+    }
 }
 
-static int lzset_number_get_rank(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    double score = luaL_checknumber(L, 2);
-    double d = luaL_checknumber(L, 3);
+static void lzset_apply_options(skiplist *sl, const lzset_options *opts) {
+    skiplistSetMaxLength(sl, opts->max_size, opts->evict);
+    if (opts->sum) {
+        skiplistEnableSums(sl);
+    }
+}
 
-    unsigned long rank = skiplistGetRank(sl, score, &d);
-    if (rank == 0) {
+/* Evict the boundary element if the insertion made the set exceed its
+ * capacity, pushing its score and member. Returns the number of pushed
+ * values. */
+static int lzset_evict(lua_State *L, skiplist *sl,
+                       void (*push_member)(lua_State *, const void *)) {
+    double score;
+    void *obj = skiplistEvict(sl, &score);
+
+    if (obj == NULL) {
         return 0;
     }
 
-    lua_pushinteger(L, rank);
+    lua_pushnumber(L, score);
+    push_member(L, obj);
+    skiplistRelease(sl, obj);
 
-    return 1;
+    return 2;
+}
+
+/* Members can be given a time to live. An expired member is hidden from
+ * reads and treated as missing by every method addressing it by member;
+ * writes reclaim it on the spot, the others are reclaimed incrementally by
+ * expire_step(). Until then it still accounts for count() and ranks. */
+
+static double lzset_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-static int lzset_string_get_rank(lua_State *L) {
+/* A Lua function called with the member of every removed element. */
+typedef struct lzset_callback {
+    lua_State *L;
+    int idx; /* stack index of the function */
+} lzset_callback;
+
+/* Pop up to n elements from the head (or the tail) of the set, returning a
+ * flat array of score, member pairs in pop order. The pairs are pushed while
+ * walking from the end, then the whole range is unlinked at once, so the
+ * cost is a single rank descent plus O(1) per popped element. Expired
+ * elements met on the way are dropped as well, the optional function is
+ * called with each of them once the range is unlinked, so it may modify the
+ * set. */
+static int lzset_pop(lua_State *L, int tail,
+                     void (*push_member)(lua_State *, const void *)) {
     skiplist *sl = lua_touserdata(L, 1);
-    double score = luaL_checknumber(L, 2);
-    luaL_checktype(L, 3, LUA_TSTRING);
+    lua_Integer count = luaL_optinteger(L, 2, 1);
+    int has_cb = !lua_isnoneornil(L, 3);
 
-    lzset_string s;
-    s.data = (char *)lua_tolstring(L, 3, &s.len);
+    if (has_cb) {
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+    }
 
-    unsigned long rank = skiplistGetRank(sl, score, &s);
-    if (rank == 0) {
-        return 0;
+    unsigned long n = count > 0 ? (unsigned long)count : 0;
+    if (n > sl->length) {
+        n = sl->length;
     }
 
-    lua_pushinteger(L, rank);
+    lua_createtable(L, n * 2, 0);
+    if (has_cb) {
+        lua_newtable(L); /* the expired members, for the function */
+    }
+
+    skiplistNode *node = tail ? sl->tail : sl->header->level[0].forward;
+    double now = lzset_now();
+    int expired = skiplistHasExpired(sl, now);
+    unsigned long i = 0, popped = 0;
+    int idx = 0, dropped = 0, j;
+
+    /* Expired elements are removed along the way but not returned. */
+    while (node && i < n) {
+        if (!expired || !skiplistIsExpired(sl, node, now)) {
+            lua_pushnumber(L, node->score);
+            lua_rawseti(L, has_cb ? -3 : -2, ++idx);
+            push_member(L, node->obj);
+            lua_rawseti(L, has_cb ? -3 : -2, ++idx);
+            i++;
+        } else if (has_cb) {
+            push_member(L, node->obj);
+            lua_rawseti(L, -2, ++dropped);
+        }
+        popped++;
+        node = tail ? node->backward : node->level[0].forward;
+    }
+
+    if (popped > 0) {
+        if (tail) {
+            skiplistDeleteRangeByRank(sl, sl->length - popped + 1, sl->length,
+                                      NULL, NULL);
+        } else {
+            skiplistDeleteRangeByRank(sl, 1, popped, NULL, NULL);
+        }
+    }
+
+    skiplistMetricsAdd(returned, i);
+
+    if (has_cb) {
+        for (j = 1; j <= dropped; j++) {
+            lua_pushvalue(L, 3);
+            lua_rawgeti(L, -2, j);
+            lua_call(L, 1, 0);
+        }
+        lua_pop(L, 1);
+    }
 
     return 1;
 }
@@ -252,277 +621,1023 @@ static int lzset_get_score_rank(lua_State *L) {
     return 1;
 }
 
-static int lzset_number_get_range_by_rank(lua_State *L) {
+/* Return the sum of the scores and the number of elements with rank
+ * between r1 and r2. The set must be created with the sum option. */
+static int lzset_sum_by_rank(lua_State *L) {
     skiplist *sl = lua_touserdata(L, 1);
+    lua_Integer r1 = luaL_checkinteger(L, 2);
+    lua_Integer r2 = luaL_checkinteger(L, 3);
 
-    unsigned long r1 = luaL_checkinteger(L, 2);
-    unsigned long r2 = luaL_checkinteger(L, 3);
+    if (!sl->sums) {
+        return luaL_error(L, "sum option is not enabled");
+    }
 
-    int reverse, span;
-    if (r1 <= r2) {
-        reverse = 0;
-        span = r2 - r1 + 1;
-    } else {
-        reverse = 1;
-        span = r1 - r2 + 1;
+    if (r1 > r2) {
+        lua_Integer tmp = r1;
+        r1 = r2;
+        r2 = tmp;
     }
 
-    skiplistNode *node = skiplistGetNodeByRank(sl, r1);
+    if (r1 < 1) {
+        r1 = 1;
+    }
 
-    lua_createtable(L, span, 0);
+    if (r2 > (lua_Integer)sl->length) {
+        r2 = sl->length;
+    }
 
-    int n = 0;
-    while (node && n < span) {
-        lua_pushnumber(L, *(double *)node->obj);
-        lua_rawseti(L, -2, ++n);
-        node = reverse ? node->backward : node->level[0].forward;
+    if (r1 > r2) {
+        lua_pushnumber(L, 0);
+        lua_pushinteger(L, 0);
+        return 2;
     }
 
-    return 1;
+    lua_pushnumber(L, skiplistSumByRank(sl, r1, r2));
+    lua_pushinteger(L, r2 - r1 + 1);
+
+    return 2;
 }
 
-static int lzset_string_get_range_by_rank(lua_State *L) {
+/* Return the sum of the scores and the number of elements with a score
+ * between s1 and s2. The set must be created with the sum option. */
+static int lzset_sum_by_score(lua_State *L) {
     skiplist *sl = lua_touserdata(L, 1);
+    double s1 = luaL_checknumber(L, 2);
+    double s2 = luaL_checknumber(L, 3);
+    unsigned long count;
 
-    unsigned long r1 = luaL_checkinteger(L, 2);
-    unsigned long r2 = luaL_checkinteger(L, 3);
+    if (!sl->sums) {
+        return luaL_error(L, "sum option is not enabled");
+    }
 
-    int reverse, span;
-    if (r1 <= r2) {
-        reverse = 0;
-        span = r2 - r1 + 1;
-    } else {
-        reverse = 1;
-        span = r1 - r2 + 1;
+    if (s1 > s2) {
+        double tmp = s1;
+        s1 = s2;
+        s2 = tmp;
     }
 
-    skiplistNode *node = skiplistGetNodeByRank(sl, r1);
+    lua_pushnumber(L, skiplistSumByScore(sl, s1, s2, 0, 0, &count));
+    lua_pushinteger(L, count);
 
-    lua_createtable(L, span, 0);
+    return 2;
+}
 
-    int n = 0;
-    lzset_string *s;
-    while (node && n < span) {
-        s = node->obj;
-        lua_pushlstring(L, s->data, s->len);
-        lua_rawseti(L, -2, ++n);
-        node = reverse ? node->backward : node->level[0].forward;
+static int lzset_count_by_score(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double s1 = luaL_checknumber(L, 2);
+    double s2 = luaL_checknumber(L, 3);
+
+    if (s1 > s2) {
+        double tmp = s1;
+        s1 = s2;
+        s2 = tmp;
     }
 
+    lua_pushinteger(L, skiplistCountByScore(sl, s1, s2, 0, 0));
+
     return 1;
 }
 
-static int lzset_number_get_range_by_score(lua_State *L) {
+/* Push a new empty set with the type, options and metatable of the set at
+ * index 1. */
+static skiplist *lzset_new_like(lua_State *L, skiplist *sl) {
+    skiplist *dst = lua_newuserdata(L, sizeof(skiplist));
+
+    skiplistInitLike(dst, sl);
+
+    lua_getmetatable(L, 1);
+    lua_setmetatable(L, -2);
+
+    return dst;
+}
+
+/* Move the elements after the given rank to a new set of the same type and
+ * options, which is returned. The skiplist is cut in O(log n), only the
+ * member index entries and expire times are migrated per element. */
+static int lzset_split_at_rank(lua_State *L) {
     skiplist *sl = lua_touserdata(L, 1);
-    double s1 = luaL_checknumber(L, 2);
-    double s2 = luaL_checknumber(L, 3);
+    lua_Integer rank = luaL_checkinteger(L, 2);
 
-    int reverse;
-    skiplistNode *node;
+    skiplist *dst = lzset_new_like(L, sl);
+    skiplistSplit(sl, rank > 0 ? (unsigned long)rank : 0, dst);
 
-    if (s1 <= s2) {
-        reverse = 0;
-        node = skiplistFirstInRange(sl, s1, s2, 0, 0);
-    } else {
-        reverse = 1;
-        node = skiplistLastInRange(sl, s2, s1, 0, 0);
+    return 1;
+}
+
+/* The same for the elements with a score greater than the given one, or
+ * not less than it when ex is true. */
+static int lzset_split_at_score(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    int ex = lua_toboolean(L, 3);
+
+    skiplist *dst = lzset_new_like(L, sl);
+    skiplistSplit(sl, skiplistGetScoreRank(sl, score, ex), dst);
+
+    return 1;
+}
+
+/* Append the elements of another set of the same type and sum option,
+ * which must all come after the ones of the set and have no member in
+ * common with it, leaving the other set empty. Returns false, changing
+ * nothing, if they do not or if max_size would be exceeded. */
+static int lzset_concat(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    skiplist *other = lua_touserdata(L, 2);
+
+    if (other == NULL || other == sl || !lua_getmetatable(L, 2)) {
+        return luaL_argerror(L, 2, "another set expected");
     }
+    lua_getmetatable(L, 1);
+    if (!lua_rawequal(L, -1, -2)) {
+        return luaL_argerror(L, 2, "set of the same type expected");
+    }
+    lua_pop(L, 2);
 
-    lua_newtable(L);
-    int n = 0;
-    while (node) {
-        if (reverse) {
-            if (node->score < s2) {
-                break;
-            }
-        } else if (node->score > s2) {
-            break;
-        }
-        lua_pushnumber(L, *(double *)node->obj);
-        lua_rawseti(L, -2, ++n);
-        node = reverse ? node->backward : node->level[0].forward;
+    if (sl->sums != other->sums) {
+        return luaL_error(L, "sum option differs");
+    }
+
+    if (sl->maxlength && sl->length + other->length > sl->maxlength) {
+        lua_pushboolean(L, 0);
+        return 1;
     }
 
+    lua_pushboolean(L, skiplistConcat(sl, other));
+
     return 1;
 }
 
-static int lzset_string_get_range_by_score(lua_State *L) {
+/* A requested rank and its position in the argument table. */
+typedef struct lzset_rank_probe {
+    unsigned long rank;
+    size_t idx;
+} lzset_rank_probe;
+
+static int lzset_rank_probe_compare(const void *a, const void *b) {
+    const lzset_rank_probe *p1 = a, *p2 = b;
+
+    return (p1->rank < p2->rank) ? -1 : (p1->rank > p2->rank);
+}
+
+/* Look up the elements at all the ranks of the table argument (or at the
+ * nearest ranks of the quantiles in [0, 1] when quantiles is set). The
+ * ranks are sorted and resolved by skiplistGetNodesByRank in one pass,
+ * the result is { score1, member1, ... } in the order of the argument,
+ * with nil holes for the ranks out of range or expired. */
+static int lzset_at_many(lua_State *L, int quantiles,
+                         void (*push_member)(lua_State *, const void *)) {
     skiplist *sl = lua_touserdata(L, 1);
-    double s1 = luaL_checknumber(L, 2);
-    double s2 = luaL_checknumber(L, 3);
+    luaL_checktype(L, 2, LUA_TTABLE);
 
-    int reverse;
-    skiplistNode *node;
+    size_t n = lzset_lua_rawlen(L, 2), i;
 
-    if (s1 <= s2) {
-        reverse = 0;
-        node = skiplistFirstInRange(sl, s1, s2, 0, 0);
-    } else {
-        reverse = 1;
-        node = skiplistLastInRange(sl, s2, s1, 0, 0);
-    }
+    /* Scratch space is a userdata so that it is collected on errors. */
+    lzset_rank_probe *probes = lua_newuserdata(
+        L, n * (sizeof(lzset_rank_probe) + sizeof(unsigned long) +
+                sizeof(skiplistNode *)) + 1);
+    unsigned long *ranks = (unsigned long *)(probes + n);
+    skiplistNode **nodes = (skiplistNode **)(ranks + n);
 
-    lua_newtable(L);
-    int n = 0;
-    lzset_string *s;
-    while (node) {
-        if (reverse) {
-            if (node->score < s2) {
-                break;
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        if (!lua_isnumber(L, -1)) {
+            return luaL_error(L, "number expected at index %d", (int)i + 1);
+        }
+
+        unsigned long rank = 0;
+        if (quantiles) {
+            double q = lua_tonumber(L, -1);
+            if (!(q >= 0 && q <= 1)) {
+                return luaL_error(L, "quantile out of range at index %d",
+                                  (int)i + 1);
             }
-        } else if (node->score > s2) {
-            break;
+            /* nearest rank: ceil(q * length), at least 1 */
+            double r = q * sl->length;
+            rank = (unsigned long)r;
+            if (rank < r || rank == 0) {
+                rank++;
+            }
+        } else {
+            lua_Integer r = lua_tointeger(L, -1);
+            rank = r > 0 ? (unsigned long)r : 0;
         }
-        s = node->obj;
-        lua_pushlstring(L, s->data, s->len);
-        lua_rawseti(L, -2, ++n);
-        node = reverse ? node->backward : node->level[0].forward;
+        lua_pop(L, 1);
+
+        probes[i].rank = rank;
+        probes[i].idx = i;
+    }
+
+    qsort(probes, n, sizeof(*probes), lzset_rank_probe_compare);
+    for (i = 0; i < n; i++) {
+        ranks[i] = probes[i].rank;
+    }
+
+    skiplistGetNodesByRank(sl, ranks, nodes, n);
+
+    double now = lzset_now();
+    int expired = skiplistHasExpired(sl, now);
+
+    lua_createtable(L, n * 2, 0);
+    for (i = 0; i < n; i++) {
+        skiplistNode *node = nodes[i];
+        if (node == NULL || (expired && skiplistIsExpired(sl, node, now))) {
+            continue;
+        }
+        lua_pushnumber(L, node->score);
+        lua_rawseti(L, -2, probes[i].idx * 2 + 1);
+        push_member(L, node->obj);
+        lua_rawseti(L, -2, probes[i].idx * 2 + 2);
+        skiplistMetricsAdd(returned, 1);
     }
 
     return 1;
 }
 
-static int lzset_number_print_node(void *ctx, int index, double score,
-                                   void *obj) {
-    printf("(%d, %f, %f)\n", index, score, *(double *)obj);
+/* Return the memory used and the shape of the set, from counters kept up
+ * to date by insertions and deletions. */
+static int lzset_stats(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    skiplistStats stats;
+    int i;
+
+    skiplistGetStats(sl, &stats);
+
+    lua_createtable(L, 0, 7);
+
+    lua_pushinteger(L, sl->length);
+    lua_setfield(L, -2, "length");
+    lua_pushinteger(L, stats.nodebytes);
+    lua_setfield(L, -2, "node_bytes");
+    lua_pushinteger(L, stats.objbytes);
+    lua_setfield(L, -2, "member_bytes");
+    lua_pushinteger(L, stats.overhead);
+    lua_setfield(L, -2, "overhead_bytes");
+    lua_pushinteger(L, stats.level);
+    lua_setfield(L, -2, "level");
+    lua_pushnumber(L, stats.avgpath);
+    lua_setfield(L, -2, "avg_search_path");
+
+    lua_createtable(L, stats.level, 0);
+    for (i = 0; i < stats.level; i++) {
+        lua_pushinteger(L, stats.levels[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "levels");
 
     return 1;
 }
 
-static int lzset_string_print_node(void *ctx, int index, double score,
-                                   void *obj) {
-    printf("(%d, %f, %s)\n", index, score, ((lzset_string *)obj)->data);
+/* Move at most budget elements, with their members, to contiguous memory
+ * in rank order, resuming where the previous call stopped, see
+ * skiplistDefrag(). Returns true when the pass reached the last element. */
+static int lzset_defrag(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    lua_Integer budget = luaL_optinteger(L, 2, 100);
+
+    lua_pushboolean(L, skiplistDefrag(sl, budget > 0 ? budget : 0));
 
     return 1;
 }
 
-static int lzset_number_dump(lua_State *L) {
+/* Remove all the members in constant time, the nodes are kept for the next
+ * insertions, see skiplistClear(). */
+static int lzset_clear(lua_State *L) {
     skiplist *sl = lua_touserdata(L, 1);
 
-    skiplistIterate(sl, NULL, lzset_number_print_node);
+    skiplistClear(sl);
 
     return 0;
 }
 
-static int lzset_string_dump(lua_State *L) {
+static int lzset_count(lua_State *L) {
     skiplist *sl = lua_touserdata(L, 1);
+    lua_pushinteger(L, sl->length);
 
-    skiplistIterate(sl, NULL, lzset_string_print_node);
+    return 1;
+}
 
-    return 0;
+#ifdef SKIPLIST_METRICS
+#define LZSET_METRICS_METHODS 64
+#define LZSET_METRICS_BUCKETS 32
+
+/* Counters of a Lua method, shared by the number and string sets. */
+typedef struct lzset_method_metrics {
+    const char *name;
+    unsigned long long calls;
+    skiplistMetrics work;
+    /* latency[i] counts the calls that took less than 2^i nanoseconds and
+     * at least 2^(i-1) */
+    unsigned long long latency[LZSET_METRICS_BUCKETS];
+} lzset_method_metrics;
+
+static lzset_method_metrics lzset_metrics[LZSET_METRICS_METHODS];
+static int lzset_metrics_count;
+
+static int lzset_metrics_id(const char *name) {
+    int i;
+
+    for (i = 0; i < lzset_metrics_count; i++) {
+        if (strcmp(lzset_metrics[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    if (lzset_metrics_count == LZSET_METRICS_METHODS) {
+        return -1;
+    }
+
+    lzset_metrics[lzset_metrics_count].name = name;
+
+    return lzset_metrics_count++;
 }
 
-static int lzset_number_new(lua_State *L) {
-    skiplist *sl = lua_newuserdata(L, sizeof(skiplist));
+/* Call the method in upvalue 1 and account its latency and the work done
+ * by the skiplist to the counters of upvalue 2. */
+static int lzset_timed(lua_State *L) {
+    lzset_method_metrics *m =
+        &lzset_metrics[lua_tointeger(L, lua_upvalueindex(2))];
+    skiplistMetrics before = skiplistMetricsCounters;
+    struct timespec t0, t1;
+    int nargs = lua_gettop(L), bucket = 0;
 
-    skiplistInit(sl, lzset_number_compare, free);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
 
     lua_pushvalue(L, lua_upvalueindex(1));
-    lua_setmetatable(L, -2);
+    lua_insert(L, 1);
+    lua_call(L, nargs, LUA_MULTRET);
 
-    return 1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    unsigned long long ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+                            t1.tv_nsec - t0.tv_nsec;
+    while (bucket < LZSET_METRICS_BUCKETS - 1 && (ns >> bucket) > 0) {
+        bucket++;
+    }
+
+    m->calls++;
+    m->latency[bucket]++;
+    m->work.hops += skiplistMetricsCounters.hops - before.hops;
+    m->work.compares += skiplistMetricsCounters.compares - before.compares;
+    m->work.returned += skiplistMetricsCounters.returned - before.returned;
+
+    return lua_gettop(L);
+}
+
+/* Replace the methods of the table on the top of the stack by timed
+ * closures. */
+static void lzset_metrics_wrap(lua_State *L, const luaL_Reg *l) {
+    for (; l->name; l++) {
+        int id = lzset_metrics_id(l->name);
+        if (id < 0) {
+            continue;
+        }
+        lua_pushcfunction(L, l->func);
+        lua_pushinteger(L, id);
+        lua_pushcclosure(L, lzset_timed, 2);
+        lua_setfield(L, -2, l->name);
+    }
 }
 
-static int lzset_string_new(lua_State *L) {
-    skiplist *sl = lua_newuserdata(L, sizeof(skiplist));
+static void lzset_push_work(lua_State *L, const skiplistMetrics *work) {
+    lua_pushnumber(L, (lua_Number)work->hops);
+    lua_setfield(L, -2, "hops");
+    lua_pushnumber(L, (lua_Number)work->compares);
+    lua_setfield(L, -2, "compares");
+    lua_pushnumber(L, (lua_Number)work->returned);
+    lua_setfield(L, -2, "returned");
+}
+#endif
 
-    skiplistInit(sl, lzset_string_compare, lzset_string_free);
+/* Return the global counters, nil when built without SKIPLIST_METRICS:
+ * { hops, compares, returned, methods = { name = { calls, hops, compares,
+ * returned, latency = { ... } } } } */
+static int lzset_metrics_get(lua_State *L) {
+#ifdef SKIPLIST_METRICS
+    int i, j;
 
-    lua_pushvalue(L, lua_upvalueindex(1));
-    lua_setmetatable(L, -2);
+    lua_createtable(L, 0, 4);
+    lzset_push_work(L, &skiplistMetricsCounters);
+
+    lua_newtable(L);
+    for (i = 0; i < lzset_metrics_count; i++) {
+        lzset_method_metrics *m = &lzset_metrics[i];
+        if (m->calls == 0) {
+            continue;
+        }
+
+        lua_createtable(L, 0, 5);
+        lua_pushnumber(L, (lua_Number)m->calls);
+        lua_setfield(L, -2, "calls");
+        lzset_push_work(L, &m->work);
+
+        lua_createtable(L, LZSET_METRICS_BUCKETS, 0);
+        for (j = 0; j < LZSET_METRICS_BUCKETS; j++) {
+            lua_pushnumber(L, (lua_Number)m->latency[j]);
+            lua_rawseti(L, -2, j + 1);
+        }
+        lua_setfield(L, -2, "latency");
+
+        lua_setfield(L, -2, m->name);
+    }
+    lua_setfield(L, -2, "methods");
 
     return 1;
+#else
+    return 0;
+#endif
 }
 
-static int lzset_count(lua_State *L) {
-    skiplist *sl = lua_touserdata(L, 1);
-    lua_pushinteger(L, sl->length);
+static int lzset_metrics_reset(lua_State *L) {
+#ifdef SKIPLIST_METRICS
+    int i;
 
-    return 1;
+    memset(&skiplistMetricsCounters, 0, sizeof(skiplistMetricsCounters));
+    for (i = 0; i < lzset_metrics_count; i++) {
+        lzset_method_metrics *m = &lzset_metrics[i];
+        m->calls = 0;
+        memset(&m->work, 0, sizeof(m->work));
+        memset(m->latency, 0, sizeof(m->latency));
+    }
+#endif
+    (void)L;
+
+    return 0;
 }
 
+/* Large sets are freed in the background, so that collecting them does not
+ * stall the garbage collector. */
 static int lzset_release(lua_State *L) {
     skiplist *sl = lua_touserdata(L, 1);
 
-    skiplistFreeNodes(sl);
+    skiplistFreeNodesLazy(sl);
 
     return 0;
 }
 
-int luaopen_lzset_number(lua_State *L) {
-    luaL_Reg libs[] = {
-        {"insert", lzset_number_insert},
-        {"delete", lzset_number_delete},
-        {"update", lzset_number_update},
-        {"at", lzset_number_at},
-        {"count", lzset_count},
-        {"delete_range_by_rank", lzset_number_delete_range_by_rank},
-
-        {"get_rank", lzset_number_get_rank},
-        {"get_score_rank", lzset_get_score_rank},
-        {"get_range_by_rank", lzset_number_get_range_by_rank},
-        {"get_range_by_score", lzset_number_get_range_by_score},
-
-        {"dump", lzset_number_dump},
-        {NULL, NULL}};
+/* Sets created with the shard_size option are a skiplistShards, see
+ * skiplist_shard.h. Their methods are a subset of the ones of the other
+ * sets, without time to live, capacity or score sums. */
+
+static int lzset_shards_release(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+
+    skiplistShardsFreeShards(ss);
+
+    return 0;
+}
+
+static int lzset_shards_count(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    lua_pushinteger(L, ss->length);
+
+    return 1;
+}
+
+static int lzset_shards_get_score_rank(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    int ex = lua_toboolean(L, 3);
+
+    lua_pushinteger(L, skiplistShardsGetScoreRank(ss, score, ex));
+
+    return 1;
+}
+
+/* Return { { min = score, count = n }, ... }, the lowest score each shard
+ * may hold and its number of elements. */
+static int lzset_shards_info(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    int i;
+
+    lua_createtable(L, ss->count, 0);
+    for (i = 0; i < ss->count; i++) {
+        lua_createtable(L, 0, 2);
+        lua_pushnumber(L, ss->bounds[i]);
+        lua_setfield(L, -2, "min");
+        lua_pushinteger(L, ss->shards[i]->length);
+        lua_setfield(L, -2, "count");
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+/* Push a table of the members with a global rank between lo and hi, in
+ * reverse order when reverse is set. The shards gather their nodes in
+ * parallel, then the members are pushed. */
+static int lzset_shards_range(lua_State *L, skiplistShards *ss,
+                              unsigned long lo, unsigned long hi, int reverse,
+                              void (*push_member)(lua_State *, const void *)) {
+    unsigned long n = 0, i;
+
+    if (hi > ss->length) {
+        hi = ss->length;
+    }
+    if (lo < 1) {
+        lo = 1;
+    }
+
+    if (lo > hi) {
+        lua_newtable(L);
+        return 1;
+    }
+
+    /* Scratch space is a userdata so that it is collected on errors. */
+    skiplistNode **nodes =
+        lua_newuserdata(L, sizeof(skiplistNode *) * (hi - lo + 1));
+    n = skiplistShardsGetRange(ss, lo, hi, nodes);
+
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        push_member(L, nodes[reverse ? n - 1 - i : i]->obj);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    skiplistMetricsAdd(returned, n);
+
+    return 1;
+}
+
+/* Sets created with the compact option are a skiplistCompact, see
+ * skiplist_compact.h. Their methods are a subset of the ones of the other
+ * sets, without time to live, capacity, score sums or bulk operations. */
+
+static int lzset_compact_release(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+
+    skiplistCompactFreeNodes(sl);
+
+    return 0;
+}
+
+static int lzset_compact_count(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    lua_pushinteger(L, sl->length);
+
+    return 1;
+}
+
+static int lzset_compact_get_score_rank(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    int ex = lua_toboolean(L, 3);
+
+    lua_pushinteger(L, skiplistCompactGetScoreRank(sl, score, ex));
+
+    return 1;
+}
+
+/* Same as lzset_stats, member_bytes is always 0 as the compact sets do not
+ * track the size of their members. */
+static int lzset_compact_stats(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    skiplistStats stats;
+    int i;
+
+    skiplistCompactGetStats(sl, &stats);
+
+    lua_createtable(L, 0, 7);
+
+    lua_pushinteger(L, sl->length);
+    lua_setfield(L, -2, "length");
+    lua_pushinteger(L, stats.nodebytes);
+    lua_setfield(L, -2, "node_bytes");
+    lua_pushinteger(L, stats.objbytes);
+    lua_setfield(L, -2, "member_bytes");
+    lua_pushinteger(L, stats.overhead);
+    lua_setfield(L, -2, "overhead_bytes");
+    lua_pushinteger(L, stats.level);
+    lua_setfield(L, -2, "level");
+    lua_pushnumber(L, stats.avgpath);
+    lua_setfield(L, -2, "avg_search_path");
+
+    lua_createtable(L, stats.level, 0);
+    for (i = 0; i < stats.level; i++) {
+        lua_pushinteger(L, stats.levels[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "levels");
+
+    return 1;
+}
 
+/* Push a table of the members of the compact set from node x, following
+ * the backward or level 0 forward links for at most span nodes. */
+static int lzset_compact_range(lua_State *L, skiplistCompact *sl, uint32_t x,
+                               unsigned long span, int reverse,
+                               void (*push_member)(lua_State *, const void *)) {
+    unsigned long n = 0;
+
+    lua_createtable(L, x ? span : 0, 0);
+    while (x && n < span) {
+        push_member(L, sl->nodes[x].obj);
+        lua_rawseti(L, -2, ++n);
+        x = reverse ? sl->nodes[x].backward
+                    : skiplistCompactLevelOf(sl, x, 0).forward;
+    }
+
+    skiplistMetricsAdd(returned, n);
+
+    return 1;
+}
+
+#if LUA_VERSION_NUM < 503
+/* Register the int64_t constructor used by lzset_integer_push and the type
+ * check used by lzset_integer_to, if the ffi module can be loaded. */
+static void lzset_integer_open_box(lua_State *L) {
+    static const char code[] =
+        "local ok, ffi = pcall(require, 'ffi')\n"
+        "if not ok then return nil end\n"
+        "local int64, uint64 = ffi.typeof('int64_t'), ffi.typeof('uint64_t')\n"
+        "local istype = ffi.istype\n"
+        "return function(hi, lo) return int64(hi) * 4294967296 + lo end,\n"
+        "       function(v) return istype(int64, v) or istype(uint64, v) end\n";
+
+    if (luaL_loadstring(L, code) != 0 || lua_pcall(L, 0, 2, 0) != 0) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+
+    lua_pushlightuserdata(L, &lzset_integer_is64_key);
+    lua_insert(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, &lzset_integer_box_key);
+    lua_insert(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+#endif
+
+#define LZSET_NAME(f) lzset_number_##f
+#define LZSET_SKIPLIST(f) skiplistNumber##f
+#define LZSET_KEY double
+#include "lzset_impl.h"
+
+#define LZSET_NAME(f) lzset_string_##f
+#define LZSET_SKIPLIST(f) skiplistString##f
+#define LZSET_KEY lzset_string
+#include "lzset_impl.h"
+
+#define LZSET_NAME(f) lzset_integer_##f
+#define LZSET_SKIPLIST(f) skiplistInteger##f
+#define LZSET_KEY int64_t
+#include "lzset_impl.h"
+
+/* Push the metatable of sets with the given methods. */
+static void lzset_new_metatable(lua_State *L, const luaL_Reg *methods,
+                                lua_CFunction gc, lua_CFunction len) {
     lua_createtable(L, 0, 3);
 
+    lua_newtable(L);
 #if LUA_VERSION_NUM >= 502
-    luaL_newlib(L, libs);
+    luaL_setfuncs(L, methods, 0);
 #else
-    lzset_lua_newlibtable(L, libs);
-    luaL_register(L, NULL, libs);
+    luaL_register(L, NULL, methods);
+#endif
+
+#ifdef SKIPLIST_METRICS
+    lzset_metrics_wrap(L, methods);
 #endif
 
     lua_setfield(L, -2, "__index");
 
-    lua_pushcfunction(L, lzset_release);
+    lua_pushcfunction(L, gc);
     lua_setfield(L, -2, "__gc");
 
-    lua_pushcfunction(L, lzset_count);
+    lua_pushcfunction(L, len);
     lua_setfield(L, -2, "__len");
+}
+
+/* Registry key of a userdata collected when the state closes, whose
+ * finalizer stops the thread freeing large sets in the background: Lua
+ * unloads the module right after, and the thread runs its code. The sets
+ * collected later are freed on the spot. */
+static char lzset_lazy_key;
+
+static int lzset_lazy_stop(lua_State *L) {
+    (void)L;
+    skiplistFreeLazyStop();
+
+    return 0;
+}
+
+static void lzset_open_lazy(lua_State *L) {
+    lua_pushlightuserdata(L, &lzset_lazy_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+
+    lua_pushlightuserdata(L, &lzset_lazy_key);
+    lua_newuserdata(L, 1);
+    lua_newtable(L);
+    lua_pushcfunction(L, lzset_lazy_stop);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
 
-    lua_pushcclosure(L, lzset_number_new, 1);
+/* Return the constructor of a set type, whose sets have the given methods,
+ * the shard methods when created with the shard_size option, the compact
+ * methods when created with the compact option or the queue methods when
+ * created with the queue option. */
+static int lzset_open(lua_State *L, const luaL_Reg *methods,
+                      const luaL_Reg *shard_methods,
+                      const luaL_Reg *compact_methods,
+                      const luaL_Reg *queue_methods, lua_CFunction new) {
+    lzset_open_lazy(L);
+
+    lzset_new_metatable(L, methods, lzset_release, lzset_count);
+    lzset_new_metatable(L, shard_methods, lzset_shards_release,
+                        lzset_shards_count);
+    lzset_new_metatable(L, compact_methods, lzset_compact_release,
+                        lzset_compact_count);
+    lzset_new_metatable(L, queue_methods, lzset_release, lzset_count);
+
+    lua_pushcclosure(L, new, 4);
 
     return 1;
 }
 
-int luaopen_lzset_string(lua_State *L) {
-    luaL_Reg libs[] = {
-        {"insert", lzset_string_insert},
-        {"delete", lzset_string_delete},
-        {"update", lzset_string_update},
-        {"at", lzset_string_at},
-        {"count", lzset_count},
-        {"delete_range_by_rank", lzset_string_delete_range_by_rank},
-
-        {"get_rank", lzset_string_get_rank},
-        {"get_score_rank", lzset_get_score_rank},
-        {"get_range_by_rank", lzset_string_get_range_by_rank},
-        {"get_range_by_score", lzset_string_get_range_by_score},
-
-        {"dump", lzset_string_dump},
-        {NULL, NULL}};
+int luaopen_lzset_number(lua_State *L) {
+    return lzset_open(L, lzset_number_methods, lzset_number_shard_methods,
+                      lzset_number_compact_methods,
+                      lzset_number_queue_methods, lzset_number_new);
+}
 
-    lua_createtable(L, 0, 3);
+int luaopen_lzset_string(lua_State *L) {
+    return lzset_open(L, lzset_string_methods, lzset_string_shard_methods,
+                      lzset_string_compact_methods,
+                      lzset_string_queue_methods, lzset_string_new);
+}
 
-#if LUA_VERSION_NUM >= 502
-    luaL_newlib(L, libs);
-#else
-    lzset_lua_newlibtable(L, libs);
-    luaL_register(L, NULL, libs);
+int luaopen_lzset_integer(lua_State *L) {
+#if LUA_VERSION_NUM < 503
+    lzset_integer_open_box(L);
 #endif
 
-    lua_setfield(L, -2, "__index");
+    return lzset_open(L, lzset_integer_methods, lzset_integer_shard_methods,
+                      lzset_integer_compact_methods,
+                      lzset_integer_queue_methods, lzset_integer_new);
+}
 
-    lua_pushcfunction(L, lzset_release);
-    lua_setfield(L, -2, "__gc");
+/* LuaJIT FFI API, used by lzset_ffi.lua instead of the Lua C API above.
+ * Members are passed by address, as the keys of lzset_impl.h: a double for
+ * the number sets, an int64_t for the integer sets and an lzset_string for
+ * the string sets. The other operations are called directly in
+ * skiplist.h. */
+
+#define LZSET_FFI_NUMBER 0
+#define LZSET_FFI_STRING 1
+#define LZSET_FFI_INTEGER 2
+
+skiplist *lzset_ffi_new(int type, unsigned long max_size, int evict, int sum) {
+    skiplist *sl;
+
+    if (type == LZSET_FFI_NUMBER) {
+        sl = skiplistCreate(lzset_number_compare, lzset_number_release);
+        skiplistEnableIndex(sl, lzset_number_hash);
+        skiplistEnablePrefix(sl, lzset_number_prefix);
+        skiplistSetObjSize(sl, lzset_number_size);
+        skiplistSetObjMove(sl, lzset_number_move);
+    } else if (type == LZSET_FFI_INTEGER) {
+        sl = skiplistCreate(lzset_integer_compare, lzset_integer_release);
+        skiplistEnableIndex(sl, lzset_integer_hash);
+        skiplistEnablePrefix(sl, lzset_integer_prefix);
+        skiplistSetObjSize(sl, lzset_integer_size);
+        skiplistSetObjMove(sl, lzset_integer_move);
+    } else {
+        sl = skiplistCreate(lzset_string_compare, lzset_string_release);
+        skiplistEnableIndex(sl, lzset_string_hash);
+        skiplistEnablePrefix(sl, lzset_string_prefix);
+        skiplistSetObjSize(sl, lzset_string_size);
+        skiplistSetObjMove(sl, lzset_string_move);
+    }
 
-    lua_pushcfunction(L, lzset_count);
-    lua_setfield(L, -2, "__len");
+    lzset_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.max_size = max_size;
+    opts.evict = evict;
+    opts.sum = sum;
+    lzset_apply_options(sl, &opts);
+
+    return sl;
+}
+
+void lzset_ffi_free(skiplist *sl) {
+    skiplistFreeLazy(sl);
+}
+
+/* Release a member handed over by lzset_ffi_insert or lzset_ffi_incrby. */
+void lzset_ffi_release(skiplist *sl, void *obj) {
+    skiplistRelease(sl, obj);
+}
+
+static void *lzset_ffi_copy(skiplist *sl, const void *key) {
+    if (sl->compare == lzset_number_compare) {
+        return lzset_number_copy(key);
+    } else if (sl->compare == lzset_integer_compare) {
+        return lzset_integer_copy(key);
+    }
+
+    return lzset_string_copy(key);
+}
+
+/* Returns 0 if the member was not inserted, 1 if it was and 2 if another
+ * member was evicted, *evicted is NULL otherwise. The evicted member belongs
+ * to the caller, which must pass it to lzset_ffi_release once read. */
+int lzset_ffi_insert(skiplist *sl, double score, const void *key,
+                     double *evicted_score, void **evicted) {
+    *evicted = NULL;
+    if (skiplistWouldEvict(sl, score, (void *)key)) {
+        return 0;
+    }
+
+    void *obj = lzset_ffi_copy(sl, key);
+    if (skiplistInsert(sl, score, obj) == NULL) {
+        sl->release(obj);
+        return 0;
+    }
+
+    *evicted = skiplistEvict(sl, evicted_score);
+
+    return *evicted ? 2 : 1;
+}
+
+int lzset_ffi_score(skiplist *sl, const void *key, double *score) {
+    skiplistNode *node = skiplistFind(sl, (void *)key);
+
+    if (node == NULL) {
+        return 0;
+    }
 
-    lua_pushcclosure(L, lzset_string_new, 1);
+    *score = node->score;
 
     return 1;
 }
+
+/* Same results as lzset_ffi_insert, the new score and, when rank is not
+ * NULL, the new rank are stored on success. */
+int lzset_ffi_incrby(skiplist *sl, const void *key, double delta,
+                     double *score, unsigned long *rank, double *evicted_score,
+                     void **evicted) {
+    skiplistNode *node = skiplistFind(sl, (void *)key);
+
+    *evicted = NULL;
+    if (node) {
+        skiplistUpdateScoreRank(sl, node->score, node->obj,
+                                node->score + delta, rank);
+        *score = node->score;
+        return 1;
+    }
+
+    if (skiplistWouldEvict(sl, delta, (void *)key)) {
+        return 0;
+    }
+
+    node = skiplistInsert(sl, delta, lzset_ffi_copy(sl, key));
+    *score = node->score;
+    if (rank) {
+        *rank = skiplistGetRank(sl, node->score, node->obj);
+    }
+
+    *evicted = skiplistEvict(sl, evicted_score);
+
+    return *evicted ? 2 : 1;
+}
+
+/* Copy at most n elements from node on, stopping past bound when bounded.
+ * Any of scores, objs and members can be NULL, members receives the
+ * members of a number set. */
+static unsigned long lzset_ffi_walk(skiplistNode *node, int reverse,
+                                    unsigned long n, int bounded, double bound,
+                                    double *scores, void **objs,
+                                    double *members) {
+    unsigned long i = 0;
+
+    while (node && i < n) {
+        if (bounded && (reverse ? node->score < bound : node->score > bound)) {
+            break;
+        }
+        if (scores) {
+            scores[i] = node->score;
+        }
+        if (objs) {
+            objs[i] = node->obj;
+        }
+        if (members) {
+            members[i] = *(double *)node->obj;
+        }
+        i++;
+        node = reverse ? node->backward : node->level[0].forward;
+    }
+
+    return i;
+}
+
+/* Read the ranks r1 to r2, backward if r1 > r2, the buffers must have room
+ * for |r2 - r1| + 1 elements. Returns the number of elements read. */
+unsigned long lzset_ffi_range_by_rank(skiplist *sl, unsigned long r1,
+                                      unsigned long r2, double *scores,
+                                      void **objs) {
+    int reverse = r1 > r2;
+    unsigned long n = reverse ? r1 - r2 + 1 : r2 - r1 + 1;
+
+    return lzset_ffi_walk(skiplistGetNodeByRank(sl, r1), reverse, n, 0, 0,
+                          scores, objs, NULL);
+}
+
+unsigned long lzset_ffi_number_range_by_rank(skiplist *sl, unsigned long r1,
+                                             unsigned long r2, double *scores,
+                                             double *members) {
+    int reverse = r1 > r2;
+    unsigned long n = reverse ? r1 - r2 + 1 : r2 - r1 + 1;
+
+    return lzset_ffi_walk(skiplistGetNodeByRank(sl, r1), reverse, n, 0, 0,
+                          scores, NULL, members);
+}
+
+static skiplistNode *lzset_ffi_score_start(skiplist *sl, double s1,
+                                           double s2) {
+    return s1 <= s2 ? skiplistFirstInRange(sl, s1, s2, 0, 0)
+                    : skiplistLastInRange(sl, s2, s1, 0, 0);
+}
+
+/* Read at most n elements with a score from s1 to s2, backward if
+ * s1 > s2. Returns the number of elements read. */
+unsigned long lzset_ffi_range_by_score(skiplist *sl, double s1, double s2,
+                                       unsigned long n, double *scores,
+                                       void **objs) {
+    return lzset_ffi_walk(lzset_ffi_score_start(sl, s1, s2), s1 > s2, n, 1,
+                          s2, scores, objs, NULL);
+}
+
+/* Same as lzset_ffi_range_by_score, resuming right after the element
+ * after/key when key is not NULL, see get_range_by_score_step in
+ * lzset_impl.h. */
+unsigned long lzset_ffi_range_by_score_after(skiplist *sl, double s1,
+                                             double s2, unsigned long n,
+                                             double after, const void *key,
+                                             double *scores, void **objs) {
+    skiplistNode *node;
+
+    if (key == NULL) {
+        return lzset_ffi_range_by_score(sl, s1, s2, n, scores, objs);
+    }
+
+    node = skiplistLastBefore(sl, after, (void *)key);
+    if (s1 > s2) {
+        node = node == sl->header ? NULL : node;
+    } else {
+        node = node->level[0].forward;
+        if (node && node->score == after && sl->compare(node->obj, key) == 0) {
+            node = node->level[0].forward;
+        }
+    }
+
+    return lzset_ffi_walk(node, s1 > s2, n, 1, s2, scores, objs, NULL);
+}
+
+unsigned long lzset_ffi_number_range_by_score(skiplist *sl, double s1,
+                                              double s2, unsigned long n,
+                                              double *scores,
+                                              double *members) {
+    return lzset_ffi_walk(lzset_ffi_score_start(sl, s1, s2), s1 > s2, n, 1,
+                          s2, scores, NULL, members);
+}
+
+/* Read the elements of the n ascending ranks, objs[k] is NULL when ranks[k]
+ * is out of range. */
+void lzset_ffi_at_many(skiplist *sl, const unsigned long *ranks,
+                       unsigned long n, double *scores, void **objs) {
+    skiplistNode **nodes = malloc(n * sizeof(*nodes) + 1);
+    unsigned long i;
+
+    skiplistGetNodesByRank(sl, ranks, nodes, n);
+    for (i = 0; i < n; i++) {
+        scores[i] = nodes[i] ? nodes[i]->score : 0;
+        objs[i] = nodes[i] ? nodes[i]->obj : NULL;
+    }
+
+    free(nodes);
+}
+
+/* Store in ranks[k] the rank of the k-th of the n keys laid out every
+ * keysize bytes, 0 when it is missing. */
+void lzset_ffi_get_ranks(skiplist *sl, const void *keys, size_t keysize,
+                         unsigned long n, unsigned long *ranks) {
+    skiplistNode **nodes = malloc(n * sizeof(*nodes) + 1);
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        nodes[i] = skiplistFind(sl, (char *)keys + i * keysize);
+    }
+
+    skiplistGetRanks(sl, nodes, ranks, n);
+
+    free(nodes);
+}
@@ -0,0 +1,697 @@
+-- LuaJIT FFI binding of lzset, with the methods of lzset.number,
+-- lzset.string and lzset.integer so that any can be used by zset.lua:
+--
+--   local lzset_ffi = require "lzset_ffi"
+--   local zs = lzset_ffi.number({ max_size = 100 })
+--
+-- The calls go through the FFI, so the numeric paths stay compiled. Number
+-- sets can also read ranges into caller provided double buffers with
+-- get_range_by_rank_into and get_range_by_score_into.
+--
+-- Members do not expire: expire, ttl, persist and expire_step raise an
+-- error. metrics always returns nil.
+
+local ffi = require "ffi"
+
+
+local C = ffi.load(package.searchpath("lzset", package.cpath))
+
+local error = error
+local floor = math.floor
+local sort = table.sort
+local tonumber = tonumber
+local type = type
+
+
+ffi.cdef [[
+typedef struct skiplist skiplist;
+typedef struct skiplistNode skiplistNode;
+
+typedef struct lzset_string {
+    size_t len;
+    const char *data;
+} lzset_string;
+
+typedef struct skiplistStats {
+    size_t nodebytes;
+    size_t objbytes;
+    size_t overhead;
+    int level;
+    unsigned long levels[32];
+    double avgpath;
+} skiplistStats;
+
+typedef struct lzset_ffi_number { skiplist *sl; int sum; } lzset_ffi_number;
+typedef struct lzset_ffi_string { skiplist *sl; int sum; } lzset_ffi_string;
+typedef struct lzset_ffi_integer { skiplist *sl; int sum; } lzset_ffi_integer;
+
+unsigned long skiplistLength(skiplist *sl);
+int skiplistDelete(skiplist *sl, double score, const void *obj);
+skiplistNode *skiplistUpdateScore(skiplist *sl, double curscore,
+                                  const void *obj, double newscore);
+unsigned long skiplistDeleteRangeByRank(skiplist *sl, unsigned int start,
+                                        unsigned int end, void *cb,
+                                        void *ctx);
+unsigned long skiplistGetRank(skiplist *sl, double score, const void *obj);
+unsigned long skiplistGetScoreRank(skiplist *sl, double score, int ex);
+double skiplistSumByRank(skiplist *sl, unsigned long start,
+                         unsigned long end);
+double skiplistSumByScore(skiplist *sl, double min, double max, int minex,
+                          int maxex, unsigned long *count);
+unsigned long skiplistCountByScore(skiplist *sl, double min, double max,
+                                   int minex, int maxex);
+void skiplistGetStats(skiplist *sl, skiplistStats *stats);
+int skiplistDefrag(skiplist *sl, unsigned long budget);
+void skiplistClear(skiplist *sl);
+void skiplistFreeLazyStop(void);
+
+skiplist *lzset_ffi_new(int type, unsigned long max_size, int evict,
+                        int sum);
+void lzset_ffi_free(skiplist *sl);
+void lzset_ffi_release(skiplist *sl, void *obj);
+int lzset_ffi_insert(skiplist *sl, double score, const void *key,
+                     double *evicted_score, void **evicted);
+int lzset_ffi_score(skiplist *sl, const void *key, double *score);
+int lzset_ffi_incrby(skiplist *sl, const void *key, double delta,
+                     double *score, unsigned long *rank,
+                     double *evicted_score, void **evicted);
+unsigned long lzset_ffi_range_by_rank(skiplist *sl, unsigned long r1,
+                                      unsigned long r2, double *scores,
+                                      void **objs);
+unsigned long lzset_ffi_number_range_by_rank(skiplist *sl, unsigned long r1,
+                                             unsigned long r2,
+                                             double *scores,
+                                             double *members);
+unsigned long lzset_ffi_range_by_score(skiplist *sl, double s1, double s2,
+                                       unsigned long n, double *scores,
+                                       void **objs);
+unsigned long lzset_ffi_range_by_score_after(skiplist *sl, double s1,
+                                             double s2, unsigned long n,
+                                             double after, const void *key,
+                                             double *scores, void **objs);
+unsigned long lzset_ffi_number_range_by_score(skiplist *sl, double s1,
+                                              double s2, unsigned long n,
+                                              double *scores,
+                                              double *members);
+void lzset_ffi_at_many(skiplist *sl, const unsigned long *ranks,
+                       unsigned long n, double *scores, void **objs);
+void lzset_ffi_get_ranks(skiplist *sl, const void *keys, size_t keysize,
+                         unsigned long n, unsigned long *ranks);
+]]
+
+
+local TYPE_NUMBER, TYPE_STRING, TYPE_INTEGER = 0, 1, 2
+local EVICT = { min = 0, max = 1 }
+
+
+-- scratch space shared by all the sets, grown on demand
+local out_score = ffi.new("double[1]")
+local out_evicted_score = ffi.new("double[1]")
+local out_rank = ffi.new("unsigned long[1]")
+local out_obj = ffi.new("void *[1]")
+local number_key = ffi.new("double[1]")
+local string_key = ffi.new("lzset_string[1]")
+local integer_key = ffi.new("int64_t[1]")
+local int64_ctype, uint64_ctype = ffi.typeof("int64_t"), ffi.typeof("uint64_t")
+local scratch_size = 0
+local scratch_scores, scratch_objs, scratch_ranks
+
+local function scratch(n)
+    if n > scratch_size then
+        scratch_size = n < 64 and 64 or n
+        scratch_scores = ffi.new("double[?]", scratch_size)
+        scratch_objs = ffi.new("void *[?]", scratch_size)
+        scratch_ranks = ffi.new("unsigned long[?]", scratch_size)
+    end
+end
+
+
+local function check_number(n, what)
+    if type(n) ~= "number" then
+        error(what .. " must be a number", 3)
+    end
+    return n
+end
+
+
+local function number_key_of(member)
+    number_key[0] = check_number(member, "member")
+    return number_key
+end
+
+local function number_read(obj)
+    return ffi.cast("double *", obj)[0]
+end
+
+local function string_key_of(member)
+    if type(member) ~= "string" then
+        error("member must be a string", 3)
+    end
+    string_key[0].data = member
+    string_key[0].len = #member
+    return string_key
+end
+
+local function string_read(obj)
+    local s = ffi.cast("lzset_string *", obj)
+    return ffi.string(s.data, s.len)
+end
+
+
+-- only int64_t and uint64_t cdata are integers, the others would be
+-- converted or truncated
+local function is_int64(v)
+    return ffi.istype(int64_ctype, v) or ffi.istype(uint64_ctype, v)
+end
+
+
+local function integer_key_of(member)
+    local t = type(member)
+    if t == "number" then
+        if member % 1 ~= 0 then
+            error("member must be an integer", 3)
+        end
+    elseif t ~= "cdata" or not is_int64(member) then
+        error("member must be an integer", 3)
+    end
+    integer_key[0] = member
+    return integer_key
+end
+
+-- a number when exact, an int64_t cdata beyond 2^53 as lzset.integer
+local function integer_read(obj)
+    local v = ffi.cast("int64_t *", obj)[0]
+    if v >= -9007199254740992LL and v <= 9007199254740992LL then
+        return tonumber(v)
+    end
+    return v
+end
+
+
+local function new_methods(key_of, read, key_type)
+    local _M = {}
+
+    -- hand over an evicted member, see lzset_ffi_insert
+    local function evicted(self)
+        local member = read(out_obj[0])
+        C.lzset_ffi_release(self.sl, out_obj[0])
+        return out_evicted_score[0], member
+    end
+
+    -- read n elements from the scratch space into { score1, member1, ... }
+    local function pairs_of(n)
+        local t = {}
+        for i = 0, n - 1 do
+            t[2 * i + 1] = scratch_scores[i]
+            t[2 * i + 2] = read(scratch_objs[i])
+        end
+        return t
+    end
+
+    function _M.count(self)
+        return tonumber(C.skiplistLength(self.sl))
+    end
+
+    function _M.clear(self)
+        C.skiplistClear(self.sl)
+    end
+
+    function _M.insert(self, score, member)
+        local r = C.lzset_ffi_insert(self.sl, check_number(score, "score"),
+                                     key_of(member), out_evicted_score,
+                                     out_obj)
+        if r == 0 then
+            return false
+        elseif r == 2 then
+            return true, evicted(self)
+        end
+        return true
+    end
+
+    function _M.delete(self, score, member)
+        return C.skiplistDelete(self.sl, score, key_of(member)) == 1
+    end
+
+    function _M.update(self, curscore, member, newscore)
+        return C.skiplistUpdateScore(self.sl, curscore, key_of(member),
+                                     newscore) ~= nil
+    end
+
+    function _M.incrby(self, member, delta, with_rank)
+        local r = C.lzset_ffi_incrby(self.sl, key_of(member),
+                                     check_number(delta, "delta"), out_score,
+                                     with_rank and out_rank or nil,
+                                     out_evicted_score, out_obj)
+        if r == 0 then
+            return
+        end
+
+        local score = out_score[0]
+        local rank = with_rank and tonumber(out_rank[0]) or nil
+        if r == 2 then
+            return score, rank, evicted(self)
+        end
+        return score, rank
+    end
+
+    function _M.score(self, member)
+        if C.lzset_ffi_score(self.sl, key_of(member), out_score) ~= 0 then
+            return out_score[0]
+        end
+    end
+
+    function _M.at(self, rank)
+        if rank < 1 then
+            return
+        end
+        scratch(1)
+        if C.lzset_ffi_range_by_rank(self.sl, rank, rank, scratch_scores,
+                                     scratch_objs) == 0 then
+            return
+        end
+        return scratch_scores[0], read(scratch_objs[0])
+    end
+
+    function _M.get_rank(self, score, member)
+        local rank = C.skiplistGetRank(self.sl, score, key_of(member))
+        if rank == 0 then
+            return
+        end
+        return tonumber(rank)
+    end
+
+    function _M.get_score_rank(self, score, ex)
+        return tonumber(C.skiplistGetScoreRank(self.sl, score, ex and 1 or 0))
+    end
+
+    local function read_range(self, r1, r2)
+        local len = _M.count(self)
+        if r1 < 1 or r1 > len then
+            return 0
+        end
+        if r2 > len then
+            r2 = len
+        elseif r2 < 1 then
+            r2 = 1
+        end
+        scratch(r1 > r2 and r1 - r2 + 1 or r2 - r1 + 1)
+        return tonumber(C.lzset_ffi_range_by_rank(self.sl, r1, r2,
+                                                  scratch_scores,
+                                                  scratch_objs))
+    end
+
+    function _M.delete_range_by_rank(self, r1, r2, cb)
+        if r1 > r2 then
+            r1, r2 = r2, r1
+        end
+
+        local members
+        if cb then
+            local n = read_range(self, r1 < 1 and 1 or r1, r2)
+            members = {}
+            for i = 0, n - 1 do
+                members[i + 1] = read(scratch_objs[i])
+            end
+        end
+
+        local removed = tonumber(C.skiplistDeleteRangeByRank(self.sl, r1, r2,
+                                                             nil, nil))
+        if cb then
+            for i = 1, #members do
+                cb(members[i])
+            end
+        end
+        return removed
+    end
+
+    function _M.delete_range_by_rank_step(self, r1, r2, budget, cb)
+        if r1 > r2 then
+            r1, r2 = r2, r1
+        end
+        if r1 < 1 then
+            r1 = 1
+        end
+        budget = budget or 100
+        if budget < 1 then
+            budget = 1
+        end
+
+        local last = r2 - r1 >= budget and r1 + budget - 1 or r2
+        local removed = r2 < 1 and 0
+            or _M.delete_range_by_rank(self, r1, last, cb)
+        if last == r2 or removed < last - r1 + 1 then
+            return removed
+        end
+        return removed, r2 - removed
+    end
+
+    local function pop(self, n, tail)
+        n = n or 1
+        local len = _M.count(self)
+        if n > len then n = len end
+        if n < 1 then
+            return {}
+        end
+
+        local t = pairs_of(tail and read_range(self, len, len - n + 1)
+                               or read_range(self, 1, n))
+        if tail then
+            C.skiplistDeleteRangeByRank(self.sl, len - n + 1, len, nil, nil)
+        else
+            C.skiplistDeleteRangeByRank(self.sl, 1, n, nil, nil)
+        end
+        return t
+    end
+
+    function _M.pop_min(self, n)
+        return pop(self, n, false)
+    end
+
+    function _M.pop_max(self, n)
+        return pop(self, n, true)
+    end
+
+    function _M.get_range_by_rank(self, r1, r2)
+        local t = {}
+        for i = 0, read_range(self, r1, r2) - 1 do
+            t[i + 1] = read(scratch_objs[i])
+        end
+        return t
+    end
+
+    function _M.get_range_by_score(self, s1, s2)
+        local n = _M.count_by_score(self, s1, s2)
+        scratch(n)
+        n = tonumber(C.lzset_ffi_range_by_score(self.sl, s1, s2, n, nil,
+                                                scratch_objs))
+        local t = {}
+        for i = 0, n - 1 do
+            t[i + 1] = read(scratch_objs[i])
+        end
+        return t
+    end
+
+    -- one more element than the budget is read to tell whether the range
+    -- goes on
+    function _M.get_range_by_score_step(self, s1, s2, budget, after, member)
+        budget = budget or 100
+        if budget < 1 then
+            budget = 1
+        end
+        scratch(budget + 1)
+        local n = tonumber(C.lzset_ffi_range_by_score_after(
+            self.sl, s1, s2, budget + 1, after or 0,
+            after and key_of(member) or nil, scratch_scores, scratch_objs))
+        local t = {}
+        for i = 0, (n > budget and budget or n) - 1 do
+            t[i + 1] = read(scratch_objs[i])
+        end
+        if n <= budget then
+            return t
+        end
+        return t, scratch_scores[budget - 1], read(scratch_objs[budget - 1])
+    end
+
+    function _M.count_by_score(self, s1, s2)
+        if s1 > s2 then
+            s1, s2 = s2, s1
+        end
+        return tonumber(C.skiplistCountByScore(self.sl, s1, s2, 0, 0))
+    end
+
+    function _M.sum_by_rank(self, r1, r2)
+        if self.sum == 0 then
+            error("sum option is not enabled", 2)
+        end
+        if r1 > r2 then
+            r1, r2 = r2, r1
+        end
+        local len = _M.count(self)
+        if r1 < 1 then r1 = 1 end
+        if r2 > len then r2 = len end
+        if r1 > r2 then
+            return 0, 0
+        end
+        return C.skiplistSumByRank(self.sl, r1, r2), r2 - r1 + 1
+    end
+
+    function _M.sum_by_score(self, s1, s2)
+        if self.sum == 0 then
+            error("sum option is not enabled", 2)
+        end
+        if s1 > s2 then
+            s1, s2 = s2, s1
+        end
+        local sum = C.skiplistSumByScore(self.sl, s1, s2, 0, 0, out_rank)
+        return sum, tonumber(out_rank[0])
+    end
+
+    -- ranks in any order, resolved in one pass, see lzset_at_many
+    local function at_ranks(self, ranks)
+        local n = #ranks
+        local order = {}
+        for i = 1, n do
+            order[i] = i
+        end
+        sort(order, function(a, b) return ranks[a] < ranks[b] end)
+
+        scratch(n)
+        for i = 1, n do
+            local rank = ranks[order[i]]
+            scratch_ranks[i - 1] = rank > 0 and rank or 0
+        end
+        C.lzset_ffi_at_many(self.sl, scratch_ranks, n, scratch_scores,
+                            scratch_objs)
+
+        local t = {}
+        for i = 1, n do
+            local obj = scratch_objs[i - 1]
+            if obj ~= nil then
+                local idx = order[i]
+                t[2 * idx - 1] = scratch_scores[i - 1]
+                t[2 * idx] = read(obj)
+            end
+        end
+        return t
+    end
+
+    function _M.at_many(self, ranks)
+        local r = {}
+        for i = 1, #ranks do
+            r[i] = floor(check_number(ranks[i], "rank"))
+        end
+        return at_ranks(self, r)
+    end
+
+    function _M.quantiles(self, qs)
+        local len = _M.count(self)
+        local r = {}
+        for i = 1, #qs do
+            local q = check_number(qs[i], "quantile")
+            if not (q >= 0 and q <= 1) then
+                error("quantile out of range at index " .. i, 2)
+            end
+            local rank = math.ceil(q * len)
+            r[i] = (rank < 1 and len > 0) and 1 or rank
+        end
+        return at_ranks(self, r)
+    end
+
+    function _M.get_ranks(self, members)
+        local n, idx = #members, {}
+        local keys = ffi.new(key_type .. "[?]", n + 1)
+        local m = 0
+        for i = 1, n do
+            local member = members[i]
+            if (key_type == "double" and type(member) == "number")
+                or (key_type == "lzset_string" and type(member) == "string")
+                or (key_type == "int64_t" and (is_int64(member)
+                    or (type(member) == "number" and member % 1 == 0)))
+            then
+                keys[m] = key_of(member)[0]
+                m = m + 1
+                idx[m] = i
+            end
+        end
+
+        scratch(m)
+        C.lzset_ffi_get_ranks(self.sl, keys, ffi.sizeof(key_type), m,
+                              scratch_ranks)
+
+        local t = {}
+        for i = 1, m do
+            local rank = scratch_ranks[i - 1]
+            if rank > 0 then
+                t[idx[i]] = tonumber(rank)
+            end
+        end
+        return t
+    end
+
+    function _M.around(self, member, before, after)
+        local score = _M.score(self, member)
+        if not score then
+            return
+        end
+        local rank = _M.get_rank(self, score, member)
+        local first = rank - (before or 0)
+        if first < 1 then first = 1 end
+        local last = rank + ((after and after > 0) and after or 0)
+        return first, pairs_of(read_range(self, first, last))
+    end
+
+    function _M.stats(self)
+        local st = ffi.new("skiplistStats")
+        C.skiplistGetStats(self.sl, st)
+        local levels = {}
+        for i = 1, st.level do
+            levels[i] = tonumber(st.levels[i - 1])
+        end
+        return {
+            length = _M.count(self),
+            node_bytes = tonumber(st.nodebytes),
+            member_bytes = tonumber(st.objbytes),
+            overhead_bytes = tonumber(st.overhead),
+            level = st.level,
+            avg_search_path = st.avgpath,
+            levels = levels,
+        }
+    end
+
+    function _M.defrag(self, budget)
+        budget = budget or 100
+        if budget < 0 then
+            budget = 0
+        end
+        return C.skiplistDefrag(self.sl, budget) == 1
+    end
+
+    local function unsupported()
+        error("members do not expire in lzset_ffi", 2)
+    end
+
+    _M.expire = unsupported
+    _M.ttl = unsupported
+    _M.persist = unsupported
+    _M.expire_step = unsupported
+
+    function _M.metrics()
+    end
+
+    function _M.reset_metrics()
+    end
+
+    function _M.dump(self)
+        local n = read_range(self, 1, _M.count(self))
+        for i = 0, n - 1 do
+            print(i + 1, scratch_scores[i], read(scratch_objs[i]))
+        end
+    end
+
+    function _M.dump_step(self, budget, rank)
+        budget = budget or 100
+        rank = rank or 1
+        if rank < 1 then
+            rank = 1
+        end
+        local len = _M.count(self)
+        local last = rank + budget - 1
+        if last > len then
+            last = len
+        end
+        local n = last >= rank and read_range(self, rank, last) or 0
+        for i = 0, n - 1 do
+            print(rank + i, scratch_scores[i], read(scratch_objs[i]))
+        end
+        if rank + n <= len then
+            return rank + n
+        end
+    end
+
+    return _M
+end
+
+
+local number_methods = new_methods(number_key_of, number_read, "double")
+local string_methods = new_methods(string_key_of, string_read,
+                                   "lzset_string")
+local integer_methods = new_methods(integer_key_of, integer_read, "int64_t")
+
+
+-- Read the ranks r1 to r2 of a number set into the scores and members
+-- double buffers, which need room for |r2 - r1| + 1 elements (either can
+-- be nil). Returns the number of elements read.
+function number_methods.get_range_by_rank_into(self, r1, r2, scores,
+                                               members)
+    if r1 < 1 or r2 < 1 then
+        return 0
+    end
+    return tonumber(C.lzset_ffi_number_range_by_rank(self.sl, r1, r2, scores,
+                                                     members))
+end
+
+
+-- Same with at most n elements with a score from s1 to s2.
+function number_methods.get_range_by_score_into(self, s1, s2, n, scores,
+                                                members)
+    return tonumber(C.lzset_ffi_number_range_by_score(self.sl, s1, s2, n,
+                                                      scores, members))
+end
+
+
+local function gc(self)
+    if self.sl ~= nil then
+        C.lzset_ffi_free(self.sl)
+        self.sl = nil
+    end
+end
+
+
+-- large sets are freed by a background thread running code of the library,
+-- stop it when the state closes: this userdata is newer than the library
+-- namespace, so it is finalized first
+local lazy_guard = newproxy(true)
+getmetatable(lazy_guard).__gc = function()
+    C.skiplistFreeLazyStop()
+end
+
+local number_ct = ffi.metatype("lzset_ffi_number", {
+    __index = number_methods, __len = number_methods.count, __gc = gc,
+})
+local string_ct = ffi.metatype("lzset_ffi_string", {
+    __index = string_methods, __len = string_methods.count, __gc = gc,
+})
+local integer_ct = ffi.metatype("lzset_ffi_integer", {
+    __index = integer_methods, __len = integer_methods.count, __gc = gc,
+})
+
+
+-- opts: { max_size = n, evict = "min" | "max", sum = true }, see lzset.c
+local function new(ct, typ, opts)
+    local max_size, evict, sum = 0, 0, 0
+    if opts ~= nil then
+        if opts.max_size ~= nil then
+            max_size = opts.max_size
+            if type(max_size) ~= "number" or max_size < 0 then
+                error("max_size must be a non-negative number", 3)
+            end
+        end
+        if opts.evict ~= nil then
+            evict = EVICT[opts.evict]
+            if not evict then
+                error("evict must be \"min\" or \"max\"", 3)
+            end
+        end
+        sum = opts.sum and 1 or 0
+    end
+
+    return ct(C.lzset_ffi_new(typ, max_size, evict, sum), sum)
+end
+
+
+return {
+    number = function(opts) return new(number_ct, TYPE_NUMBER, opts) end,
+    string = function(opts) return new(string_ct, TYPE_STRING, opts) end,
+    integer = function(opts) return new(integer_ct, TYPE_INTEGER, opts) end,
+    _lazy_guard = lazy_guard,
+}
@@ -0,0 +1,1326 @@
+/* Methods of a set type, included by lzset.c once per member type with the
+ * following macros defined:
+ *
+ *   LZSET_NAME(f)      name of the function f of the type, lzset_number_##f
+ *   LZSET_SKIPLIST(f)  name of the skiplist operation f specialized for the
+ *                      type, e.g. skiplistNumber##f
+ *   LZSET_KEY          C type of a key, see lzset.c
+ *
+ * The skiplist operations comparing members are instantiated from
+ * skiplist_impl.h with the compare, hash and prefix functions of the type,
+ * so the compiler can inline them in the descents. The methods are
+ * collected in LZSET_NAME(methods) and the constructor is LZSET_NAME(new). */
+
+#define SKIPLIST_NAME LZSET_SKIPLIST
+#define SKIPLIST_COMPARE(sl, a, b) LZSET_NAME(compare)(a, b)
+#define SKIPLIST_HASH(sl, obj) LZSET_NAME(hash)(obj)
+#define SKIPLIST_PREFIX(sl, obj) LZSET_NAME(prefix)(obj)
+#define SKIPLIST_API static inline
+#include "skiplist_impl.h"
+
+/* Find the node of a member, hiding it if it has expired. */
+static skiplistNode *LZSET_NAME(find)(skiplist *sl, LZSET_KEY *key) {
+    skiplistNode *node = LZSET_SKIPLIST(Find)(sl, key);
+
+    if (node && sl->expires && skiplistIsExpired(sl, node, lzset_now())) {
+        return NULL;
+    }
+
+    return node;
+}
+
+/* Remove the member if it has expired. Returns 1 if it was removed. */
+static int LZSET_NAME(reclaim)(skiplist *sl, LZSET_KEY *key) {
+    skiplistNode *node;
+
+    if (!sl->expires || !skiplistHasExpired(sl, lzset_now())) {
+        return 0;
+    }
+
+    node = LZSET_SKIPLIST(Find)(sl, key);
+    if (node && skiplistIsExpired(sl, node, lzset_now())) {
+        return LZSET_SKIPLIST(Delete)(sl, node->score, node->obj);
+    }
+
+    return 0;
+}
+
+static int LZSET_NAME(insert)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    LZSET_NAME(reclaim)(sl, &key);
+
+    if (LZSET_SKIPLIST(WouldEvict)(sl, score, &key)) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    void *obj = LZSET_NAME(copy)(&key);
+
+    if (LZSET_SKIPLIST(Insert)(sl, score, obj) == NULL) {
+        LZSET_NAME(release)(obj);
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1 + lzset_evict(L, sl, LZSET_NAME(push_member));
+}
+
+static int LZSET_NAME(delete)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    lua_pushboolean(L, !LZSET_NAME(reclaim)(sl, &key) &&
+                           LZSET_SKIPLIST(Delete)(sl, score, &key));
+
+    return 1;
+}
+
+static int LZSET_NAME(update)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double curscore = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+    double newscore = luaL_checknumber(L, 4);
+
+    lua_pushboolean(L, !LZSET_NAME(reclaim)(sl, &key) &&
+                           LZSET_SKIPLIST(UpdateScore)(sl, curscore, &key,
+                                                       newscore));
+
+    return 1;
+}
+
+/* Add delta to the score of an existing element, relinking its node in
+ * place. Pushes the new score and, when asked for, the new rank. */
+static int LZSET_NAME(incrby_existing)(lua_State *L, skiplist *sl,
+                                       skiplistNode *node, double delta,
+                                       int with_rank) {
+    unsigned long rank;
+
+    LZSET_SKIPLIST(UpdateScoreRank)(sl, node->score, node->obj,
+                                    node->score + delta,
+                                    with_rank ? &rank : NULL);
+
+    lua_pushnumber(L, node->score);
+    if (!with_rank) {
+        return 1;
+    }
+
+    lua_pushinteger(L, rank);
+
+    return 2;
+}
+
+/* Push the result of an incrby that created the element: the new score,
+ * the rank when asked for (nil otherwise) and the evicted element if the
+ * insertion made the set exceed its capacity. */
+static int LZSET_NAME(incrby_inserted)(lua_State *L, skiplist *sl,
+                                       skiplistNode *node, int with_rank) {
+    double score;
+    void *obj = skiplistEvict(sl, &score);
+
+    lua_pushnumber(L, node->score);
+    if (with_rank) {
+        lua_pushinteger(L, LZSET_SKIPLIST(GetRank)(sl, node->score,
+                                                   node->obj));
+    } else if (obj == NULL) {
+        return 1;
+    } else {
+        lua_pushnil(L);
+    }
+
+    if (obj == NULL) {
+        return 2;
+    }
+
+    lua_pushnumber(L, score);
+    LZSET_NAME(push_member)(L, obj);
+    skiplistRelease(sl, obj);
+
+    return 4;
+}
+
+static int LZSET_NAME(incrby)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 2, &key);
+    double delta = luaL_checknumber(L, 3);
+    int with_rank = lua_toboolean(L, 4);
+
+    LZSET_NAME(reclaim)(sl, &key);
+
+    skiplistNode *node = LZSET_SKIPLIST(Find)(sl, &key);
+    if (node) {
+        return LZSET_NAME(incrby_existing)(L, sl, node, delta, with_rank);
+    }
+
+    if (LZSET_SKIPLIST(WouldEvict)(sl, delta, &key)) {
+        return 0;
+    }
+
+    node = LZSET_SKIPLIST(Insert)(sl, delta, LZSET_NAME(copy)(&key));
+
+    return LZSET_NAME(incrby_inserted)(L, sl, node, with_rank);
+}
+
+static int LZSET_NAME(score)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 2, &key);
+
+    skiplistNode *node = LZSET_NAME(find)(sl, &key);
+    if (node == NULL) {
+        return 0;
+    }
+
+    lua_pushnumber(L, node->score);
+
+    return 1;
+}
+
+static int LZSET_NAME(at)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    unsigned int rank = luaL_checkinteger(L, 2);
+    skiplistNode *node = skiplistGetNodeByRank(sl, rank);
+
+    if (node && !(sl->expires && skiplistIsExpired(sl, node, lzset_now()))) {
+        lua_pushnumber(L, node->score);
+        LZSET_NAME(push_member)(L, node->obj);
+        return 2;
+    }
+
+    return 0;
+}
+
+static void LZSET_NAME(delete_cb)(void *ctx, void *obj) {
+    lzset_callback *cb = ctx;
+
+    lua_pushvalue(cb->L, cb->idx);
+    LZSET_NAME(push_member)(cb->L, obj);
+
+    lua_call(cb->L, 1, 0);
+}
+
+static int LZSET_NAME(delete_range_by_rank)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    unsigned int start = luaL_checkinteger(L, 2);
+    unsigned int end = luaL_checkinteger(L, 3);
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    if (start > end) {
+        unsigned int tmp = start;
+        start = end;
+        end = tmp;
+    }
+
+    lzset_callback cb = {L, 4};
+
+    lua_pushinteger(L, skiplistDeleteRangeByRank(sl, start, end,
+                                                 LZSET_NAME(delete_cb), &cb));
+
+    return 1;
+}
+
+/* Same as delete_range_by_rank, deleting at most budget elements (100 by
+ * default) with an optional callback, called once the elements are
+ * unlinked. Returns the number deleted and, when elements of the range are
+ * left, the end rank to pass to the next call: the range shrinks as its
+ * first elements go. */
+static int LZSET_NAME(delete_range_by_rank_step)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    lua_Integer start = luaL_checkinteger(L, 2);
+    lua_Integer end = luaL_checkinteger(L, 3);
+    lua_Integer budget = luaL_optinteger(L, 4, 100);
+    int has_cb = !lua_isnoneornil(L, 5);
+    unsigned long removed = 0, i;
+
+    if (has_cb) {
+        luaL_checktype(L, 5, LUA_TFUNCTION);
+    }
+
+    if (start > end) {
+        lua_Integer tmp = start;
+        start = end;
+        end = tmp;
+    }
+    if (start < 1) {
+        start = 1;
+    }
+    if (budget < 1) {
+        budget = 1;
+    }
+
+    lua_Integer last = end - start >= budget ? start + budget - 1 : end;
+
+    if (end >= 1) {
+        if (has_cb) {
+            /* the members, for the function */
+            skiplistNode *node = skiplistGetNodeByRank(sl, start);
+            lua_newtable(L);
+            for (i = 1; node && i <= (unsigned long)(last - start + 1); i++) {
+                LZSET_NAME(push_member)(L, node->obj);
+                lua_rawseti(L, -2, i);
+                node = node->level[0].forward;
+            }
+        }
+        removed = skiplistDeleteRangeByRank(sl, start, last, NULL, NULL);
+        if (has_cb) {
+            for (i = 1; i <= removed; i++) {
+                lua_pushvalue(L, 5);
+                lua_rawgeti(L, -2, i);
+                lua_call(L, 1, 0);
+            }
+            lua_pop(L, 1);
+        }
+    }
+
+    lua_pushinteger(L, removed);
+    if (last == end || removed < (unsigned long)(last - start + 1)) {
+        return 1;
+    }
+
+    lua_pushinteger(L, end - removed);
+
+    return 2;
+}
+
+static int LZSET_NAME(pop_min)(lua_State *L) {
+    return lzset_pop(L, 0, LZSET_NAME(push_member));
+}
+
+static int LZSET_NAME(pop_max)(lua_State *L) {
+    return lzset_pop(L, 1, LZSET_NAME(push_member));
+}
+
+static int LZSET_NAME(get_rank)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    unsigned long rank = LZSET_SKIPLIST(GetRank)(sl, score, &key);
+    if (rank == 0 || (sl->expires && LZSET_NAME(find)(sl, &key) == NULL)) {
+        return 0;
+    }
+
+    lua_pushinteger(L, rank);
+
+    return 1;
+}
+
+static int LZSET_NAME(at_many)(lua_State *L) {
+    return lzset_at_many(L, 0, LZSET_NAME(push_member));
+}
+
+static int LZSET_NAME(quantiles)(lua_State *L) {
+    return lzset_at_many(L, 1, LZSET_NAME(push_member));
+}
+
+/* Return the ranks of all the members of the table argument, in the same
+ * order, with nil holes for the missing ones. The members are looked up
+ * in the index and the specialized skiplistGetRanks computes all the ranks
+ * in one pass. */
+static int LZSET_NAME(get_ranks)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    size_t n = lzset_lua_rawlen(L, 2), i;
+
+    /* Scratch space is a userdata so that it is collected on errors. */
+    skiplistNode **nodes = lua_newuserdata(
+        L, n * (sizeof(skiplistNode *) + sizeof(unsigned long)) + 1);
+    unsigned long *ranks = (unsigned long *)(nodes + n);
+
+    for (i = 0; i < n; i++) {
+        LZSET_KEY key;
+        lua_rawgeti(L, 2, i + 1);
+        nodes[i] = LZSET_NAME(to)(L, -1, &key) ? LZSET_NAME(find)(sl, &key)
+                                                : NULL;
+        lua_pop(L, 1);
+    }
+
+    LZSET_SKIPLIST(GetRanks)(sl, nodes, ranks, n);
+
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        if (ranks[i] > 0) {
+            lua_pushinteger(L, ranks[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+    }
+
+    return 1;
+}
+
+/* Return the rank of the first row and { score1, member1, ... } of the
+ * member with up to before elements above it and after elements below it.
+ * The rank is computed by a single descent, the rows are then read by
+ * following the backward and level 0 forward pointers of the node. */
+static int LZSET_NAME(around)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 2, &key);
+    lua_Integer before = luaL_optinteger(L, 3, 0);
+    lua_Integer after = luaL_optinteger(L, 4, 0);
+    skiplistNode *node = LZSET_NAME(find)(sl, &key);
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    double now = lzset_now();
+    int expired = skiplistHasExpired(sl, now);
+    unsigned long rank = LZSET_SKIPLIST(GetRank)(sl, node->score, node->obj);
+    lua_Integer n = 0;
+
+    while (n < before && node->backward) {
+        node = node->backward;
+        rank--;
+        if (!expired || !skiplistIsExpired(sl, node, now)) {
+            n++;
+        }
+    }
+
+    lua_Integer rows = n + 1 + (after > 0 ? after : 0);
+    unsigned long first = 0;
+    int idx = 0;
+
+    lua_createtable(L, rows * 2, 0);
+    while (node && rows > 0) {
+        if (!expired || !skiplistIsExpired(sl, node, now)) {
+            if (first == 0) {
+                first = rank;
+            }
+            lua_pushnumber(L, node->score);
+            lua_rawseti(L, -2, ++idx);
+            LZSET_NAME(push_member)(L, node->obj);
+            lua_rawseti(L, -2, ++idx);
+            rows--;
+        }
+        node = node->level[0].forward;
+        rank++;
+    }
+
+    skiplistMetricsAdd(returned, idx / 2);
+
+    lua_pushinteger(L, first);
+    lua_insert(L, -2);
+
+    return 2;
+}
+
+static int LZSET_NAME(get_range_by_rank)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+
+    unsigned long r1 = luaL_checkinteger(L, 2);
+    unsigned long r2 = luaL_checkinteger(L, 3);
+
+    int reverse, span;
+    if (r1 <= r2) {
+        reverse = 0;
+        span = r2 - r1 + 1;
+    } else {
+        reverse = 1;
+        span = r1 - r2 + 1;
+    }
+
+    skiplistNode *node = skiplistGetNodeByRank(sl, r1);
+
+    lua_createtable(L, span, 0);
+
+    double now = lzset_now();
+    int expired = skiplistHasExpired(sl, now);
+    int i = 0, n = 0;
+    while (node && i++ < span) {
+        if (!expired || !skiplistIsExpired(sl, node, now)) {
+            LZSET_NAME(push_member)(L, node->obj);
+            lua_rawseti(L, -2, ++n);
+        }
+        node = reverse ? node->backward : node->level[0].forward;
+    }
+
+    skiplistMetricsAdd(returned, n);
+
+    return 1;
+}
+
+static int LZSET_NAME(get_range_by_score)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double s1 = luaL_checknumber(L, 2);
+    double s2 = luaL_checknumber(L, 3);
+
+    int reverse;
+    skiplistNode *node;
+
+    if (s1 <= s2) {
+        reverse = 0;
+        node = skiplistFirstInRange(sl, s1, s2, 0, 0);
+    } else {
+        reverse = 1;
+        node = skiplistLastInRange(sl, s2, s1, 0, 0);
+    }
+
+    lua_newtable(L);
+    double now = lzset_now();
+    int expired = skiplistHasExpired(sl, now);
+    int n = 0;
+    while (node) {
+        if (reverse) {
+            if (node->score < s2) {
+                break;
+            }
+        } else if (node->score > s2) {
+            break;
+        }
+        if (!expired || !skiplistIsExpired(sl, node, now)) {
+            LZSET_NAME(push_member)(L, node->obj);
+            lua_rawseti(L, -2, ++n);
+        }
+        node = reverse ? node->backward : node->level[0].forward;
+    }
+
+    skiplistMetricsAdd(returned, n);
+
+    return 1;
+}
+
+/* Same as get_range_by_score, visiting at most budget elements (100 by
+ * default). Returns the members and, when the range goes on, the score and
+ * member of the last element visited: passed back as the last two
+ * arguments, the next call resumes right after it. */
+static int LZSET_NAME(get_range_by_score_step)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double s1 = luaL_checknumber(L, 2);
+    double s2 = luaL_checknumber(L, 3);
+    lua_Integer budget = luaL_optinteger(L, 4, 100);
+    int reverse = s1 > s2;
+    skiplistNode *node, *last = NULL;
+
+    if (lua_isnoneornil(L, 5)) {
+        node = reverse ? skiplistLastInRange(sl, s2, s1, 0, 0)
+                       : skiplistFirstInRange(sl, s1, s2, 0, 0);
+    } else {
+        double after = luaL_checknumber(L, 5);
+        LZSET_KEY key;
+        LZSET_NAME(check)(L, 6, &key);
+
+        node = LZSET_SKIPLIST(LastBefore)(sl, after, &key);
+        if (reverse) {
+            node = node == sl->header ? NULL : node;
+        } else {
+            node = node->level[0].forward;
+            if (node && node->score == after &&
+                LZSET_NAME(compare)(node->obj, &key) == 0) {
+                node = node->level[0].forward;
+            }
+        }
+    }
+
+    if (budget < 1) {
+        budget = 1;
+    }
+
+    lua_newtable(L);
+    double now = lzset_now();
+    int expired = skiplistHasExpired(sl, now);
+    int n = 0;
+    while (node && budget > 0 && (reverse ? node->score >= s2
+                                          : node->score <= s2)) {
+        if (!expired || !skiplistIsExpired(sl, node, now)) {
+            LZSET_NAME(push_member)(L, node->obj);
+            lua_rawseti(L, -2, ++n);
+        }
+        last = node;
+        node = reverse ? node->backward : node->level[0].forward;
+        budget--;
+    }
+
+    skiplistMetricsAdd(returned, n);
+
+    if (node == NULL || (reverse ? node->score < s2 : node->score > s2)) {
+        return 1;
+    }
+
+    lua_pushnumber(L, last->score);
+    LZSET_NAME(push_member)(L, last->obj);
+
+    return 3;
+}
+
+/* Set the time to live of a member in seconds. Returns false if the
+ * member does not exist. */
+static int LZSET_NAME(expire)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 2, &key);
+    double ttl = luaL_checknumber(L, 3);
+
+    LZSET_NAME(reclaim)(sl, &key);
+
+    skiplistNode *node = LZSET_SKIPLIST(Find)(sl, &key);
+    if (node) {
+        skiplistSetExpire(sl, node, lzset_now() + ttl);
+    }
+
+    lua_pushboolean(L, node != NULL);
+
+    return 1;
+}
+
+/* Return the remaining time to live of a member in seconds, -1 if it has
+ * none, or nothing if the member does not exist. */
+static int LZSET_NAME(ttl)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 2, &key);
+    double when;
+
+    skiplistNode *node = LZSET_NAME(find)(sl, &key);
+    if (node == NULL) {
+        return 0;
+    }
+
+    if (!skiplistGetExpire(sl, node, &when)) {
+        lua_pushinteger(L, -1);
+        return 1;
+    }
+
+    lua_pushnumber(L, when - lzset_now());
+
+    return 1;
+}
+
+/* Remove the time to live of a member. Returns true if it had one. */
+static int LZSET_NAME(persist)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 2, &key);
+
+    LZSET_NAME(reclaim)(sl, &key);
+
+    skiplistNode *node = LZSET_SKIPLIST(Find)(sl, &key);
+    lua_pushboolean(L, node && skiplistPersist(sl, node));
+
+    return 1;
+}
+
+/* Reclaim at most budget expired members, oldest expire time first, calling
+ * the optional function with each of them. Returns the number reclaimed. */
+static int LZSET_NAME(expire_step)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    lua_Integer budget = luaL_optinteger(L, 2, 100);
+    lzset_callback cb = {L, 3};
+    skiplistDeleteCb delete_cb = LZSET_NAME(delete_cb);
+
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TFUNCTION);
+    } else {
+        delete_cb = NULL;
+    }
+
+    lua_pushinteger(L, LZSET_SKIPLIST(ExpireStep)(sl, lzset_now(),
+                                                  budget > 0 ? budget : 0,
+                                                  delete_cb, &cb));
+
+    return 1;
+}
+
+static int LZSET_NAME(dump)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+
+    skiplistIterate(sl, NULL, LZSET_NAME(print_node));
+
+    return 0;
+}
+
+/* Same as dump, printing at most budget elements (100 by default) from the
+ * given rank (1 by default). Returns the rank to resume from, or nothing
+ * after the last element. */
+static int LZSET_NAME(dump_step)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    lua_Integer budget = luaL_optinteger(L, 2, 100);
+    lua_Integer rank = luaL_optinteger(L, 3, 1);
+
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    skiplistNode *node = skiplistGetNodeByRank(sl, rank);
+
+    while (node && budget-- > 0) {
+        LZSET_NAME(print_node)(NULL, rank++, node->score, node->obj);
+        node = node->level[0].forward;
+    }
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    lua_pushinteger(L, rank);
+
+    return 1;
+}
+
+/* Copy the pairs of the table { score1, member1, score2, member2, ... } at
+ * idx into arrays kept in a userdata pushed onto the stack, checking all of
+ * them before copying any member. Returns the number of pairs. */
+static size_t LZSET_NAME(check_pairs)(lua_State *L, int idx, double **scores,
+                                      void ***objs) {
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    size_t n = lzset_lua_rawlen(L, idx) / 2, i;
+    LZSET_KEY key = {0};
+
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, idx, i * 2 + 1);
+        lua_rawgeti(L, idx, i * 2 + 2);
+        if (!lua_isnumber(L, -2) || !LZSET_NAME(to)(L, -1, &key)) {
+            luaL_error(L, "bad score or member at index %d", (int)i * 2 + 1);
+        }
+        lua_pop(L, 2);
+    }
+
+    *scores = lua_newuserdata(L, n * (sizeof(double) + sizeof(void *)) + 1);
+    *objs = (void **)(*scores + n);
+
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, idx, i * 2 + 1);
+        lua_rawgeti(L, idx, i * 2 + 2);
+        LZSET_NAME(to)(L, -1, &key);
+        (*scores)[i] = lua_tonumber(L, -2);
+        (*objs)[i] = LZSET_NAME(copy)(&key);
+        lua_pop(L, 2);
+    }
+
+    return n;
+}
+
+/* Insert the pairs of { score1, member1, score2, member2, ... }, the
+ * members that are already in the set or repeated are skipped. An empty
+ * set is built from the sorted pairs instead of inserting them one by one,
+ * sorting and linking on 'threads' threads (1 by default). Returns the
+ * number of inserted members. */
+static int LZSET_NAME(load)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    lua_Integer threads = luaL_optinteger(L, 3, 1);
+    double *scores;
+    void **objs;
+
+    luaL_argcheck(L, threads >= 1 && threads <= 256, 3,
+                  "threads must be between 1 and 256");
+    if (sl->maxlength) {
+        return luaL_error(L, "load cannot be used with max_size");
+    }
+
+    size_t n = LZSET_NAME(check_pairs)(L, 2, &scores, &objs);
+    skiplistWorkers *w = skiplistWorkersCreate((int)threads);
+
+    lua_pushinteger(L, skiplistLoad(sl, w, n, scores, objs));
+    skiplistWorkersFree(w);
+
+    return 1;
+}
+
+static int LZSET_NAME(shards_insert)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    void *obj = LZSET_NAME(copy)(&key);
+
+    if (skiplistShardsInsert(ss, score, obj) == NULL) {
+        LZSET_NAME(release)(obj);
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+static int LZSET_NAME(shards_delete)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    lua_pushboolean(L, skiplistShardsDelete(ss, score, &key));
+
+    return 1;
+}
+
+/* An element moving to another shard keeps its node and member copy. */
+static int LZSET_NAME(shards_update)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    double curscore = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+    double newscore = luaL_checknumber(L, 4);
+
+    lua_pushboolean(
+        L, skiplistShardsUpdateScore(ss, curscore, &key, newscore) != NULL);
+
+    return 1;
+}
+
+static int LZSET_NAME(shards_score)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 2, &key);
+
+    skiplistNode *node = skiplistShardsFind(ss, &key);
+    if (node == NULL) {
+        return 0;
+    }
+
+    lua_pushnumber(L, node->score);
+
+    return 1;
+}
+
+static int LZSET_NAME(shards_get_rank)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    unsigned long rank = skiplistShardsGetRank(ss, score, &key);
+    if (rank == 0) {
+        return 0;
+    }
+
+    lua_pushinteger(L, rank);
+
+    return 1;
+}
+
+static int LZSET_NAME(shards_at)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    lua_Integer rank = luaL_checkinteger(L, 2);
+
+    skiplistNode *node =
+        skiplistShardsGetNodeByRank(ss, rank > 0 ? (unsigned long)rank : 0);
+    if (node == NULL) {
+        return 0;
+    }
+
+    lua_pushnumber(L, node->score);
+    LZSET_NAME(push_member)(L, node->obj);
+
+    return 2;
+}
+
+static int LZSET_NAME(shards_get_range_by_rank)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    lua_Integer r1 = luaL_checkinteger(L, 2);
+    lua_Integer r2 = luaL_checkinteger(L, 3);
+
+    if (r1 <= r2) {
+        return lzset_shards_range(L, ss, r1 > 0 ? r1 : 0, r2 > 0 ? r2 : 0, 0,
+                                  LZSET_NAME(push_member));
+    }
+
+    /* like the other sets, a reverse range starts at an existing rank */
+    if ((unsigned long)r1 > ss->length) {
+        r1 = 0;
+    }
+
+    return lzset_shards_range(L, ss, r2 > 0 ? r2 : 0, r1, 1,
+                              LZSET_NAME(push_member));
+}
+
+static int LZSET_NAME(shards_get_range_by_score)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    double s1 = luaL_checknumber(L, 2);
+    double s2 = luaL_checknumber(L, 3);
+    int reverse = s1 > s2;
+
+    if (reverse) {
+        double tmp = s1;
+        s1 = s2;
+        s2 = tmp;
+    }
+
+    return lzset_shards_range(L, ss,
+                              skiplistShardsGetScoreRank(ss, s1, 1) + 1,
+                              skiplistShardsGetScoreRank(ss, s2, 0), reverse,
+                              LZSET_NAME(push_member));
+}
+
+/* The shards delete their part of the range in parallel. The members for
+ * the optional callback are gathered first, and the callback is called once
+ * the set is consistent again, so that it may raise errors or use the set. */
+static int LZSET_NAME(shards_delete_range_by_rank)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    lua_Integer start = luaL_checkinteger(L, 2);
+    lua_Integer end = luaL_checkinteger(L, 3);
+    int has_cb = !lua_isnoneornil(L, 4);
+    unsigned long removed, i;
+
+    if (has_cb) {
+        luaL_checktype(L, 4, LUA_TFUNCTION);
+    }
+
+    if (start > end) {
+        lua_Integer tmp = start;
+        start = end;
+        end = tmp;
+    }
+
+    if (end < 1) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+    if (start < 1) {
+        start = 1;
+    }
+
+    if (has_cb) {
+        lzset_shards_range(L, ss, start, end, 0, LZSET_NAME(push_member));
+    }
+    removed = skiplistShardsDeleteRangeByRank(ss, start, end);
+
+    if (has_cb) {
+        for (i = 1; i <= removed; i++) {
+            lua_pushvalue(L, 4);
+            lua_rawgeti(L, -2, i);
+            lua_call(L, 1, 0);
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_pushinteger(L, removed);
+
+    return 1;
+}
+
+/* Insert the pairs of { score1, member1, score2, member2, ... }, the
+ * members that are already in the set or repeated are skipped. The shards
+ * insert their part in parallel. Returns the number of inserted members. */
+static int LZSET_NAME(shards_load)(lua_State *L) {
+    skiplistShards *ss = lua_touserdata(L, 1);
+    double *scores;
+    void **objs;
+    size_t n = LZSET_NAME(check_pairs)(L, 2, &scores, &objs);
+
+    lua_pushinteger(L, skiplistShardsLoad(ss, n, scores, objs));
+
+    return 1;
+}
+
+static int LZSET_NAME(compact_insert)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    void *obj = LZSET_NAME(copy)(&key);
+
+    if (skiplistCompactInsert(sl, score, obj) == 0) {
+        LZSET_NAME(release)(obj);
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+static int LZSET_NAME(compact_delete)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    lua_pushboolean(L, skiplistCompactDelete(sl, score, &key));
+
+    return 1;
+}
+
+static int LZSET_NAME(compact_update)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    double curscore = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+    double newscore = luaL_checknumber(L, 4);
+
+    lua_pushboolean(L, skiplistCompactUpdateScore(sl, curscore, &key,
+                                                  newscore) != 0);
+
+    return 1;
+}
+
+static int LZSET_NAME(compact_score)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 2, &key);
+
+    uint32_t x = skiplistCompactFind(sl, &key);
+    if (x == 0) {
+        return 0;
+    }
+
+    lua_pushnumber(L, sl->nodes[x].score);
+
+    return 1;
+}
+
+static int LZSET_NAME(compact_at)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    lua_Integer rank = luaL_checkinteger(L, 2);
+
+    uint32_t x =
+        skiplistCompactGetNodeByRank(sl, rank > 0 ? (unsigned long)rank : 0);
+    if (x == 0) {
+        return 0;
+    }
+
+    lua_pushnumber(L, sl->nodes[x].score);
+    LZSET_NAME(push_member)(L, sl->nodes[x].obj);
+
+    return 2;
+}
+
+static int LZSET_NAME(compact_delete_range_by_rank)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    lua_Integer start = luaL_checkinteger(L, 2);
+    lua_Integer end = luaL_checkinteger(L, 3);
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    if (start > end) {
+        lua_Integer tmp = start;
+        start = end;
+        end = tmp;
+    }
+
+    if (end < 1) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    lzset_callback cb = {L, 4};
+
+    lua_pushinteger(L, skiplistCompactDeleteRangeByRank(
+                           sl, start > 0 ? start : 0, end,
+                           LZSET_NAME(delete_cb), &cb));
+
+    return 1;
+}
+
+static int LZSET_NAME(compact_get_rank)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    double score = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    unsigned long rank = skiplistCompactGetRank(sl, score, &key);
+    if (rank == 0) {
+        return 0;
+    }
+
+    lua_pushinteger(L, rank);
+
+    return 1;
+}
+
+static int LZSET_NAME(compact_get_range_by_rank)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    lua_Integer r1 = luaL_checkinteger(L, 2);
+    lua_Integer r2 = luaL_checkinteger(L, 3);
+    uint32_t x =
+        skiplistCompactGetNodeByRank(sl, r1 > 0 ? (unsigned long)r1 : 0);
+
+    if (r1 <= r2) {
+        return lzset_compact_range(L, sl, x, r2 - r1 + 1, 0,
+                                   LZSET_NAME(push_member));
+    }
+
+    return lzset_compact_range(L, sl, x, r1 - r2 + 1, 1,
+                               LZSET_NAME(push_member));
+}
+
+/* The range is located by two score rank descents, then its nodes are
+ * read by following the links of the first one. */
+static int LZSET_NAME(compact_get_range_by_score)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    double s1 = luaL_checknumber(L, 2);
+    double s2 = luaL_checknumber(L, 3);
+    int reverse = s1 > s2;
+
+    if (reverse) {
+        double tmp = s1;
+        s1 = s2;
+        s2 = tmp;
+    }
+
+    unsigned long lo = skiplistCompactGetScoreRank(sl, s1, 1) + 1;
+    unsigned long hi = skiplistCompactGetScoreRank(sl, s2, 0);
+
+    if (lo > hi) {
+        lua_newtable(L);
+        return 1;
+    }
+
+    uint32_t x = skiplistCompactGetNodeByRank(sl, reverse ? hi : lo);
+
+    return lzset_compact_range(L, sl, x, hi - lo + 1, reverse,
+                               LZSET_NAME(push_member));
+}
+
+static int LZSET_NAME(compact_dump)(lua_State *L) {
+    skiplistCompact *sl = lua_touserdata(L, 1);
+    uint32_t x = skiplistCompactLevelOf(sl, 0, 0).forward;
+    int index = 0;
+
+    while (x && LZSET_NAME(print_node)(NULL, ++index, sl->nodes[x].score,
+                                       sl->nodes[x].obj)) {
+        x = skiplistCompactLevelOf(sl, x, 0).forward;
+    }
+
+    return 0;
+}
+
+/* Sets created with the queue option order the members of equal scores by
+ * push, see skiplistEnableQueue(). The score is the due time. */
+
+static int LZSET_NAME(queue_push)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double due = luaL_checknumber(L, 2);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 3, &key);
+
+    if (LZSET_SKIPLIST(Find)(sl, &key)) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    skiplistPush(sl, due, LZSET_NAME(copy)(&key));
+    lua_pushboolean(L, 1);
+
+    return 1;
+}
+
+/* Return the due time and member of the head, nothing if empty. */
+static int LZSET_NAME(queue_peek)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    skiplistNode *node = sl->header->level[0].forward;
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    lua_pushnumber(L, node->score);
+    LZSET_NAME(push_member)(L, node->obj);
+
+    return 2;
+}
+
+/* Pop up to max (1 by default) members due at now, returning a flat array
+ * of due time, member pairs, oldest first. Every member is unlinked from
+ * the head without any descent. */
+static int LZSET_NAME(queue_pop_due)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    double now = luaL_checknumber(L, 2);
+    lua_Integer max = luaL_optinteger(L, 3, 1);
+    skiplistNode *node;
+    int idx = 0;
+
+    lua_newtable(L);
+    while (max-- > 0 && (node = sl->header->level[0].forward) &&
+           node->score <= now) {
+        lua_pushnumber(L, node->score);
+        lua_rawseti(L, -2, ++idx);
+        LZSET_NAME(push_member)(L, node->obj);
+        lua_rawseti(L, -2, ++idx);
+        skiplistRelease(sl, skiplistPopHead(sl));
+    }
+
+    skiplistMetricsAdd(returned, idx / 2);
+
+    return 1;
+}
+
+/* Remove a member wherever it is in the queue. Returns false if it is not
+ * there. */
+static int LZSET_NAME(queue_cancel)(lua_State *L) {
+    skiplist *sl = lua_touserdata(L, 1);
+    LZSET_KEY key;
+    LZSET_NAME(check)(L, 2, &key);
+
+    skiplistNode *node = LZSET_SKIPLIST(Find)(sl, &key);
+    if (node) {
+        skiplistQueueDelete(sl, node);
+    }
+
+    lua_pushboolean(L, node != NULL);
+
+    return 1;
+}
+
+/* Set up an empty skiplist for the members of the type. */
+static void LZSET_NAME(init)(skiplist *sl) {
+    skiplistInit(sl, LZSET_NAME(compare), LZSET_NAME(release));
+    skiplistEnableIndex(sl, LZSET_NAME(hash));
+    skiplistEnablePrefix(sl, LZSET_NAME(prefix));
+    skiplistSetObjSize(sl, LZSET_NAME(size));
+    skiplistSetObjMove(sl, LZSET_NAME(move));
+}
+
+/* The metatables of the sets, of the sharded sets, of the compact sets and
+ * of the queues are upvalues 1, 2, 3 and 4. */
+static int LZSET_NAME(new)(lua_State *L) {
+    lzset_options opts;
+    lzset_check_options(L, 1, &opts);
+
+    if (opts.compact) {
+        skiplistCompact *sl = lua_newuserdata(L, sizeof(skiplistCompact));
+
+        skiplistCompactInit(sl, LZSET_NAME(compare), LZSET_NAME(release));
+        skiplistCompactEnableIndex(sl, LZSET_NAME(hash));
+
+        lua_pushvalue(L, lua_upvalueindex(3));
+        lua_setmetatable(L, -2);
+
+        return 1;
+    }
+
+    if (opts.shard_size) {
+        skiplistShards *ss = lua_newuserdata(L, sizeof(skiplistShards));
+        skiplist *first = malloc(sizeof(skiplist));
+
+        LZSET_NAME(init)(first);
+        skiplistShardsInit(ss, first, opts.shard_size, opts.threads);
+
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_setmetatable(L, -2);
+
+        return 1;
+    }
+
+    skiplist *sl = lua_newuserdata(L, sizeof(skiplist));
+
+    LZSET_NAME(init)(sl);
+    lzset_apply_options(sl, &opts);
+    if (opts.queue) {
+        skiplistEnableQueue(sl);
+    }
+
+    lua_pushvalue(L, lua_upvalueindex(opts.queue ? 4 : 1));
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static const luaL_Reg LZSET_NAME(methods)[] = {
+    {"insert", LZSET_NAME(insert)},
+    {"delete", LZSET_NAME(delete)},
+    {"update", LZSET_NAME(update)},
+    {"incrby", LZSET_NAME(incrby)},
+    {"score", LZSET_NAME(score)},
+    {"at", LZSET_NAME(at)},
+    {"at_many", LZSET_NAME(at_many)},
+    {"quantiles", LZSET_NAME(quantiles)},
+    {"count", lzset_count},
+    {"clear", lzset_clear},
+    {"delete_range_by_rank", LZSET_NAME(delete_range_by_rank)},
+    {"delete_range_by_rank_step", LZSET_NAME(delete_range_by_rank_step)},
+    {"pop_min", LZSET_NAME(pop_min)},
+    {"pop_max", LZSET_NAME(pop_max)},
+    {"split_at_rank", lzset_split_at_rank},
+    {"split_at_score", lzset_split_at_score},
+    {"concat", lzset_concat},
+    {"load", LZSET_NAME(load)},
+
+    {"get_rank", LZSET_NAME(get_rank)},
+    {"get_ranks", LZSET_NAME(get_ranks)},
+    {"around", LZSET_NAME(around)},
+    {"get_score_rank", lzset_get_score_rank},
+    {"sum_by_rank", lzset_sum_by_rank},
+    {"sum_by_score", lzset_sum_by_score},
+    {"count_by_score", lzset_count_by_score},
+    {"get_range_by_rank", LZSET_NAME(get_range_by_rank)},
+    {"get_range_by_score", LZSET_NAME(get_range_by_score)},
+    {"get_range_by_score_step", LZSET_NAME(get_range_by_score_step)},
+
+    {"expire", LZSET_NAME(expire)},
+    {"ttl", LZSET_NAME(ttl)},
+    {"persist", LZSET_NAME(persist)},
+    {"expire_step", LZSET_NAME(expire_step)},
+
+    {"stats", lzset_stats},
+    {"defrag", lzset_defrag},
+    {"metrics", lzset_metrics_get},
+    {"reset_metrics", lzset_metrics_reset},
+    {"dump", LZSET_NAME(dump)},
+    {"dump_step", LZSET_NAME(dump_step)},
+    {NULL, NULL}};
+
+static const luaL_Reg LZSET_NAME(shard_methods)[] = {
+    {"insert", LZSET_NAME(shards_insert)},
+    {"delete", LZSET_NAME(shards_delete)},
+    {"update", LZSET_NAME(shards_update)},
+    {"score", LZSET_NAME(shards_score)},
+    {"at", LZSET_NAME(shards_at)},
+    {"count", lzset_shards_count},
+    {"delete_range_by_rank", LZSET_NAME(shards_delete_range_by_rank)},
+    {"load", LZSET_NAME(shards_load)},
+
+    {"get_rank", LZSET_NAME(shards_get_rank)},
+    {"get_score_rank", lzset_shards_get_score_rank},
+    {"get_range_by_rank", LZSET_NAME(shards_get_range_by_rank)},
+    {"get_range_by_score", LZSET_NAME(shards_get_range_by_score)},
+
+    {"shards", lzset_shards_info},
+    {"metrics", lzset_metrics_get},
+    {"reset_metrics", lzset_metrics_reset},
+    {NULL, NULL}};
+
+static const luaL_Reg LZSET_NAME(queue_methods)[] = {
+    {"push", LZSET_NAME(queue_push)},
+    {"peek", LZSET_NAME(queue_peek)},
+    {"pop_due", LZSET_NAME(queue_pop_due)},
+    {"cancel", LZSET_NAME(queue_cancel)},
+    {"score", LZSET_NAME(score)},
+    {"count", lzset_count},
+    {"clear", lzset_clear},
+
+    {"get_range_by_rank", LZSET_NAME(get_range_by_rank)},
+
+    {"stats", lzset_stats},
+    {"metrics", lzset_metrics_get},
+    {"reset_metrics", lzset_metrics_reset},
+    {NULL, NULL}};
+
+static const luaL_Reg LZSET_NAME(compact_methods)[] = {
+    {"insert", LZSET_NAME(compact_insert)},
+    {"delete", LZSET_NAME(compact_delete)},
+    {"update", LZSET_NAME(compact_update)},
+    {"score", LZSET_NAME(compact_score)},
+    {"at", LZSET_NAME(compact_at)},
+    {"count", lzset_compact_count},
+    {"delete_range_by_rank", LZSET_NAME(compact_delete_range_by_rank)},
+
+    {"get_rank", LZSET_NAME(compact_get_rank)},
+    {"get_score_rank", lzset_compact_get_score_rank},
+    {"get_range_by_rank", LZSET_NAME(compact_get_range_by_rank)},
+    {"get_range_by_score", LZSET_NAME(compact_get_range_by_score)},
+
+    {"stats", lzset_compact_stats},
+    {"metrics", lzset_metrics_get},
+    {"reset_metrics", lzset_metrics_reset},
+    {"dump", LZSET_NAME(compact_dump)},
+    {NULL, NULL}};
+
+#undef LZSET_NAME
+#undef LZSET_SKIPLIST
+#undef LZSET_KEY
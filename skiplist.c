@@ -46,16 +46,50 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "skiplist.h"
+#include "skiplist_impl.h"
 
 
+#ifdef SKIPLIST_METRICS
+skiplistMetrics skiplistMetricsCounters;
+#endif
+
+#ifdef SKIPLIST_USDT
+unsigned long long skiplistHops;
+#endif
+
 /* Create a skip list node with the specified number of levels, pointing to
  * the specified object. */
 skiplistNode *skiplistCreateNode(int level, double score, void *obj) {
     skiplistNode *zn = malloc(sizeof(*zn)+level*sizeof(struct skiplistLevel));
     zn->obj = obj;
     zn->score = score;
+    zn->prefix = 0;
+    return zn;
+}
+
+/* When score sums are enabled, every level of a node also records the sum
+ * of the scores of the nodes crossed by its span, see skiplistSum(). The
+ * sums are stored in front of the node, preceded by the size of that
+ * prefix so that the node can be freed without knowing its level. Nodes of
+ * other skiplists have no prefix at all. */
+static skiplistNode *skiplistCreateSumNode(int level, double score, void *obj) {
+    size_t prefix = (level+1)*sizeof(double);
+    char *p = malloc(prefix+sizeof(skiplistNode)+level*sizeof(struct skiplistLevel));
+    skiplistNode *zn = (skiplistNode *)(p+prefix);
+    ((size_t *)zn)[-1] = prefix;
+    zn->obj = obj;
+    zn->score = score;
+    zn->prefix = 0;
+    return zn;
+}
+
+skiplistNode *skiplistNewNode(skiplist *sl, int level, double score, void *obj) {
+    skiplistNode *zn = sl->sums ? skiplistCreateSumNode(level,score,obj)
+                                : skiplistCreateNode(level,score,obj);
+    if (sl->prefix && obj) zn->prefix = sl->prefix(obj);
     return zn;
 }
 
@@ -74,6 +108,23 @@ void skiplistInit(skiplist *sl, int (*compare)(const void *, const void *), void
     sl->tail = NULL;
     sl->compare = compare;
     sl->release = release;
+    sl->maxlength = 0;
+    sl->evict = SKIPLIST_EVICT_MIN;
+    sl->hash = NULL;
+    sl->prefix = NULL;
+    sl->index = NULL;
+    sl->indexsize = 0;
+    sl->expires = NULL;
+    sl->sums = 0;
+    sl->objsize = NULL;
+    sl->objbytes = 0;
+    sl->objmove = NULL;
+    sl->defragrank = 0;
+    sl->slabs = NULL;
+    sl->pool = NULL;
+    sl->queue = NULL;
+    for (j = 0; j < SKIPLIST_MAXLEVEL; j++)
+        sl->levels[j] = 0;
 }
 
 /* Create a new skip list with the specified function used in order to
@@ -84,28 +135,379 @@ skiplist *skiplistCreate(int (*compare)(const void *, const void *), void (*rele
     return sl;
 }
 
+/* Initialize an empty skiplist with the callbacks, capacity and score
+ * sums of sl. */
+void skiplistInitLike(skiplist *dst, skiplist *sl) {
+    skiplistInit(dst,sl->compare,sl->release);
+    dst->hash = sl->hash;
+    dst->prefix = sl->prefix;
+    dst->objsize = sl->objsize;
+    dst->objmove = sl->objmove;
+    skiplistSetMaxLength(dst,sl->maxlength,sl->evict);
+    if (sl->sums) skiplistEnableSums(dst);
+}
+
+/* skiplistDefrag() moves the nodes, and the objects it can move, to slabs:
+ * large blocks it fills in list order, so that neighbouring elements end up
+ * next to each other whatever the allocator does with freed memory. A slab
+ * is freed once everything in it is freed. Every skiplist holding nodes of
+ * a slab has it in its registry, sorted by address, which tells whether a
+ * node or an object being freed belongs to a slab. After skiplistSplit()
+ * both skiplists have the slabs of sl in their registry, and the shards of
+ * a set may free nodes of the same slab in parallel, so the counts are
+ * atomic. A registry drops a slab when its count reaches 0, or on the next
+ * defrag step when another registry freed its last allocation. */
+#define SKIPLIST_SLAB_SIZE (64*1024)
+#define SKIPLIST_SLAB_ALIGN 8
+
+typedef struct skiplistSlab {
+    char *mem;
+    size_t size, used; // bytes allocated and handed out
+    unsigned long live; // allocations not freed yet, plus 1 while filled
+    int refs; // registries holding the slab
+} skiplistSlab;
+
+typedef struct skiplistSlabs {
+    skiplistSlab **slab; // by address
+    int count, size;
+    skiplistSlab *open; // slab being filled, NULL if none
+} skiplistSlabs;
+
+static void skiplistSlabUnref(skiplistSlab *slab) {
+    if (__atomic_sub_fetch(&slab->refs,1,__ATOMIC_ACQ_REL) == 0) {
+        free(slab->mem);
+        free(slab);
+    }
+}
+
+/* Return the position of the slab holding p in the registry, -1 if none. */
+static int skiplistSlabsFind(skiplistSlabs *s, const void *p) {
+    int lo = 0, hi = s->count-1, mid;
+
+    while (lo <= hi) {
+        mid = (lo+hi)/2;
+        if ((const char *)p < s->slab[mid]->mem)
+            hi = mid-1;
+        else if ((const char *)p >= s->slab[mid]->mem+s->slab[mid]->size)
+            lo = mid+1;
+        else
+            return mid;
+    }
+    return -1;
+}
+
+static void skiplistSlabsAdd(skiplistSlabs *s, skiplistSlab *slab) {
+    int i;
+
+    if (s->count == s->size) {
+        s->size = s->size ? s->size*2 : 8;
+        s->slab = realloc(s->slab,sizeof(skiplistSlab *)*s->size);
+    }
+    for (i = s->count; i > 0 && s->slab[i-1]->mem > slab->mem; i--)
+        s->slab[i] = s->slab[i-1];
+    s->slab[i] = slab;
+    s->count++;
+}
+
+static void skiplistSlabsRemove(skiplistSlabs *s, int i) {
+    skiplistSlab *slab = s->slab[i];
+
+    memmove(s->slab+i,s->slab+i+1,sizeof(skiplistSlab *)*(s->count-i-1));
+    s->count--;
+    skiplistSlabUnref(slab);
+}
+
+/* Drop one allocation of the slab at position i. */
+static void skiplistSlabsPut(skiplistSlabs *s, int i) {
+    if (__atomic_sub_fetch(&s->slab[i]->live,1,__ATOMIC_ACQ_REL) == 0)
+        skiplistSlabsRemove(s,i);
+}
+
+/* Free p if it belongs to a slab of sl, returns 0 if it does not. */
+static int skiplistSlabsFree(skiplist *sl, const void *p) {
+    int i = skiplistSlabsFind(sl->slabs,p);
+
+    if (i < 0) return 0;
+    skiplistSlabsPut(sl->slabs,i);
+    return 1;
+}
+
+/* Stop filling the open slab. */
+static void skiplistSlabsClose(skiplistSlabs *s) {
+    if (!s->open) return;
+    skiplistSlabsPut(s,skiplistSlabsFind(s,s->open->mem));
+    s->open = NULL;
+}
+
+/* Allocate size bytes right after the previous allocation. */
+static void *skiplistSlabAlloc(skiplist *sl, size_t size) {
+    skiplistSlabs *s = sl->slabs;
+    skiplistSlab *slab;
+    void *p;
+
+    if (!s) s = sl->slabs = calloc(1,sizeof(*s));
+    size = (size+SKIPLIST_SLAB_ALIGN-1) & ~(size_t)(SKIPLIST_SLAB_ALIGN-1);
+    if (!s->open || s->open->used+size > s->open->size) {
+        skiplistSlabsClose(s);
+        slab = malloc(sizeof(*slab));
+        slab->size = size > SKIPLIST_SLAB_SIZE ? size : SKIPLIST_SLAB_SIZE;
+        slab->mem = malloc(slab->size);
+        slab->used = 0;
+        slab->live = 1;
+        slab->refs = 1;
+        skiplistSlabsAdd(s,slab);
+        s->open = slab;
+    }
+
+    slab = s->open;
+    p = slab->mem+slab->used;
+    slab->used += size;
+    __atomic_add_fetch(&slab->live,1,__ATOMIC_ACQ_REL);
+    return p;
+}
+
+/* Drop the slabs whose last allocation was freed through another
+ * registry. */
+static void skiplistSlabsPrune(skiplistSlabs *s) {
+    int i;
+
+    for (i = s->count-1; i >= 0; i--) {
+        if (__atomic_load_n(&s->slab[i]->live,__ATOMIC_ACQUIRE) == 0)
+            skiplistSlabsRemove(s,i);
+    }
+}
+
+/* Add the slabs of src to the registry of dst. When moving, src gives its
+ * references away and is left without slabs, otherwise both hold them. */
+static void skiplistSlabsMerge(skiplist *dst, skiplist *src, int move) {
+    skiplistSlabs *s = src->slabs;
+    int i;
+
+    if (!s) return;
+    if (!dst->slabs) dst->slabs = calloc(1,sizeof(*dst->slabs));
+    if (move) skiplistSlabsClose(s);
+    for (i = 0; i < s->count; i++) {
+        if (skiplistSlabsFind(dst->slabs,s->slab[i]->mem) >= 0) {
+            if (move) skiplistSlabUnref(s->slab[i]);
+            continue;
+        }
+        if (!move) __atomic_add_fetch(&s->slab[i]->refs,1,__ATOMIC_ACQ_REL);
+        skiplistSlabsAdd(dst->slabs,s->slab[i]);
+    }
+    if (move) {
+        free(s->slab);
+        free(s);
+        src->slabs = NULL;
+    }
+}
+
+/* Drop all the slabs of the registry of sl, its nodes must be freed. */
+static void skiplistSlabsFreeAll(skiplist *sl) {
+    skiplistSlabs *s = sl->slabs;
+    int i;
+
+    if (!s) return;
+    for (i = 0; i < s->count; i++)
+        skiplistSlabUnref(s->slab[i]);
+    free(s->slab);
+    free(s);
+    sl->slabs = NULL;
+}
+
 /* Free a skiplist node. */
-static inline void skiplistDoFreeNode(skiplistNode *node) {
-    free(node);
+static inline void skiplistDoFreeNode(skiplist *sl, skiplistNode *node) {
+    void *p = sl->sums ? (char *)node-((size_t *)node)[-1] : (void *)node;
+
+    if (sl->slabs && skiplistSlabsFree(sl,p)) return;
+    free(p);
+}
+
+/* Release an object of sl, which may live in one of its slabs. Objects
+ * handed out by skiplistPopHead(), skiplistEvict() and the like must be
+ * released with this function rather than with sl->release. */
+void skiplistRelease(skiplist *sl, void *obj) {
+    if (sl->slabs && skiplistSlabsFree(sl,obj)) return;
+    if (sl->release) sl->release(obj);
 }
 
 /* Free a skiplist node and the node's pointed object when needed. */
 void skiplistFreeNode(skiplist *sl, skiplistNode *node) {
-    if (sl->release)
-        sl->release(node->obj);
-    skiplistDoFreeNode(node);
+    skiplistRelease(sl,node->obj);
+    skiplistDoFreeNode(sl,node);
+}
+
+/* A queue orders the elements of equal scores by arrival instead of by
+ * object: the prefix of every node holds a sequence number increasing
+ * with every push, see skiplistPush(). The last node of every level is
+ * kept up to date by skiplistLinkNode() and skiplistDeleteNode(), so that
+ * a push at the tail needs no descent. */
+typedef struct skiplistQueue {
+    uint64_t seq; // sequence number of the next push
+    skiplistNode *last[SKIPLIST_MAXLEVEL]; // last node of each level, or the header
+} skiplistQueue;
+
+/* Nodes given up by skiplistClear() wait in a pool to be reused by the
+ * next insertions. The cleared nodes stay linked as they were, objects
+ * included, and next[i] is the first one not recycled yet at level i: a
+ * node is the first one of as many levels as it has, so walking level 0
+ * tells the level of every node without storing it. Every node taken
+ * recycles up to SKIPLIST_POOL_STEP cleared nodes, releasing their object
+ * and moving them to the free list of their level. */
+#define SKIPLIST_POOL_STEP 4
+
+typedef struct skiplistPool {
+    skiplistNode *next[SKIPLIST_MAXLEVEL]; // next cleared node at each level
+    skiplistNode *last[SKIPLIST_MAXLEVEL]; // last cleared node at each level
+    skiplistNode *free[SKIPLIST_MAXLEVEL]; // recycled nodes of i+1 levels
+    size_t bytes; // bytes of the nodes and of the cleared objects
+} skiplistPool;
+
+static size_t skiplistNodeSize(skiplist *sl, int level);
+
+/* Recycle the first cleared node of the pool, returns 0 if there is none. */
+static int skiplistPoolRecycle(skiplist *sl) {
+    skiplistPool *p = sl->pool;
+    skiplistNode *x = p->next[0];
+    int i;
+
+    if (!x) return 0;
+    for (i = 0; i < SKIPLIST_MAXLEVEL && p->next[i] == x; i++)
+        p->next[i] = x->level[i].forward;
+    if (sl->objsize) p->bytes -= sl->objsize(x->obj);
+    skiplistRelease(sl,x->obj);
+    x->level[0].forward = p->free[i-1];
+    p->free[i-1] = x;
+    return 1;
+}
+
+/* Same as skiplistNewNode(), reusing a node of the pool when there is one
+ * with the same level. */
+skiplistNode *skiplistTakeNode(skiplist *sl, int level, double score, void *obj) {
+    skiplistPool *p = sl->pool;
+    skiplistNode *x;
+    int j;
+
+    if (!p) return skiplistNewNode(sl,level,score,obj);
+    for (j = 0; j < SKIPLIST_POOL_STEP && skiplistPoolRecycle(sl); j++);
+    if (!(x = p->free[level-1])) return skiplistNewNode(sl,level,score,obj);
+
+    p->free[level-1] = x->level[0].forward;
+    p->bytes -= skiplistNodeSize(sl,level);
+    x->obj = obj;
+    x->score = score;
+    x->prefix = sl->prefix && obj ? sl->prefix(obj) : 0;
+    return x;
+}
+
+/* Release the objects of the cleared nodes and free all the nodes of the
+ * pool. */
+static void skiplistFreePool(skiplist *sl) {
+    skiplistPool *p = sl->pool;
+    skiplistNode *x, *next;
+    int i;
+
+    if (!p) return;
+    for (x = p->next[0]; x; x = next) {
+        next = x->level[0].forward;
+        skiplistFreeNode(sl,x);
+    }
+    for (i = 0; i < SKIPLIST_MAXLEVEL; i++) {
+        for (x = p->free[i]; x; x = next) {
+            next = x->level[0].forward;
+            skiplistDoFreeNode(sl,x);
+        }
+    }
+    free(p);
+    sl->pool = NULL;
+}
+
+/* Remove all the elements in constant time: the nodes are moved to the
+ * pool as they are, and their objects are only released when the nodes are
+ * reused by the next insertions, or when the skiplist is freed. */
+void skiplistClear(skiplist *sl) {
+    skiplistPool *p = sl->pool;
+    skiplistNode *x;
+    int i;
+
+    if (sl->expires) skiplistClear(sl->expires);
+    if (sl->length == 0) return;
+    if (!p) p = sl->pool = calloc(1,sizeof(*p));
+
+    /* Append the nodes after the ones still waiting in the pool. */
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward) x = x->level[i].forward;
+        if (p->next[i])
+            p->last[i]->level[i].forward = sl->header->level[i].forward;
+        else
+            p->next[i] = sl->header->level[i].forward;
+        p->last[i] = x;
+    }
+    for (i = 0; i < SKIPLIST_MAXLEVEL; i++) {
+        p->bytes += sl->levels[i]*skiplistNodeSize(sl,i+1);
+        sl->levels[i] = 0;
+        sl->header->level[i].forward = NULL;
+        sl->header->level[i].span = 0;
+        if (sl->sums) skiplistSum(sl->header,i) = 0;
+    }
+    p->bytes += sl->objbytes;
+    if (sl->queue) {
+        for (i = 0; i < SKIPLIST_MAXLEVEL; i++)
+            sl->queue->last[i] = sl->header;
+    }
+
+    free(sl->index);
+    sl->index = NULL;
+    sl->indexsize = 0;
+    sl->tail = NULL;
+    sl->length = 0;
+    sl->level = 1;
+    sl->objbytes = 0;
+    sl->defragrank = 0;
+}
+
+/* Enable score sums on an empty skiplist. The header is created again
+ * with room for the sums. */
+void skiplistEnableSums(skiplist *sl) {
+    int j;
+
+    if (sl->sums) return;
+    skiplistFreePool(sl);
+    free(sl->header);
+    sl->sums = 1;
+    sl->header = skiplistNewNode(sl,SKIPLIST_MAXLEVEL,0,NULL);
+    for (j = 0; j < SKIPLIST_MAXLEVEL; j++) {
+        sl->header->level[j].forward = NULL;
+        sl->header->level[j].span = 0;
+        skiplistSum(sl->header,j) = 0;
+    }
+    sl->header->backward = NULL;
+}
+
+/* Cache a prefix of every object in its node on an empty skiplist, using
+ * the specified function that must preserve the order of sl->compare:
+ * prefix(a) < prefix(b) implies compare(a,b) < 0. Searches then compare
+ * the prefixes first, and only call sl->compare on a tie, so most of the
+ * steps of a descent along equal scores never touch the objects. */
+void skiplistEnablePrefix(skiplist *sl, uint64_t (*prefix)(const void *)) {
+    sl->prefix = prefix;
 }
 
 /* Free an skiplist nodes. */
 void skiplistFreeNodes(skiplist *sl) {
     skiplistNode *node = sl->header->level[0].forward, *next;
 
-    free(sl->header);
+    if (sl->expires) skiplistFree(sl->expires);
+    skiplistFreePool(sl);
+    free(sl->queue);
+    free(sl->index);
+    skiplistDoFreeNode(sl,sl->header);
     while(node) {
         next = node->level[0].forward;
         skiplistFreeNode(sl,node);
         node = next;
     }
+    skiplistSlabsFreeAll(sl);
 }
 
 /* Free an entire skiplist. */
@@ -114,6 +516,56 @@ void skiplistFree(skiplist *sl) {
     free(sl);
 }
 
+/* Bytes used by a node of the given level. */
+static size_t skiplistNodeSize(skiplist *sl, int level) {
+    size_t size = sizeof(skiplistNode)+level*sizeof(struct skiplistLevel);
+    return sl->sums ? size+(level+1)*sizeof(double) : size;
+}
+
+/* Fill stats from the counters kept up to date on insertion and deletion,
+ * the cost does not depend on the number of elements. The skiplist struct
+ * itself is not counted as it is usually embedded in something else.
+ *
+ * The search path length is estimated from the level histogram: between
+ * two nodes of level i+1 or more there are in average n(i)/(n(i+1)+1)
+ * nodes at level i, half of which are crossed, plus one step down for
+ * every level. */
+void skiplistGetStats(skiplist *sl, skiplistStats *stats) {
+    unsigned long above = 0;
+    int i;
+
+    stats->nodebytes = 0;
+    stats->objbytes = sl->objbytes;
+    stats->overhead = skiplistNodeSize(sl,SKIPLIST_MAXLEVEL) +
+        sl->indexsize*sizeof(skiplistNode *);
+    stats->level = sl->level;
+    stats->avgpath = 0;
+
+    for (i = SKIPLIST_MAXLEVEL-1; i >= 0; i--) {
+        stats->levels[i] = sl->levels[i];
+        stats->nodebytes += sl->levels[i]*skiplistNodeSize(sl,i+1);
+        if (i < sl->level) {
+            /* nodes at level i are the nodes of level i+1 or more */
+            stats->avgpath += (double)(above+sl->levels[i])/(above+1)/2 + 1;
+        }
+        above += sl->levels[i];
+    }
+
+    if (sl->pool) stats->overhead += sizeof(skiplistPool) + sl->pool->bytes;
+    if (sl->slabs) {
+        stats->overhead += sizeof(skiplistSlabs) +
+            sl->slabs->size*sizeof(skiplistSlab *);
+        if (sl->slabs->open)
+            stats->overhead += sl->slabs->open->size - sl->slabs->open->used;
+    }
+    if (sl->expires) {
+        skiplistStats expires;
+        skiplistGetStats(sl->expires,&expires);
+        stats->overhead += sizeof(skiplist) + expires.nodebytes +
+            expires.overhead;
+    }
+}
+
 /* Returns a random level for the new skiplist node we are going to create.
  * The return value of this function is between 1 and SKIPLIST_MAXLEVEL
  * (both inclusive), with a powerlaw-alike distribution where higher
@@ -125,48 +577,222 @@ int skiplistRandomLevel(void) {
     return (level<SKIPLIST_MAXLEVEL) ? level : SKIPLIST_MAXLEVEL;
 }
 
-/* Insert the specified object, return NULL if the element already
- * exists. */
-skiplistNode *skiplistInsert(skiplist *sl, double score, void *obj) {
-    skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
-    unsigned int rank[SKIPLIST_MAXLEVEL];
-    int i, level;
+/* The optional member index is an open addressing hash table of node
+ * pointers, keyed by the node object, with linear probing. Every node of
+ * the skiplist is in the table, so sl->length is also its fill. The table
+ * is kept at most half full and is released when the skiplist is freed. */
 
-    x = sl->header;
-    for (i = sl->level-1; i >= 0; i--) {
-        /* store rank that is crossed to reach the insert position */
-        rank[i] = i == (sl->level-1) ? 0 : rank[i+1];
-        while (x->level[i].forward &&
-            (x->level[i].forward->score < score ||
-               (x->level[i].forward->score == score &&
-                sl->compare(x->level[i].forward->obj,obj) < 0)))
-        {
-            rank[i] += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        update[i] = x;
+/* Enable the member index on an empty skiplist, using the specified hash
+ * function that must be consistent with sl->compare. */
+void skiplistEnableIndex(skiplist *sl, unsigned int (*hash)(const void *)) {
+    sl->hash = hash;
+}
+
+/* Account the bytes used by the objects with the given function, the set
+ * must be empty. */
+void skiplistSetObjSize(skiplist *sl, size_t (*objsize)(const void *)) {
+    sl->objsize = objsize;
+}
+
+/* Move the objects along with their nodes in skiplistDefrag(), using the
+ * specified function that copies obj to dst, objsize(obj) bytes with room
+ * for everything the object points to: the copy lives in a slab, and must
+ * not need sl->release. Needs skiplistSetObjSize(). */
+void skiplistSetObjMove(skiplist *sl, void (*objmove)(void *dst, const void *obj)) {
+    sl->objmove = objmove;
+}
+
+static void skiplistIndexResize(skiplist *sl, unsigned long size) {
+    skiplistNode **old = sl->index;
+    unsigned long oldsize = sl->indexsize, i, j;
+
+    sl->index = calloc(size,sizeof(skiplistNode *));
+    sl->indexsize = size;
+    for (i = 0; i < oldsize; i++) {
+        if (old[i] == NULL) continue;
+        j = sl->hash(old[i]->obj) & (size-1);
+        while (sl->index[j]) j = (j+1) & (size-1);
+        sl->index[j] = old[i];
     }
+    free(old);
+}
 
-    /* we assume the key is not already inside, since we allow duplicated
-     * scores, and the re-insertion of score and redis object should never
-     * happen since the caller of slInsert() should test in the hash table
-     * if the element is already inside or not. */
+/* Add a node to the index, the node must not be already indexed.
+ * sl->length must not account for the node yet. */
+void skiplistIndexAdd(skiplist *sl, skiplistNode *x) {
+    unsigned long j;
 
-    /* If the element is already inside, return NULL. */
-    if (x->level[0].forward &&
-        sl->compare(x->level[0].forward->obj,obj) == 0) return NULL;
+    if (!sl->hash) return;
+    if ((sl->length+1)*2 > sl->indexsize)
+        skiplistIndexResize(sl,sl->indexsize ? sl->indexsize*2 : 16);
+
+    j = sl->hash(x->obj) & (sl->indexsize-1);
+    while (sl->index[j]) j = (j+1) & (sl->indexsize-1);
+    sl->index[j] = x;
+}
+
+/* Point the index entry of node x to nx, its copy. */
+static void skiplistIndexReplace(skiplist *sl, skiplistNode *x, skiplistNode *nx) {
+    unsigned long j;
+
+    if (!sl->hash) return;
+    j = sl->hash(x->obj) & (sl->indexsize-1);
+    while (sl->index[j] != x) j = (j+1) & (sl->indexsize-1);
+    sl->index[j] = nx;
+}
+
+/* Remove a node from the index, shifting back the entries of the same probe
+ * sequence so that no tombstone is needed. sl->length must not account for
+ * the node anymore. */
+void skiplistIndexDelete(skiplist *sl, skiplistNode *x) {
+    unsigned long mask, i, j, k;
+
+    if (!sl->hash) return;
+    mask = sl->indexsize-1;
+    i = sl->hash(x->obj) & mask;
+    while (sl->index[i] != x) i = (i+1) & mask;
+    sl->index[i] = NULL;
+
+    for (j = (i+1) & mask; sl->index[j]; j = (j+1) & mask) {
+        k = sl->hash(sl->index[j]->obj) & mask;
+        /* Leave the entry in place if its home slot is cyclically in
+         * (i, j], otherwise it can be moved to fill the hole. */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        sl->index[i] = sl->index[j];
+        sl->index[j] = NULL;
+        i = j;
+    }
+
+    if (sl->indexsize > 16 && sl->length*8 < sl->indexsize)
+        skiplistIndexResize(sl,sl->indexsize/2);
+}
+
+/* The generic instantiation of the operations comparing objects, calling
+ * sl->compare and sl->hash. See skiplist_impl.h. */
+#define SKIPLIST_NAME(f) skiplist##f
+#define SKIPLIST_COMPARE(sl,a,b) (sl)->compare(a,b)
+#define SKIPLIST_HASH(sl,obj) (sl)->hash(obj)
+#define SKIPLIST_PREFIX(sl,obj) ((sl)->prefix ? (sl)->prefix(obj) : 0)
+#define SKIPLIST_API
+#include "skiplist_impl.h"
+
+/* Nodes with a time to live are tracked by a second skiplist, ordered by
+ * expire time, whose objects are the nodes of the main skiplist. Its member
+ * index is keyed by node address, so the expire entry of a node is found
+ * in O(1). Expire times are plain numbers, the caller chooses the clock. */
+
+static int skiplistComparePointer(const void *a, const void *b) {
+    return (a < b) ? -1 : (a > b);
+}
+
+static unsigned int skiplistHashPointer(const void *p) {
+    unsigned long long u = (unsigned long long)(size_t)p;
+
+    u ^= u >> 33;
+    u *= 0xff51afd7ed558ccdULL;
+    u ^= u >> 33;
+    return (unsigned int)u;
+}
+
+/* Set the expire time of a node, replacing the previous one if any. */
+void skiplistSetExpire(skiplist *sl, skiplistNode *x, double when) {
+    skiplistNode *e;
+
+    if (!sl->expires) {
+        sl->expires = skiplistCreate(skiplistComparePointer,NULL);
+        skiplistEnableIndex(sl->expires,skiplistHashPointer);
+    }
+
+    e = skiplistIndexFind(sl->expires,x);
+    if (e)
+        skiplistUpdateScore(sl->expires,e->score,x,when);
+    else
+        skiplistInsert(sl->expires,when,x);
+}
+
+/* Remove the expire time of a node. Returns 1 if the node had one. */
+int skiplistPersist(skiplist *sl, skiplistNode *x) {
+    skiplistNode *e;
+
+    if (!sl->expires || sl->expires->length == 0) return 0;
+    e = skiplistIndexFind(sl->expires,x);
+    if (!e) return 0;
+    return skiplistDelete(sl->expires,e->score,x);
+}
+
+/* Store the expire time of a node in '*when'. Returns 0 if the node has
+ * no expire time. */
+int skiplistGetExpire(skiplist *sl, skiplistNode *x, double *when) {
+    skiplistNode *e;
+
+    if (!sl->expires || sl->expires->length == 0) return 0;
+    e = skiplistIndexFind(sl->expires,x);
+    if (!e) return 0;
+    *when = e->score;
+    return 1;
+}
+
+/* Return 1 if some node has an expire time not after 'now'. This only
+ * looks at the head of the expire skiplist, so it is a cheap way to skip
+ * the per node checks when nothing has expired. */
+int skiplistHasExpired(skiplist *sl, double now) {
+    skiplistNode *e;
+
+    if (!sl->expires) return 0;
+    e = sl->expires->header->level[0].forward;
+    return e && e->score <= now;
+}
+
+/* Return 1 if the node has an expire time not after 'now'. */
+int skiplistIsExpired(skiplist *sl, skiplistNode *x, double now) {
+    double when;
+
+    if (!skiplistHasExpired(sl,now)) return 0;
+    return skiplistGetExpire(sl,x,&when) && when <= now;
+}
+
+/* Drop the node from the member index and the expire skiplist, it must be
+ * called for every node removed from the skiplist. */
+void skiplistForgetNode(skiplist *sl, skiplistNode *x) {
+    skiplistIndexDelete(sl,x);
+    skiplistPersist(sl,x);
+}
+
+/* Return the sum of the scores of all the nodes, walking the top level. */
+static double skiplistTotalSum(skiplist *sl) {
+    skiplistNode *x = sl->header;
+    int i = sl->level-1;
+    double sum = 0;
+
+    while (x) {
+        sum += skiplistSum(x,i);
+        x = x->level[i].forward;
+        skiplistHop();
+    }
+    return sum;
+}
+
+/* Link the node x, made of 'level' levels, at the position found by
+ * skiplistFindInsertPosition(). */
+void skiplistLinkNode(skiplist *sl, skiplistNode *x, int level,
+                      skiplistNode **update, unsigned int *rank,
+                      double *psum) {
+    int i;
 
-    /* Add a new node with a random number of levels. */
-    level = skiplistRandomLevel();
     if (level > sl->level) {
+        double total = sl->sums ? skiplistTotalSum(sl) : 0;
+
         for (i = sl->level; i < level; i++) {
             rank[i] = 0;
             update[i] = sl->header;
             update[i]->level[i].span = sl->length;
+            if (sl->sums) {
+                psum[i] = 0;
+                skiplistSum(update[i],i) = total;
+            }
         }
         sl->level = level;
     }
-    x = skiplistCreateNode(level,score,obj);
     for (i = 0; i < level; i++) {
         x->level[i].forward = update[i]->level[i].forward;
         update[i]->level[i].forward = x;
@@ -174,33 +800,52 @@ skiplistNode *skiplistInsert(skiplist *sl, double score, void *obj) {
         /* update span covered by update[i] as x is inserted here */
         x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
         update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+
+        if (sl->sums) {
+            skiplistSum(x,i) = skiplistSum(update[i],i) - (psum[0] - psum[i]);
+            skiplistSum(update[i],i) = (psum[0] - psum[i]) + x->score;
+        }
     }
 
     /* increment span for untouched levels */
     for (i = level; i < sl->level; i++) {
         update[i]->level[i].span++;
+        if (sl->sums) skiplistSum(update[i],i) += x->score;
     }
 
+    sl->levels[level-1]++;
+    if (sl->objsize) sl->objbytes += sl->objsize(x->obj);
+
     x->backward = (update[0] == sl->header) ? NULL : update[0];
     if (x->level[0].forward)
         x->level[0].forward->backward = x;
     else
         sl->tail = x;
     sl->length++;
-    return x;
+
+    if (sl->queue) {
+        for (i = 0; i < level; i++)
+            if (!x->level[i].forward) sl->queue->last[i] = x;
+    }
 }
 
 /* Internal function used by skiplistDelete, it needs an array of other
  * skiplist nodes that point to the node to delete in order to update
  * all the references of the node we are going to remove. */
 void skiplistDeleteNode(skiplist *sl, skiplistNode *x, skiplistNode **update) {
-    int i;
+    int i, level = 0;
     for (i = 0; i < sl->level; i++) {
         if (update[i]->level[i].forward == x) {
+            level++;
             update[i]->level[i].span += x->level[i].span - 1;
             update[i]->level[i].forward = x->level[i].forward;
+            if (sl->queue && sl->queue->last[i] == x)
+                sl->queue->last[i] = update[i];
+            if (sl->sums)
+                skiplistSum(update[i],i) += skiplistSum(x,i) - x->score;
         } else {
             update[i]->level[i].span -= 1;
+            if (sl->sums) skiplistSum(update[i],i) -= x->score;
         }
     }
     if (x->level[0].forward) {
@@ -211,134 +856,176 @@ void skiplistDeleteNode(skiplist *sl, skiplistNode *x, skiplistNode **update) {
     while(sl->level > 1 && sl->header->level[sl->level-1].forward == NULL)
         sl->level--;
     sl->length--;
+    sl->levels[level-1]--;
+    if (sl->objsize) sl->objbytes -= sl->objsize(x->obj);
 }
 
-/* Delete an element with matching score/object from the skiplist.
- * 1 is returned, otherwise if the element was not there, 0 is returned. */
-int skiplistDelete(skiplist *sl, double score, void *obj) {
+/* If the skip list is empty, NULL is returned, otherwise the element
+ * at head is removed and its pointed object returned. The object is not
+ * released, the caller takes the ownership.
+ *
+ * The head node is always reached directly from the header, so there is
+ * no need to search for the update vector. */
+void *skiplistPopHead(skiplist *sl) {
     skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+    void *obj;
     int i;
 
-    x = sl->header;
-    for (i = sl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                 sl->compare(x->level[i].forward->obj,obj) < 0)))
-        {
-            x = x->level[i].forward;
-        }
-        update[i] = x;
-    }
-    x = x->level[0].forward;
-    if (x && sl->compare(x->obj,obj) == 0) {
-        skiplistDeleteNode(sl,x,update);
-        skiplistFreeNode(sl,x);
-        return 1;
-    }
-    return 0; /* not found */
+    x = sl->header->level[0].forward;
+    if (!x) return NULL;
+    for (i = 0; i < sl->level; i++)
+        update[i] = sl->header;
+    obj = x->obj;
+    skiplistDeleteNode(sl,x,update);
+    skiplistForgetNode(sl,x);
+    skiplistDoFreeNode(sl,x);
+    return obj;
 }
 
-/* Update the score of an object inside the sorted set skiplist.
- * Note that the object must exist and must match 'score'.
- * This function does not update the score in the hash table side, the
- * caller should take care of it.
- *
- * Note that this function attempts to just update the node, in case after
- * the score update, the node would be exactly at the same position.
- * Otherwise the skiplist is modified by removing and re-adding a new
- * object, which is more costly.
+/* If the skip list is empty, NULL is returned, otherwise the element
+ * at tail is removed and its pointed object returned. The object is not
+ * released, the caller takes the ownership.
  *
- * The function returns the updated object skiplist node pointer. */
-skiplistNode *skiplistUpdateScore(skiplist *sl, double curscore, void *obj, double newscore) {
-    skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+ * Since the tail is the last node of every level it belongs to, the update
+ * vector is found by following the forward pointers until they reach the
+ * tail, without comparing any object. */
+void *skiplistPopTail(skiplist *sl) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x, *tail = sl->tail;
+    void *obj;
     int i;
 
-    /* We need to seek to object to update to start: this is useful anyway,
-     * we'll have to update or remove it. */
+    if (!tail) return NULL;
     x = sl->header;
     for (i = sl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < curscore ||
-                    (x->level[i].forward->score == curscore &&
-                     sl->compare(x->level[i].forward->obj,obj) < 0)))
-        {
+        while (x->level[i].forward && x->level[i].forward != tail) {
             x = x->level[i].forward;
+            skiplistHop();
         }
         update[i] = x;
     }
+    obj = tail->obj;
+    skiplistDeleteNode(sl,tail,update);
+    skiplistForgetNode(sl,tail);
+    skiplistDoFreeNode(sl,tail);
+    return obj;
+}
 
-    /* Jump to our object: note that this function assumes that the
-     * object with the matching score exists. */
-    x = x->level[0].forward;
-    // serverAssert(x && curscore == x->score && sl->compare(x->obj,obj) == 0);
-
-    /* If the node, after the score update, would be still exactly
-     * at the same position, we can just update the score without
-     * actually removing and re-inserting the object in the skiplist. */
-    if ((x->backward == NULL || x->backward->score < newscore) &&
-        (x->level[0].forward == NULL || x->level[0].forward->score > newscore))
-    {
-        x->score = newscore;
+/* Turn an empty skiplist into a queue: equal scores are ordered by push,
+ * oldest first, and never compare their objects. The elements must be
+ * added with skiplistPush() and deleted with skiplistPopHead() or
+ * skiplistQueueDelete(). Queues have no node prefix and no score sums,
+ * and objects are only found through the member index. */
+void skiplistEnableQueue(skiplist *sl) {
+    int i;
+
+    if (sl->queue) return;
+    sl->prefix = NULL;
+    sl->queue = calloc(1,sizeof(*sl->queue));
+    for (i = 0; i < SKIPLIST_MAXLEVEL; i++)
+        sl->queue->last[i] = sl->header;
+}
+
+/* Add an element to a queue after all the elements of a lower or equal
+ * score. NULL is returned if the member index already holds obj. A score
+ * not lower than the one of the tail is linked after the last node of
+ * every level without any descent, otherwise the descent only compares
+ * scores. */
+skiplistNode *skiplistPush(skiplist *sl, double score, void *obj) {
+    skiplistQueue *q = sl->queue;
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+    unsigned int rank[SKIPLIST_MAXLEVEL];
+    int i, level;
+
+    if (sl->hash && skiplistIndexFind(sl,obj)) return NULL;
+
+    level = skiplistRandomLevel();
+    x = skiplistTakeNode(sl,level,score,obj);
+    x->prefix = q->seq++;
+    skiplistIndexAdd(sl,x);
+
+    if (sl->tail && sl->tail->score > score) {
+        for (i = sl->level-1; i >= 0; i--) {
+            rank[i] = i == (sl->level-1) ? 0 : rank[i+1];
+            update[i] = i == (sl->level-1) ? sl->header : update[i+1];
+            while (update[i]->level[i].forward &&
+                   update[i]->level[i].forward->score <= score)
+            {
+                rank[i] += update[i]->level[i].span;
+                update[i] = update[i]->level[i].forward;
+                skiplistHop();
+            }
+        }
+        skiplistLinkNode(sl,x,level,update,rank,NULL);
         return x;
     }
 
-    /* No way to reuse the old node: we need to remove and insert a new
-     * one at a different place. */
-    skiplistDeleteNode(sl,x,update);
-    skiplistNode *newnode = skiplistInsert(sl,newscore,x->obj);
-    /* We reused the old node x->obj object, free the node now
-     * since zslInsert created a new one. */
-    x->obj = NULL;
-    /* Only free the node self, since its pointed object is moved. */
-    skiplistDoFreeNode(x);
-    return newnode;
+    /* The last node of a level spans the remaining nodes, one more now. */
+    if (level > sl->level) {
+        for (i = sl->level; i < level; i++)
+            sl->header->level[i].span = sl->length;
+        sl->level = level;
+    }
+    for (i = 0; i < sl->level; i++) {
+        q->last[i]->level[i].span++;
+        if (i < level) {
+            q->last[i]->level[i].forward = x;
+            x->level[i].forward = NULL;
+            x->level[i].span = 0;
+            q->last[i] = x;
+        }
+    }
+    sl->levels[level-1]++;
+    if (sl->objsize) sl->objbytes += sl->objsize(x->obj);
+    x->backward = sl->tail;
+    sl->tail = x;
+    sl->length++;
+    return x;
 }
 
-
-/* Search for the element in the skip list, if found the
- * node pointer is returned, otherwise NULL is returned. */
-void *skiplistFind(skiplist *sl, void *obj) {
-    skiplistNode *x;
+/* Delete node x of a queue, the descent compares the scores and the
+ * sequence numbers only. */
+void skiplistQueueDelete(skiplist *sl, skiplistNode *x) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *y = sl->header, *next;
     int i;
 
-    x = sl->header;
     for (i = sl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-               sl->compare(x->level[i].forward->obj,obj) < 0)
+        while ((next = y->level[i].forward) &&
+               (next->score < x->score ||
+                (next->score == x->score && next->prefix < x->prefix)))
         {
-            x = x->level[i].forward;
+            y = next;
+            skiplistHop();
         }
+        update[i] = y;
     }
-    x = x->level[0].forward;
-    if (x && sl->compare(x->obj,obj) == 0) {
-        return x;
-    } else {
-        return NULL;
-    }
+    skiplistDeleteNode(sl,x,update);
+    skiplistForgetNode(sl,x);
+    skiplistFreeNode(sl,x);
 }
 
-/* If the skip list is empty, NULL is returned, otherwise the element
- * at head is removed and its pointed object returned. */
-void *skiplistPopHead(skiplist *sl) {
-    skiplistNode *x = sl->header;
-
-    x = x->level[0].forward;
-    if (!x) return NULL;
-    void *obj = x->obj;
-    skiplistDelete(sl,x->score,obj);
-    return obj;
+/* Bound the skiplist to 'maxlength' elements, 0 means unbounded. Once the
+ * capacity is reached, every accepted insertion is followed by the eviction
+ * of the element at the end selected by 'evict'. */
+void skiplistSetMaxLength(skiplist *sl, unsigned long maxlength, int evict) {
+    sl->maxlength = maxlength;
+    sl->evict = evict;
 }
 
-/* If the skip list is empty, NULL is returned, otherwise the element
- * at tail is removed and its pointed object returned. */
-void *skiplistPopTail(skiplist *sl) {
-    skiplistNode *x = sl->tail;
+/* If the skiplist holds more elements than its capacity, remove the boundary
+ * element selected by the eviction policy and return its object, storing the
+ * score in '*score' when not NULL. The object is not released, the caller
+ * takes the ownership. NULL is returned when nothing has to be evicted. */
+void *skiplistEvict(skiplist *sl, double *score) {
+    skiplistNode *x;
 
-    if (!x) return NULL;
-    void *obj = x->obj;
-    skiplistDelete(sl,x->score,obj);
-    return obj;
+    if (sl->maxlength == 0 || sl->length <= sl->maxlength)
+        return NULL;
+
+    x = sl->evict == SKIPLIST_EVICT_MIN ? sl->header->level[0].forward
+                                        : sl->tail;
+    if (score) *score = x->score;
+    return sl->evict == SKIPLIST_EVICT_MIN ? skiplistPopHead(sl)
+                                           : skiplistPopTail(sl);
 }
 
 unsigned long skiplistLength(skiplist *sl) {
@@ -346,20 +1033,26 @@ unsigned long skiplistLength(skiplist *sl) {
 }
 
 /* Delete all the elements with rank between start and end from the skiplist.
- * Start and end are inclusive. Note that start and end need to be 1-based */
+ * Start and end are inclusive. Note that start and end need to be 1-based.
+ * The callback is optional, when given it is called for every element
+ * right before the element is released. */
 unsigned long skiplistDeleteRangeByRank(skiplist *sl, unsigned int start, unsigned int end, skiplistDeleteCb cb, void *ctx) {
     skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
     unsigned long traversed = 0, removed = 0;
     int i;
+    skiplistProbeEntry(delete_range_by_rank,sl,start);
 
-    if (start > sl->length || end < 1)
+    if (start > sl->length || end < 1) {
+        skiplistProbeReturn(delete_range_by_rank,sl,start);
         return 0;
+    }
 
     x = sl->header;
     for (i = sl->level-1; i >= 0; i--) {
         while (x->level[i].forward && (traversed + x->level[i].span) < start) {
             traversed += x->level[i].span;
             x = x->level[i].forward;
+            skiplistHop();
         }
         update[i] = x;
     }
@@ -369,40 +1062,386 @@ unsigned long skiplistDeleteRangeByRank(skiplist *sl, unsigned int start, unsign
     while (x && traversed <= end) {
         skiplistNode *next = x->level[0].forward;
         skiplistDeleteNode(sl,x,update);
-        cb(ctx,x->obj);
+        skiplistForgetNode(sl,x);
+        if (cb) cb(ctx,x->obj);
         skiplistFreeNode(sl,x);
         removed++;
         traversed++;
         x = next;
     }
+    skiplistProbeReturn(delete_range_by_rank,sl,start);
     return removed;
 }
 
-/* Find the rank for an element by both score and key.
- * Returns 0 when the element cannot be found, rank otherwise.
- * Note that the rank is 1-based due to the span of sl->header to the
- * first element. */
-unsigned long skiplistGetRank(skiplist *sl, double score, void *obj) {
-    skiplistNode *x;
-    unsigned long rank = 0;
-    int i;
+/* Move the elements with rank above 'rank' to dst, an empty skiplist
+ * created the same way as sl, keeping the first 'rank' ones in sl. Every
+ * level is cut after the last node it keeps, so the relinking costs a
+ * single descent. The moved nodes are then visited once to migrate their
+ * member index entries, expire times and statistics. */
+void skiplistSplit(skiplist *sl, unsigned long rank, skiplist *dst) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *next[SKIPLIST_MAXLEVEL], *x;
+    unsigned long traversed = 0, crossed[SKIPLIST_MAXLEVEL];
+    double psum[SKIPLIST_MAXLEVEL], sum = 0, when;
+    size_t size;
+    int i, level;
+
+    if (rank >= sl->length) return;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward && traversed + x->level[i].span <= rank) {
+            traversed += x->level[i].span;
+            if (sl->sums) sum += skiplistSum(x,i);
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+        update[i] = x;
+        crossed[i] = traversed;
+        psum[i] = sum;
+    }
+
+    /* The spans and sums of a last node cover the nodes after it, the part
+     * beyond the cut goes to the header of dst. */
+    for (i = 0; i < sl->level; i++) {
+        x = update[i];
+        next[i] = x->level[i].forward;
+        dst->header->level[i].forward = next[i];
+        dst->header->level[i].span = x->level[i].span - (rank - crossed[i]);
+        x->level[i].forward = NULL;
+        x->level[i].span = rank - crossed[i];
+        if (sl->sums) {
+            skiplistSum(dst->header,i) = skiplistSum(x,i) - (psum[0] - psum[i]);
+            skiplistSum(x,i) = psum[0] - psum[i];
+        }
+    }
+
+    next[0]->backward = NULL;
+    skiplistSlabsMerge(dst,sl,0);
+    dst->tail = sl->tail;
+    sl->tail = (update[0] == sl->header) ? NULL : update[0];
+    dst->level = sl->level;
+    while (sl->level > 1 && sl->header->level[sl->level-1].forward == NULL)
+        sl->level--;
+    while (dst->level > 1 && dst->header->level[dst->level-1].forward == NULL)
+        dst->level--;
+
+    for (x = next[0]; x; x = x->level[0].forward) {
+        /* The levels of x are the ones whose next moved node is x. */
+        for (level = 0; level < dst->level && next[level] == x; level++)
+            next[level] = x->level[level].forward;
+        sl->levels[level-1]--;
+        dst->levels[level-1]++;
+        if (sl->objsize) {
+            size = sl->objsize(x->obj);
+            sl->objbytes -= size;
+            dst->objbytes += size;
+        }
+
+        sl->length--;
+        skiplistIndexDelete(sl,x);
+        skiplistIndexAdd(dst,x);
+        dst->length++;
+
+        if (skiplistGetExpire(sl,x,&when)) {
+            skiplistPersist(sl,x);
+            skiplistSetExpire(dst,x,when);
+        }
+    }
+}
+
+/* Append the elements of other, a distinct skiplist created the same way
+ * as sl, leaving other empty. The last node of every level of sl is linked
+ * to the first node of the same level of other, so the relinking costs a
+ * single descent along the tail. The member index entries and expire
+ * times of the appended nodes are migrated one by one. Returns 0, changing
+ * nothing, if the elements of other do not all come after the ones of sl,
+ * or if the member index is enabled and a member of other is in sl too. */
+int skiplistConcat(skiplist *sl, skiplist *other) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+    double total = 0, ototal = 0;
+    int i, level;
+
+    x = other->header->level[0].forward;
+    if (!x) return 1;
+    if (sl->tail && !skiplistNodeLess(sl,sl->tail,x)) return 0;
+    if (sl->hash && sl->length) {
+        for (; x; x = x->level[0].forward)
+            if (skiplistFind(sl,x->obj)) return 0;
+    }
+
+    if (sl->sums) {
+        total = skiplistTotalSum(sl);
+        ototal = skiplistTotalSum(other);
+    }
+
+    /* Seek the last node of every level. */
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward) {
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+        update[i] = x;
+    }
+
+    level = sl->level > other->level ? sl->level : other->level;
+    for (i = sl->level; i < level; i++) {
+        update[i] = sl->header;
+        update[i]->level[i].span = sl->length;
+        if (sl->sums) skiplistSum(update[i],i) = total;
+    }
+
+    for (i = 0; i < level; i++) {
+        x = update[i];
+        if (i < other->level) {
+            x->level[i].forward = other->header->level[i].forward;
+            x->level[i].span += other->header->level[i].span;
+            if (sl->sums) skiplistSum(x,i) += skiplistSum(other->header,i);
+        } else {
+            x->level[i].span += other->length;
+            if (sl->sums) skiplistSum(x,i) += ototal;
+        }
+    }
+
+    x = other->header->level[0].forward;
+    x->backward = sl->tail;
+    sl->tail = other->tail;
+    sl->level = level;
+    for (i = 0; i < SKIPLIST_MAXLEVEL; i++) {
+        sl->levels[i] += other->levels[i];
+        other->levels[i] = 0;
+    }
+    sl->objbytes += other->objbytes;
+    other->objbytes = 0;
+    skiplistSlabsMerge(sl,other,1);
+
+    if (sl->hash) {
+        for (; x; x = x->level[0].forward) {
+            skiplistIndexAdd(sl,x);
+            sl->length++;
+        }
+    } else {
+        sl->length += other->length;
+    }
+
+    if (other->expires) {
+        for (x = other->expires->header->level[0].forward; x;
+             x = x->level[0].forward)
+            skiplistSetExpire(sl,x->obj,x->score);
+        skiplistFree(other->expires);
+        other->expires = NULL;
+    }
+
+    for (i = 0; i < SKIPLIST_MAXLEVEL; i++) {
+        other->header->level[i].forward = NULL;
+        other->header->level[i].span = 0;
+        if (other->sums) skiplistSum(other->header,i) = 0;
+    }
+    other->tail = NULL;
+    other->length = 0;
+    other->level = 1;
+    free(other->index);
+    other->index = NULL;
+    other->indexsize = 0;
+    return 1;
+}
+
+/* Move the element with matching score/object from sl to dst, a skiplist
+ * created the same way as sl, under a new score. The node is unlinked and
+ * linked again keeping its levels, like skiplistUpdateScore() does, so
+ * neither the node nor its object is reallocated and the pointers to the
+ * node stay valid. Its expire time and slabs follow it. Queues are not
+ * supported. Returns the node, or NULL if the element is not in sl or its
+ * object is already in dst. */
+skiplistNode *skiplistMoveNode(skiplist *sl, double curscore, void *obj, skiplist *dst, double newscore) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *dstupdate[SKIPLIST_MAXLEVEL], *x;
+    unsigned int rank[SKIPLIST_MAXLEVEL];
+    double psum[SKIPLIST_MAXLEVEL], when;
+    uint64_t prefix = sl->prefix ? sl->prefix(obj) : 0;
+    int i, level, expire;
 
     x = sl->header;
     for (i = sl->level-1; i >= 0; i--) {
         while (x->level[i].forward &&
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                 sl->compare(x->level[i].forward->obj,obj) <= 0))) {
+            (x->level[i].forward->score < curscore ||
+                (x->level[i].forward->score == curscore &&
+                 skiplistCompareNode(sl,x->level[i].forward,obj,prefix) < 0)))
+        {
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+        update[i] = x;
+    }
+    x = x->level[0].forward;
+    if (!x || curscore != x->score || skiplistCompareNode(sl,x,obj,prefix) != 0)
+        return NULL;
+    if ((dst->hash && skiplistIndexFind(dst,obj)) ||
+        !skiplistFindInsertPosition(dst,newscore,obj,dstupdate,rank,psum))
+        return NULL;
+
+    /* The node levels are the ones where its predecessor points to it. */
+    for (level = 1; level < sl->level; level++)
+        if (update[level]->level[level].forward != x) break;
+
+    expire = skiplistGetExpire(sl,x,&when);
+    skiplistDeleteNode(sl,x,update);
+    skiplistForgetNode(sl,x);
+    x->score = newscore;
+    skiplistIndexAdd(dst,x);
+    skiplistLinkNode(dst,x,level,dstupdate,rank,psum);
+    if (expire) skiplistSetExpire(dst,x,when);
+    skiplistSlabsMerge(dst,sl,0);
+    return x;
+}
+
+/* Move at most 'budget' nodes to the open slab, in list order, starting
+ * where the previous call stopped, so that after a lot of churn logically
+ * adjacent nodes are next to each other in memory again. The objects are
+ * moved too, right after their node, if sl->objmove is set. The walk keeps
+ * the last node of every level seen so far, whose forward pointer is the
+ * one to patch when the node it points to moves. Returns 1 when the step
+ * reached the end of the list, the next one then starts over from the
+ * first node.
+ *
+ * The resume point is a rank, so insertions and deletions between two
+ * steps may make a pass skip or move again as many nodes. Pointers to the
+ * moved nodes and objects are invalidated. */
+int skiplistDefrag(skiplist *sl, unsigned long budget) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x, *nx;
+    unsigned long rank = 0, moved = 0;
+    size_t size, prefix;
+    double when;
+    void *obj;
+    int i, level, expires;
+
+    if (sl->slabs) skiplistSlabsPrune(sl->slabs);
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward && rank + x->level[i].span <= sl->defragrank) {
             rank += x->level[i].span;
             x = x->level[i].forward;
+            skiplistHop();
+        }
+        update[i] = x;
+    }
+
+    x = update[0]->level[0].forward;
+    while (x && moved < budget) {
+        for (level = 0; level < sl->level && update[level]->level[level].forward == x; level++);
+        size = skiplistNodeSize(sl,level);
+        prefix = sl->sums ? ((size_t *)x)[-1] : 0;
+        nx = (skiplistNode *)((char *)skiplistSlabAlloc(sl,size)+prefix);
+        memcpy((char *)nx-prefix,(char *)x-prefix,size);
+
+        expires = skiplistGetExpire(sl,x,&when);
+        if (expires) skiplistPersist(sl,x);
+        skiplistIndexReplace(sl,x,nx);
+        if (sl->objmove && sl->objsize) {
+            obj = skiplistSlabAlloc(sl,sl->objsize(x->obj));
+            sl->objmove(obj,x->obj);
+            skiplistRelease(sl,x->obj);
+            nx->obj = obj;
+        }
+
+        for (i = 0; i < level; i++) {
+            update[i]->level[i].forward = nx;
+            update[i] = nx;
+            if (sl->queue && sl->queue->last[i] == x) sl->queue->last[i] = nx;
+        }
+        if (nx->level[0].forward)
+            nx->level[0].forward->backward = nx;
+        else
+            sl->tail = nx;
+        if (expires) skiplistSetExpire(sl,nx,when);
+
+        skiplistDoFreeNode(sl,x);
+        x = nx->level[0].forward;
+        moved++;
+    }
+
+    sl->defragrank = x ? rank+moved : 0;
+    return x == NULL;
+}
+
+/* Return 1 if node a comes before node b, by score then object. */
+int skiplistNodeBefore(skiplist *sl, skiplistNode *a, skiplistNode *b) {
+    return skiplistNodeLess(sl,a,b);
+}
+
+/* Sort n nodes by score then object. The merge sort is stable, so equal
+ * elements keep their order. tmp is scratch space for n nodes. */
+void skiplistMergeSortNodes(skiplist *sl, skiplistNode **nodes, skiplistNode **tmp, unsigned long n) {
+    unsigned long mid = n/2, i = 0, j = mid, k = 0;
+    skiplistNode *x;
+
+    if (n < 16) {
+        for (i = 1; i < n; i++) {
+            x = nodes[i];
+            for (j = i; j > 0 && skiplistNodeLess(sl,x,nodes[j-1]); j--)
+                nodes[j] = nodes[j-1];
+            nodes[j] = x;
         }
+        return;
+    }
+    skiplistMergeSortNodes(sl,nodes,tmp,mid);
+    skiplistMergeSortNodes(sl,nodes+mid,tmp,n-mid);
+    if (!skiplistNodeLess(sl,nodes[mid],nodes[mid-1])) return;
+
+    while (i < mid && j < n) {
+        if (skiplistNodeLess(sl,nodes[j],nodes[i]))
+            tmp[k++] = nodes[j++];
+        else
+            tmp[k++] = nodes[i++];
+    }
+    while (i < mid) tmp[k++] = nodes[i++];
+    while (j < n) tmp[k++] = nodes[j++];
+    memcpy(nodes,tmp,n*sizeof(*nodes));
+}
+
+/* Link n nodes, sorted and distinct, into the empty skiplist sl without
+ * any search: every level of a new node is appended after the last node
+ * of that level so far. The nodes are created by skiplistNewNode() with
+ * their number of levels stored in level[0].span until they are linked. */
+void skiplistAppendNodes(skiplist *sl, skiplistNode **nodes, unsigned long n) {
+    skiplistNode *last[SKIPLIST_MAXLEVEL], *x;
+    unsigned long rank[SKIPLIST_MAXLEVEL], k;
+    double psum[SKIPLIST_MAXLEVEL], sum = 0;
+    int i, level;
+
+    for (i = 0; i < SKIPLIST_MAXLEVEL; i++) {
+        last[i] = sl->header;
+        rank[i] = 0;
+        psum[i] = 0;
+    }
 
-        /* x might be equal to sl->header, so test if obj is non-NULL */
-        if (x->obj && sl->compare(x->obj,obj) == 0) {
-            return rank;
+    for (k = 0; k < n; k++) {
+        x = nodes[k];
+        level = x->level[0].span;
+        sum += x->score;
+        for (i = 0; i < level; i++) {
+            last[i]->level[i].forward = x;
+            last[i]->level[i].span = k+1-rank[i];
+            if (sl->sums) skiplistSum(last[i],i) = sum-psum[i];
+            last[i] = x;
+            rank[i] = k+1;
+            psum[i] = sum;
         }
+        x->backward = k ? nodes[k-1] : NULL;
+        if (level > sl->level) sl->level = level;
+        sl->levels[level-1]++;
+        if (sl->objsize) sl->objbytes += sl->objsize(x->obj);
+        skiplistIndexAdd(sl,x);
+        sl->length++;
     }
-    return 0;
+
+    /* The last node of every level spans the nodes after it. */
+    for (i = 0; i < sl->level; i++) {
+        last[i]->level[i].forward = NULL;
+        last[i]->level[i].span = n-rank[i];
+        if (sl->sums) skiplistSum(last[i],i) = sum-psum[i];
+    }
+    sl->tail = n ? nodes[n-1] : NULL;
 }
 
 static inline int skiplistValueGteMin(double value, double min, int minex) {
@@ -418,6 +1457,7 @@ unsigned long skiplistGetScoreRank(skiplist *sl, double score, int ex) {
     skiplistNode *x;
     unsigned long rank = 0;
     int i;
+    skiplistProbeEntry(get_score_rank,sl,score);
 
     x = sl->header;
     for (i = sl->level-1; i >= 0; i--) {
@@ -425,8 +1465,10 @@ unsigned long skiplistGetScoreRank(skiplist *sl, double score, int ex) {
                skiplistValueLteMax(x->level[i].forward->score,score,ex)) {
             rank += x->level[i].span;
             x = x->level[i].forward;
+            skiplistHop();
         }
     }
+    skiplistProbeReturn(get_score_rank,sl,score);
     return rank;
 }
 
@@ -435,9 +1477,12 @@ skiplistNode* skiplistGetNodeByRank(skiplist *sl, unsigned long rank) {
     skiplistNode *x;
     unsigned long traversed = 0;
     int i;
+    skiplistProbeEntry(get_node_by_rank,sl,rank);
 
-    if (rank == 0 || rank > sl->length)
+    if (rank == 0 || rank > sl->length) {
+        skiplistProbeReturn(get_node_by_rank,sl,rank);
         return NULL;
+    }
 
     x = sl->header;
     for (i = sl->level-1; i >= 0; i--) {
@@ -445,14 +1490,140 @@ skiplistNode* skiplistGetNodeByRank(skiplist *sl, unsigned long rank) {
         {
             traversed += x->level[i].span;
             x = x->level[i].forward;
+            skiplistHop();
         }
         if (traversed == rank) {
+            skiplistProbeReturn(get_node_by_rank,sl,rank);
             return x;
         }
     }
+    skiplistProbeReturn(get_node_by_rank,sl,rank);
     return NULL;
 }
 
+/* Finds the elements of several ranks at once, storing in nodes[k] the
+ * element of ranks[k], or NULL when the rank is out of range. The ranks
+ * must be sorted in ascending order: the last node visited at every level
+ * is remembered, and every descent starts each level from there when it is
+ * further than the node reached from the level above. The forward moves
+ * done at every level are never done again, so the whole lookup is a
+ * single left to right pass. */
+void skiplistGetNodesByRank(skiplist *sl, const unsigned long *ranks, skiplistNode **nodes, unsigned long n) {
+    skiplistNode *path[SKIPLIST_MAXLEVEL], *x;
+    unsigned long pathrank[SKIPLIST_MAXLEVEL], traversed, rank, k;
+    int i;
+
+    for (i = 0; i < sl->level; i++) {
+        path[i] = sl->header;
+        pathrank[i] = 0;
+    }
+
+    for (k = 0; k < n; k++) {
+        rank = ranks[k];
+        nodes[k] = NULL;
+        if (rank == 0 || rank > sl->length) continue;
+
+        x = sl->header;
+        traversed = 0;
+        for (i = sl->level-1; i >= 0; i--) {
+            if (pathrank[i] > traversed) {
+                x = path[i];
+                traversed = pathrank[i];
+            }
+            while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
+            {
+                traversed += x->level[i].span;
+                x = x->level[i].forward;
+                skiplistHop();
+            }
+            path[i] = x;
+            pathrank[i] = traversed;
+            if (traversed == rank) {
+                nodes[k] = x;
+                break;
+            }
+        }
+    }
+}
+
+/* Return the sum of the scores of the elements with rank between 1 and
+ * 'rank', the rank being clamped to the length. Score sums must be
+ * enabled. */
+static double skiplistPrefixSumByRank(skiplist *sl, unsigned long rank) {
+    skiplistNode *x;
+    unsigned long traversed = 0;
+    double sum = 0;
+    int i;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
+        {
+            traversed += x->level[i].span;
+            sum += skiplistSum(x,i);
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+    }
+    return sum;
+}
+
+/* Return the sum of the scores of the elements with rank between start and
+ * end, both inclusive and 1-based, in O(log(N)). Score sums must be
+ * enabled. */
+double skiplistSumByRank(skiplist *sl, unsigned long start, unsigned long end) {
+    if (start < 1) start = 1;
+    if (end > sl->length) end = sl->length;
+    if (start > end) return 0;
+    return skiplistPrefixSumByRank(sl,end) - skiplistPrefixSumByRank(sl,start-1);
+}
+
+/* Return the sum of the scores of the elements with a score lower than (or
+ * equal to when 'ex' is 0) the given score, storing their number in
+ * '*count'. Score sums must be enabled. */
+static double skiplistPrefixSumByScore(skiplist *sl, double score, int ex, unsigned long *count) {
+    skiplistNode *x;
+    unsigned long rank = 0;
+    double sum = 0;
+    int i;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+               skiplistValueLteMax(x->level[i].forward->score,score,ex)) {
+            rank += x->level[i].span;
+            sum += skiplistSum(x,i);
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+    }
+    *count = rank;
+    return sum;
+}
+
+/* Return the sum of the scores in the specified score range, storing the
+ * number of elements in the range in '*count', in O(log(N)). Score sums
+ * must be enabled. */
+double skiplistSumByScore(skiplist *sl, double min, double max, int minex, int maxex, unsigned long *count) {
+    unsigned long lo, hi;
+    double sum;
+
+    if (min > max || (min == max && (minex || maxex))) {
+        *count = 0;
+        return 0;
+    }
+    sum = skiplistPrefixSumByScore(sl,max,maxex,&hi);
+    sum -= skiplistPrefixSumByScore(sl,min,!minex,&lo);
+    *count = hi - lo;
+    return sum;
+}
+
+/* Return the number of elements in the specified score range. */
+unsigned long skiplistCountByScore(skiplist *sl, double min, double max, int minex, int maxex) {
+    if (min > max || (min == max && (minex || maxex))) return 0;
+    return skiplistGetScoreRank(sl,max,maxex) - skiplistGetScoreRank(sl,min,!minex);
+}
+
 /* Returns if there is a part of the zset is in range. */
 int skiplistIsInRange(skiplist *sl, double min, double max, int minex, int maxex) {
     skiplistNode *x;
@@ -474,16 +1645,22 @@ int skiplistIsInRange(skiplist *sl, double min, double max, int minex, int maxex
 skiplistNode *skiplistFirstInRange(skiplist *sl, double min, double max, int minex, int maxex) {
     skiplistNode *x;
     int i;
+    skiplistProbeEntry(first_in_range,sl,min);
 
     /* If everything is out of range, return early. */
-    if (!skiplistIsInRange(sl,min,max,minex,maxex)) return NULL;
+    if (!skiplistIsInRange(sl,min,max,minex,maxex)) {
+        skiplistProbeReturn(first_in_range,sl,min);
+        return NULL;
+    }
 
     x = sl->header;
     for (i = sl->level-1; i >= 0; i--) {
         /* Go forward while *OUT* of range. */
         while (x->level[i].forward &&
-            !skiplistValueGteMin(x->level[i].forward->score,min,minex))
+            !skiplistValueGteMin(x->level[i].forward->score,min,minex)) {
                 x = x->level[i].forward;
+                skiplistHop();
+        }
     }
 
     /* This is an inner range, so the next node cannot be NULL. */
@@ -491,7 +1668,8 @@ skiplistNode *skiplistFirstInRange(skiplist *sl, double min, double max, int min
     // serverAssert(x != NULL);
 
     /* Check if score <= max. */
-    if (!skiplistValueLteMax(x->score,max,maxex)) return NULL;
+    if (!skiplistValueLteMax(x->score,max,maxex)) x = NULL;
+    skiplistProbeReturn(first_in_range,sl,min);
     return x;
 }
 
@@ -500,23 +1678,30 @@ skiplistNode *skiplistFirstInRange(skiplist *sl, double min, double max, int min
 skiplistNode *skiplistLastInRange(skiplist *sl, double min, double max, int minex, int maxex) {
     skiplistNode *x;
     int i;
+    skiplistProbeEntry(last_in_range,sl,min);
 
     /* If everything is out of range, return early. */
-    if (!skiplistIsInRange(sl,min,max,minex,maxex)) return NULL;
+    if (!skiplistIsInRange(sl,min,max,minex,maxex)) {
+        skiplistProbeReturn(last_in_range,sl,min);
+        return NULL;
+    }
 
     x = sl->header;
     for (i = sl->level-1; i >= 0; i--) {
         /* Go forward while *IN* range. */
         while (x->level[i].forward &&
-            skiplistValueLteMax(x->level[i].forward->score,max,maxex))
+            skiplistValueLteMax(x->level[i].forward->score,max,maxex)) {
                 x = x->level[i].forward;
+                skiplistHop();
+        }
     }
 
     /* This is an inner range, so this node cannot be NULL. */
     // serverAssert(x != NULL);
 
     /* Check if score >= min. */
-    if (!skiplistValueGteMin(x->score,min,minex)) return NULL;
+    if (!skiplistValueGteMin(x->score,min,minex)) x = NULL;
+    skiplistProbeReturn(last_in_range,sl,min);
     return x;
 }
 
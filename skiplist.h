@@ -38,12 +38,20 @@
 #ifndef __SKIPLIST_H
 #define __SKIPLIST_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define SKIPLIST_MAXLEVEL 32 /* Should be enough for 2^32 elements */
 #define SKIPLIST_P 0.25      /* Skiplist P = 1/4 */
 
+/* Eviction policies of a capacity-bounded skiplist. */
+#define SKIPLIST_EVICT_MIN 0 /* drop the element with the lowest score */
+#define SKIPLIST_EVICT_MAX 1 /* drop the element with the highest score */
+
 typedef struct skiplistNode {
     void *obj;
     double score;
+    uint64_t prefix; // order preserving prefix of obj, see skiplistEnablePrefix()
     struct skiplistNode *backward; // backward pointer, only exist in level zero list
     struct skiplistLevel {
         struct skiplistNode *forward; // next node, may skip a lot of nodes
@@ -55,27 +63,101 @@ typedef struct skiplist {
     struct skiplistNode *header, *tail;
     int (*compare)(const void *, const void *);
     void (*release)(void *);
+    unsigned int (*hash)(const void *); // member index hash, NULL if disabled
+    uint64_t (*prefix)(const void *); // node prefix of an object, NULL if disabled
+    struct skiplistNode **index; // member index, open addressing table
+    unsigned long indexsize; // number of slots of the member index
+    struct skiplist *expires; // nodes with an expire time, by expire time
+    int sums; // whether levels also record the sum of the scores they span
+    size_t (*objsize)(const void *); // bytes used by an object, NULL if unknown
+    size_t objbytes; // bytes used by all the objects
+    void (*objmove)(void *, const void *); // copies an object for skiplistDefrag(), NULL if unknown
+    unsigned long defragrank; // rank where the next skiplistDefrag() step resumes
+    struct skiplistSlabs *slabs; // slabs filled by skiplistDefrag(), NULL if none
+    struct skiplistPool *pool; // nodes left by skiplistClear(), NULL if none
+    struct skiplistQueue *queue; // FIFO order of equal scores, NULL if disabled
+    unsigned long levels[SKIPLIST_MAXLEVEL]; // number of nodes of each level
     unsigned long length; // number of nodes
+    unsigned long maxlength; // capacity, 0 means unbounded
+    int evict; // eviction policy when the capacity is reached
     int level; // current level
 } skiplist;
 
+/* Build with -DSKIPLIST_METRICS to count the work done by the skiplist,
+ * the counters are global. Otherwise skiplistMetricsAdd() compiles to
+ * nothing. */
+#ifdef SKIPLIST_METRICS
+typedef struct skiplistMetrics {
+    unsigned long long hops; // forward pointers followed by searches
+    unsigned long long compares; // object comparisons, counted by the caller
+    unsigned long long returned; // nodes returned, counted by the caller
+} skiplistMetrics;
+
+extern skiplistMetrics skiplistMetricsCounters;
+
+#define skiplistMetricsAdd(field,n) (skiplistMetricsCounters.field += (n))
+#else
+#define skiplistMetricsAdd(field,n) ((void)0)
+#endif
+
 typedef void (*skiplistDeleteCb) (void *ctx, void *obj);
 
+typedef struct skiplistStats {
+    size_t nodebytes; // bytes used by the nodes
+    size_t objbytes; // bytes used by the objects, see skiplistSetObjSize()
+    size_t overhead; // header, member index, expire times, reuse pool and slabs
+    int level; // current level
+    unsigned long levels[SKIPLIST_MAXLEVEL]; // number of nodes of each level
+    double avgpath; // estimated number of nodes visited by a search
+} skiplistStats;
+
 skiplist *skiplistCreate(int (*compare)(const void *, const void *), void (*release)(void *));
 void skiplistInit(skiplist *sl, int (*compare)(const void *, const void *), void (*release)(void *));
+void skiplistInitLike(skiplist *dst, skiplist *sl);
 void skiplistFree(skiplist *sl);
 void skiplistFreeNodes(skiplist *sl);
+void skiplistClear(skiplist *sl);
+void skiplistEnableIndex(skiplist *sl, unsigned int (*hash)(const void *));
+void skiplistEnableSums(skiplist *sl);
+void skiplistEnablePrefix(skiplist *sl, uint64_t (*prefix)(const void *));
+void skiplistSetObjSize(skiplist *sl, size_t (*objsize)(const void *));
+void skiplistSetObjMove(skiplist *sl, void (*objmove)(void *dst, const void *obj));
+void skiplistEnableQueue(skiplist *sl);
+void skiplistGetStats(skiplist *sl, skiplistStats *stats);
 skiplistNode *skiplistInsert(skiplist *sl, double score, void *obj);
 int skiplistDelete(skiplist *sl, double score, void *obj);
 skiplistNode *skiplistUpdateScore(skiplist *sl, double curscore, void *obj, double newscore);
+skiplistNode *skiplistUpdateScoreRank(skiplist *sl, double curscore, void *obj, double newscore, unsigned long *rank);
 void *skiplistFind(skiplist *sl, void *obj);
+void skiplistRelease(skiplist *sl, void *obj);
 void *skiplistPopHead(skiplist *sl);
 void *skiplistPopTail(skiplist *sl);
+skiplistNode *skiplistPush(skiplist *sl, double score, void *obj);
+void skiplistQueueDelete(skiplist *sl, skiplistNode *x);
+void skiplistSetMaxLength(skiplist *sl, unsigned long maxlength, int evict);
+int skiplistWouldEvict(skiplist *sl, double score, void *obj);
+void *skiplistEvict(skiplist *sl, double *score);
 unsigned long skiplistLength(skiplist *sl);
+void skiplistSetExpire(skiplist *sl, skiplistNode *x, double when);
+int skiplistPersist(skiplist *sl, skiplistNode *x);
+int skiplistGetExpire(skiplist *sl, skiplistNode *x, double *when);
+int skiplistHasExpired(skiplist *sl, double now);
+int skiplistIsExpired(skiplist *sl, skiplistNode *x, double now);
+unsigned long skiplistExpireStep(skiplist *sl, double now, unsigned long budget, skiplistDeleteCb cb, void *ctx);
 unsigned long skiplistDeleteRangeByRank(skiplist *sl, unsigned int start, unsigned int end, skiplistDeleteCb cb, void *ctx);
+void skiplistSplit(skiplist *sl, unsigned long rank, skiplist *dst);
+int skiplistConcat(skiplist *sl, skiplist *other);
+skiplistNode *skiplistMoveNode(skiplist *sl, double curscore, void *obj, skiplist *dst, double newscore);
+int skiplistDefrag(skiplist *sl, unsigned long budget);
 unsigned long skiplistGetRank(skiplist *sl, double score, void *obj);
+skiplistNode *skiplistLastBefore(skiplist *sl, double score, void *obj);
+void skiplistGetRanks(skiplist *sl, skiplistNode **nodes, unsigned long *ranks, unsigned long n);
 unsigned long skiplistGetScoreRank(skiplist *sl, double score, int ex);
 skiplistNode* skiplistGetNodeByRank(skiplist *sl, unsigned long rank);
+void skiplistGetNodesByRank(skiplist *sl, const unsigned long *ranks, skiplistNode **nodes, unsigned long n);
+double skiplistSumByRank(skiplist *sl, unsigned long start, unsigned long end);
+double skiplistSumByScore(skiplist *sl, double min, double max, int minex, int maxex, unsigned long *count);
+unsigned long skiplistCountByScore(skiplist *sl, double min, double max, int minex, int maxex);
 skiplistNode *skiplistFirstInRange(skiplist *sl, double min, double max, int minex, int maxex);
 skiplistNode *skiplistLastInRange(skiplist *sl, double min, double max, int minex, int maxex);
 void skiplistIterate(skiplist *sl, void *ctx, int (*iterator)(void *ctx, int index, double score, void *obj));
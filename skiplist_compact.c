@@ -0,0 +1,484 @@
+/* Compact skiplist with 32-bit links, see skiplist_compact.h. The
+ * algorithms are the ones of skiplist.c with indices in place of node
+ * pointers. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "skiplist_impl.h"
+#include "skiplist_compact.h"
+
+#define L(sl,x,i) skiplistCompactLevelOf(sl,x,i)
+
+/* Take a free slot of nodes and a free block of 'level' levels for a new
+ * node, growing the arrays when the free lists are empty. Returns 0 if the
+ * indices would overflow. */
+static uint32_t skiplistCompactNewNode(skiplistCompact *sl, int level, double score, void *obj) {
+    uint32_t x, levels;
+
+    if (sl->freelv[level-1]) {
+        levels = sl->freelv[level-1];
+        sl->freelv[level-1] = sl->lv[levels].forward;
+    } else {
+        if (sl->lvused > UINT32_MAX-level) return 0;
+        if (sl->lvused+level > sl->lvsize) {
+            uint32_t size = sl->lvsize > UINT32_MAX/2 ? UINT32_MAX : sl->lvsize*2;
+            sl->lv = realloc(sl->lv,sizeof(skiplistCompactLevel)*size);
+            sl->lvsize = size;
+        }
+        levels = sl->lvused;
+        sl->lvused += level;
+    }
+
+    if (sl->freenode) {
+        x = sl->freenode;
+        sl->freenode = sl->nodes[x].levels;
+    } else {
+        if (sl->nodeused == UINT32_MAX) {
+            sl->lv[levels].forward = sl->freelv[level-1];
+            sl->freelv[level-1] = levels;
+            return 0;
+        }
+        if (sl->nodeused == sl->nodesize) {
+            uint32_t size = sl->nodesize > UINT32_MAX/2 ? UINT32_MAX : sl->nodesize*2;
+            sl->nodes = realloc(sl->nodes,sizeof(skiplistCompactNode)*size);
+            sl->nodesize = size;
+        }
+        x = sl->nodeused++;
+    }
+
+    sl->nodes[x].obj = obj;
+    sl->nodes[x].score = score;
+    sl->nodes[x].levels = levels;
+    return x;
+}
+
+/* Give the slot and the levels of node x back to the free lists, without
+ * releasing its object. */
+static void skiplistCompactFreeSlot(skiplistCompact *sl, uint32_t x, int level) {
+    uint32_t levels = sl->nodes[x].levels;
+
+    sl->lv[levels].forward = sl->freelv[level-1];
+    sl->freelv[level-1] = levels;
+    sl->nodes[x].obj = NULL;
+    sl->nodes[x].levels = sl->freenode;
+    sl->freenode = x;
+}
+
+void skiplistCompactInit(skiplistCompact *sl, int (*compare)(const void *, const void *), void (*release)(void *)) {
+    int j;
+
+    memset(sl,0,sizeof(*sl));
+    sl->nodesize = 16;
+    sl->nodes = malloc(sizeof(skiplistCompactNode)*sl->nodesize);
+    sl->lvsize = SKIPLIST_MAXLEVEL*2;
+    sl->lv = malloc(sizeof(skiplistCompactLevel)*sl->lvsize);
+
+    /* The header takes node 0 and the first SKIPLIST_MAXLEVEL levels, so
+     * that 0 is never a free block either. */
+    sl->nodeused = 1;
+    sl->lvused = SKIPLIST_MAXLEVEL;
+    sl->nodes[0].obj = NULL;
+    sl->nodes[0].score = 0;
+    sl->nodes[0].backward = 0;
+    sl->nodes[0].levels = 0;
+    for (j = 0; j < SKIPLIST_MAXLEVEL; j++) {
+        sl->lv[j].forward = 0;
+        sl->lv[j].span = 0;
+    }
+    sl->level = 1;
+    sl->compare = compare;
+    sl->release = release;
+}
+
+skiplistCompact *skiplistCompactCreate(int (*compare)(const void *, const void *), void (*release)(void *)) {
+    skiplistCompact *sl = malloc(sizeof(*sl));
+
+    skiplistCompactInit(sl,compare,release);
+    return sl;
+}
+
+/* Enable the member index on an empty skiplist, see
+ * skiplistEnableIndex(). */
+void skiplistCompactEnableIndex(skiplistCompact *sl, unsigned int (*hash)(const void *)) {
+    sl->hash = hash;
+}
+
+/* Release the elements and the arrays, but not the skiplist structure
+ * itself, see skiplistFreeNodes(). */
+void skiplistCompactFreeNodes(skiplistCompact *sl) {
+    uint32_t x = L(sl,0,0).forward;
+
+    while (x) {
+        if (sl->release) sl->release(sl->nodes[x].obj);
+        x = L(sl,x,0).forward;
+    }
+    free(sl->index);
+    free(sl->lv);
+    free(sl->nodes);
+}
+
+void skiplistCompactFree(skiplistCompact *sl) {
+    skiplistCompactFreeNodes(sl);
+    free(sl);
+}
+
+/* Same as skiplistGetStats(), the unused slots of the arrays are counted
+ * as overhead. */
+void skiplistCompactGetStats(skiplistCompact *sl, skiplistStats *stats) {
+    unsigned long above = 0, nodes = 0, levels = 0;
+    int i;
+
+    stats->objbytes = 0;
+    stats->level = sl->level;
+    stats->avgpath = 0;
+    for (i = SKIPLIST_MAXLEVEL-1; i >= 0; i--) {
+        stats->levels[i] = sl->levels[i];
+        nodes += sl->levels[i];
+        levels += sl->levels[i]*(i+1);
+        if (i < sl->level)
+            stats->avgpath += (double)(above+sl->levels[i])/(above+1)/2 + 1;
+        above += sl->levels[i];
+    }
+    stats->nodebytes = nodes*sizeof(skiplistCompactNode) +
+        levels*sizeof(skiplistCompactLevel);
+    stats->overhead = (size_t)sl->nodesize*sizeof(skiplistCompactNode) +
+        (size_t)sl->lvsize*sizeof(skiplistCompactLevel) +
+        sl->indexsize*sizeof(uint32_t) - stats->nodebytes;
+}
+
+/* The member index works as the one of skiplist.c, with node indices. */
+
+static void skiplistCompactIndexResize(skiplistCompact *sl, unsigned long size) {
+    uint32_t *old = sl->index;
+    unsigned long oldsize = sl->indexsize, i, j;
+
+    sl->index = calloc(size,sizeof(uint32_t));
+    sl->indexsize = size;
+    for (i = 0; i < oldsize; i++) {
+        if (old[i] == 0) continue;
+        j = sl->hash(sl->nodes[old[i]].obj) & (size-1);
+        while (sl->index[j]) j = (j+1) & (size-1);
+        sl->index[j] = old[i];
+    }
+    free(old);
+}
+
+/* sl->length must not account for the node yet. */
+static void skiplistCompactIndexAdd(skiplistCompact *sl, uint32_t x) {
+    unsigned long j;
+
+    if (!sl->hash) return;
+    if ((sl->length+1)*2 > sl->indexsize)
+        skiplistCompactIndexResize(sl,sl->indexsize ? sl->indexsize*2 : 16);
+
+    j = sl->hash(sl->nodes[x].obj) & (sl->indexsize-1);
+    while (sl->index[j]) j = (j+1) & (sl->indexsize-1);
+    sl->index[j] = x;
+}
+
+/* sl->length must not account for the node anymore. */
+static void skiplistCompactIndexDelete(skiplistCompact *sl, uint32_t x) {
+    unsigned long mask, i, j, k;
+
+    if (!sl->hash) return;
+    mask = sl->indexsize-1;
+    i = sl->hash(sl->nodes[x].obj) & mask;
+    while (sl->index[i] != x) i = (i+1) & mask;
+    sl->index[i] = 0;
+
+    for (j = (i+1) & mask; sl->index[j]; j = (j+1) & mask) {
+        k = sl->hash(sl->nodes[sl->index[j]].obj) & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        sl->index[i] = sl->index[j];
+        sl->index[j] = 0;
+        i = j;
+    }
+
+    if (sl->indexsize > 16 && sl->length*8 < sl->indexsize)
+        skiplistCompactIndexResize(sl,sl->indexsize/2);
+}
+
+/* Return the node of an object, 0 if it is not in the skiplist. Without
+ * the member index the level zero list is scanned. */
+uint32_t skiplistCompactFind(skiplistCompact *sl, void *obj) {
+    unsigned long j;
+    uint32_t x;
+
+    if (!sl->hash) {
+        x = L(sl,0,0).forward;
+        while (x && sl->compare(sl->nodes[x].obj,obj) != 0)
+            x = L(sl,x,0).forward;
+        return x;
+    }
+
+    if (sl->indexsize == 0) return 0;
+    j = sl->hash(obj) & (sl->indexsize-1);
+    while (sl->index[j]) {
+        if (sl->compare(sl->nodes[sl->index[j]].obj,obj) == 0)
+            return sl->index[j];
+        j = (j+1) & (sl->indexsize-1);
+    }
+    return 0;
+}
+
+/* Whether node x comes before the element score/obj. */
+static inline int skiplistCompactBefore(skiplistCompact *sl, uint32_t x, double score, void *obj) {
+    return sl->nodes[x].score < score ||
+        (sl->nodes[x].score == score && sl->compare(sl->nodes[x].obj,obj) < 0);
+}
+
+/* Find the predecessors of the insert position of score/obj at every
+ * level and the rank they are crossed at. Returns 0 if the element is
+ * already inside. */
+static int skiplistCompactFindInsertPosition(skiplistCompact *sl, double score, void *obj, uint32_t *update, unsigned long *rank) {
+    uint32_t x = 0, next;
+    int i;
+
+    for (i = sl->level-1; i >= 0; i--) {
+        rank[i] = i == (sl->level-1) ? 0 : rank[i+1];
+        while ((next = L(sl,x,i).forward) && skiplistCompactBefore(sl,next,score,obj)) {
+            rank[i] += L(sl,x,i).span;
+            x = next;
+            skiplistHop();
+        }
+        update[i] = x;
+    }
+    next = L(sl,x,0).forward;
+    return !(next && sl->compare(sl->nodes[next].obj,obj) == 0);
+}
+
+/* Link node x, made of 'level' levels, at the position found by
+ * skiplistCompactFindInsertPosition(). */
+static void skiplistCompactLinkNode(skiplistCompact *sl, uint32_t x, int level, uint32_t *update, unsigned long *rank) {
+    int i;
+
+    if (level > sl->level) {
+        for (i = sl->level; i < level; i++) {
+            rank[i] = 0;
+            update[i] = 0;
+            L(sl,0,i).span = sl->length;
+        }
+        sl->level = level;
+    }
+    for (i = 0; i < level; i++) {
+        L(sl,x,i).forward = L(sl,update[i],i).forward;
+        L(sl,update[i],i).forward = x;
+        L(sl,x,i).span = L(sl,update[i],i).span - (rank[0] - rank[i]);
+        L(sl,update[i],i).span = (rank[0] - rank[i]) + 1;
+    }
+    for (i = level; i < sl->level; i++)
+        L(sl,update[i],i).span++;
+
+    sl->nodes[x].backward = update[0];
+    if (L(sl,x,0).forward)
+        sl->nodes[L(sl,x,0).forward].backward = x;
+    else
+        sl->tail = x;
+    sl->levels[level-1]++;
+    skiplistCompactIndexAdd(sl,x);
+    sl->length++;
+}
+
+/* Insert the specified object, return 0 if the element already exists or
+ * the skiplist is full, otherwise the new node. */
+uint32_t skiplistCompactInsert(skiplistCompact *sl, double score, void *obj) {
+    uint32_t update[SKIPLIST_MAXLEVEL], x;
+    unsigned long rank[SKIPLIST_MAXLEVEL];
+    int level;
+
+    if ((sl->hash && skiplistCompactFind(sl,obj)) ||
+        !skiplistCompactFindInsertPosition(sl,score,obj,update,rank))
+        return 0;
+
+    level = skiplistRandomLevel();
+    x = skiplistCompactNewNode(sl,level,score,obj);
+    if (!x) return 0;
+    skiplistCompactLinkNode(sl,x,level,update,rank);
+    return x;
+}
+
+/* Unlink node x, whose predecessors are in update, returning its level.
+ * The slot of x is not freed. */
+static int skiplistCompactDeleteNode(skiplistCompact *sl, uint32_t x, uint32_t *update) {
+    int i, level = 0;
+
+    for (i = 0; i < sl->level; i++) {
+        if (L(sl,update[i],i).forward == x) {
+            level++;
+            L(sl,update[i],i).span += L(sl,x,i).span - 1;
+            L(sl,update[i],i).forward = L(sl,x,i).forward;
+        } else {
+            L(sl,update[i],i).span -= 1;
+        }
+    }
+    if (L(sl,x,0).forward)
+        sl->nodes[L(sl,x,0).forward].backward = sl->nodes[x].backward;
+    else
+        sl->tail = sl->nodes[x].backward;
+    while (sl->level > 1 && L(sl,0,sl->level-1).forward == 0)
+        sl->level--;
+    sl->length--;
+    sl->levels[level-1]--;
+    skiplistCompactIndexDelete(sl,x);
+    return level;
+}
+
+/* Find the predecessors of score/obj at every level, returning the node
+ * matching it or 0. */
+static uint32_t skiplistCompactSearch(skiplistCompact *sl, double score, void *obj, uint32_t *update) {
+    uint32_t x = 0, next;
+    int i;
+
+    for (i = sl->level-1; i >= 0; i--) {
+        while ((next = L(sl,x,i).forward) && skiplistCompactBefore(sl,next,score,obj)) {
+            x = next;
+            skiplistHop();
+        }
+        update[i] = x;
+    }
+    x = L(sl,x,0).forward;
+    if (x && sl->nodes[x].score == score && sl->compare(sl->nodes[x].obj,obj) == 0)
+        return x;
+    return 0;
+}
+
+/* Delete the element with matching score/object, returns 1 if it was
+ * there. */
+int skiplistCompactDelete(skiplistCompact *sl, double score, void *obj) {
+    uint32_t update[SKIPLIST_MAXLEVEL], x;
+    void *found;
+    int level;
+
+    x = skiplistCompactSearch(sl,score,obj,update);
+    if (!x) return 0;
+    found = sl->nodes[x].obj;
+    level = skiplistCompactDeleteNode(sl,x,update);
+    skiplistCompactFreeSlot(sl,x,level);
+    if (sl->release) sl->release(found);
+    return 1;
+}
+
+/* Update the score of an element, which must exist with 'curscore',
+ * otherwise 0 is returned. The node is updated in place when its position
+ * does not change, otherwise it is unlinked and linked again at its new
+ * position, keeping its index and levels. */
+uint32_t skiplistCompactUpdateScore(skiplistCompact *sl, double curscore, void *obj, double newscore) {
+    uint32_t update[SKIPLIST_MAXLEVEL], x, prev, next;
+    unsigned long rank[SKIPLIST_MAXLEVEL];
+    int level;
+
+    x = skiplistCompactSearch(sl,curscore,obj,update);
+    if (!x) return 0;
+
+    prev = sl->nodes[x].backward;
+    next = L(sl,x,0).forward;
+    if ((prev == 0 || sl->nodes[prev].score < newscore) &&
+        (next == 0 || sl->nodes[next].score > newscore))
+    {
+        sl->nodes[x].score = newscore;
+        return x;
+    }
+
+    level = skiplistCompactDeleteNode(sl,x,update);
+    sl->nodes[x].score = newscore;
+    skiplistCompactFindInsertPosition(sl,newscore,sl->nodes[x].obj,update,rank);
+    skiplistCompactLinkNode(sl,x,level,update,rank);
+    return x;
+}
+
+/* Delete the elements with rank between start and end, both inclusive
+ * and 1-based. The callback is optional, when given it is called for every
+ * element right before the element is released. */
+unsigned long skiplistCompactDeleteRangeByRank(skiplistCompact *sl, unsigned long start, unsigned long end, skiplistDeleteCb cb, void *ctx) {
+    uint32_t update[SKIPLIST_MAXLEVEL], x, next;
+    unsigned long traversed = 0, removed = 0;
+    void *obj;
+    int i, level;
+
+    if (start > sl->length || end < 1) return 0;
+
+    x = 0;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (L(sl,x,i).forward && traversed + L(sl,x,i).span < start) {
+            traversed += L(sl,x,i).span;
+            x = L(sl,x,i).forward;
+            skiplistHop();
+        }
+        update[i] = x;
+    }
+
+    traversed++;
+    x = L(sl,x,0).forward;
+    while (x && traversed <= end) {
+        next = L(sl,x,0).forward;
+        obj = sl->nodes[x].obj;
+        level = skiplistCompactDeleteNode(sl,x,update);
+        skiplistCompactFreeSlot(sl,x,level);
+        if (cb) cb(ctx,obj);
+        if (sl->release) sl->release(obj);
+        removed++;
+        traversed++;
+        x = next;
+    }
+    return removed;
+}
+
+/* Find the rank of the element by both score and object, 0 if it is not
+ * found. The rank is 1-based. */
+unsigned long skiplistCompactGetRank(skiplistCompact *sl, double score, void *obj) {
+    uint32_t x = 0, next;
+    unsigned long rank = 0;
+    int i;
+
+    for (i = sl->level-1; i >= 0; i--) {
+        while ((next = L(sl,x,i).forward) &&
+               (sl->nodes[next].score < score ||
+                (sl->nodes[next].score == score &&
+                 sl->compare(sl->nodes[next].obj,obj) <= 0))) {
+            rank += L(sl,x,i).span;
+            x = next;
+            skiplistHop();
+        }
+        if (x && sl->compare(sl->nodes[x].obj,obj) == 0)
+            return rank;
+    }
+    return 0;
+}
+
+/* Number of elements with a score lower than 'score', or lower or equal
+ * when ex is 0. */
+unsigned long skiplistCompactGetScoreRank(skiplistCompact *sl, double score, int ex) {
+    uint32_t x = 0, next;
+    unsigned long rank = 0;
+    int i;
+
+    for (i = sl->level-1; i >= 0; i--) {
+        while ((next = L(sl,x,i).forward) &&
+               (ex ? sl->nodes[next].score < score : sl->nodes[next].score <= score)) {
+            rank += L(sl,x,i).span;
+            x = next;
+            skiplistHop();
+        }
+    }
+    return rank;
+}
+
+/* Finds an element by its 1-based rank, 0 if out of range. */
+uint32_t skiplistCompactGetNodeByRank(skiplistCompact *sl, unsigned long rank) {
+    uint32_t x = 0;
+    unsigned long traversed = 0;
+    int i;
+
+    if (rank == 0 || rank > sl->length) return 0;
+
+    for (i = sl->level-1; i >= 0; i--) {
+        while (L(sl,x,i).forward && traversed + L(sl,x,i).span <= rank) {
+            traversed += L(sl,x,i).span;
+            x = L(sl,x,i).forward;
+            skiplistHop();
+        }
+        if (traversed == rank) return x;
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+/* A compact variant of the skiplist of skiplist.h for very large sets,
+ * with the same ordering and the same results, whose nodes live in arrays
+ * and are addressed by 32-bit indices instead of pointers.
+ *
+ * Node i is nodes[i]: its object, score, backward index and the position
+ * of its levels in the level array. A level is a 32-bit forward index and
+ * a 32-bit span, 8 bytes instead of 16, and a node without its levels
+ * takes 24 bytes instead of 32. Node 0 is the header, so index 0 also
+ * stands for NULL in forward and backward links.
+ *
+ * Freed nodes are chained in a free list, and freed levels in one free
+ * list per number of levels, so every slot is reused by a node of the same
+ * level. The arrays grow by doubling and never shrink. Growing moves them,
+ * so a pointer into them is only valid until the next insertion, unlike an
+ * index. A set holds at most 2^32-2 elements. */
+
+#ifndef __SKIPLIST_COMPACT_H
+#define __SKIPLIST_COMPACT_H
+
+#include <stdint.h>
+
+#include "skiplist.h"
+
+typedef struct skiplistCompactNode {
+    void *obj;
+    double score;
+    uint32_t backward; // previous node, 0 for the first one
+    uint32_t levels; // position of the first level in the level array
+} skiplistCompactNode;
+
+typedef struct skiplistCompactLevel {
+    uint32_t forward; // next node at this level, 0 for none
+    uint32_t span; // number of nodes crossed to reach the next node
+} skiplistCompactLevel;
+
+typedef struct skiplistCompact {
+    skiplistCompactNode *nodes;
+    skiplistCompactLevel *lv;
+    uint32_t nodesize, nodeused; // slots allocated and ever used in nodes
+    uint32_t lvsize, lvused; // same for lv
+    uint32_t freenode; // first free node, chained by 'levels', 0 for none
+    uint32_t freelv[SKIPLIST_MAXLEVEL]; // first free block of i+1 levels
+    uint32_t tail;
+    int (*compare)(const void *, const void *);
+    void (*release)(void *);
+    unsigned int (*hash)(const void *); // member index hash, NULL if disabled
+    uint32_t *index; // member index of node indices, 0 for an empty slot
+    unsigned long indexsize;
+    unsigned long levels[SKIPLIST_MAXLEVEL]; // number of nodes of each level
+    unsigned long length;
+    int level;
+} skiplistCompact;
+
+/* The node at index x, and the level i of node x. */
+#define skiplistCompactNodeAt(sl,x) (&(sl)->nodes[x])
+#define skiplistCompactLevelOf(sl,x,i) ((sl)->lv[(sl)->nodes[x].levels+(i)])
+
+skiplistCompact *skiplistCompactCreate(int (*compare)(const void *, const void *), void (*release)(void *));
+void skiplistCompactInit(skiplistCompact *sl, int (*compare)(const void *, const void *), void (*release)(void *));
+void skiplistCompactEnableIndex(skiplistCompact *sl, unsigned int (*hash)(const void *));
+void skiplistCompactFree(skiplistCompact *sl);
+void skiplistCompactFreeNodes(skiplistCompact *sl);
+void skiplistCompactGetStats(skiplistCompact *sl, skiplistStats *stats);
+uint32_t skiplistCompactInsert(skiplistCompact *sl, double score, void *obj);
+int skiplistCompactDelete(skiplistCompact *sl, double score, void *obj);
+uint32_t skiplistCompactUpdateScore(skiplistCompact *sl, double curscore, void *obj, double newscore);
+uint32_t skiplistCompactFind(skiplistCompact *sl, void *obj);
+unsigned long skiplistCompactDeleteRangeByRank(skiplistCompact *sl, unsigned long start, unsigned long end, skiplistDeleteCb cb, void *ctx);
+unsigned long skiplistCompactGetRank(skiplistCompact *sl, double score, void *obj);
+unsigned long skiplistCompactGetScoreRank(skiplistCompact *sl, double score, int ex);
+uint32_t skiplistCompactGetNodeByRank(skiplistCompact *sl, unsigned long rank);
+
+#endif
@@ -0,0 +1,499 @@
+/* Internals of skiplist.c and a template of the operations comparing
+ * objects, so that they can be specialized for a type of object with the
+ * comparison inlined in the descents instead of called through
+ * sl->compare. skiplist.c instantiates the generic version. An
+ * instantiation defines the following macros and includes this file:
+ *
+ *   SKIPLIST_NAME(f)          name of the operation f, e.g. skiplistNumber##f
+ *   SKIPLIST_COMPARE(sl,a,b)  compare two objects, like sl->compare
+ *   SKIPLIST_HASH(sl,obj)     hash an object, like sl->hash
+ *   SKIPLIST_PREFIX(sl,obj)   node prefix of an object, like sl->prefix, or
+ *                             0 when prefixes are disabled
+ *   SKIPLIST_API              storage class of the operations, e.g. static
+ *
+ * The operations behave exactly as the ones of skiplist.h, and work on any
+ * skiplist whose objects are of that type. The macros are undefined at the
+ * end, so the file can be included once per type. Without SKIPLIST_NAME
+ * only the internals are declared. */
+
+#ifndef __SKIPLIST_IMPL_H
+#define __SKIPLIST_IMPL_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "skiplist.h"
+
+/* When score sums are enabled, every level of a node also records the sum
+ * of the scores of the nodes crossed by its span, the same way 'span'
+ * counts them, at skiplistSum(x,i) for level i. */
+#define skiplistSum(x,i) (((double *)(x))[-2-(i)])
+
+/* Build with -DSKIPLIST_USDT to get USDT probes (lzset:insert__entry,
+ * lzset:insert__return, ...) on the main operations. Entry probes get the
+ * skiplist, the score (the rank or the start rank for the rank based
+ * operations) and the length. Return probes also get the number of forward
+ * pointers followed. */
+#ifdef SKIPLIST_USDT
+#include <sys/sdt.h>
+
+extern unsigned long long skiplistHops;
+
+#define skiplistHop() do { skiplistMetricsAdd(hops,1); skiplistHops++; } while (0)
+#define skiplistProbeEntry(op,sl,score) \
+    unsigned long long probeHops = skiplistHops; \
+    DTRACE_PROBE3(lzset,op##__entry,sl,(double)(score),(sl)->length)
+#define skiplistProbeReturn(op,sl,score) \
+    DTRACE_PROBE4(lzset,op##__return,sl,(double)(score),(sl)->length, \
+                  skiplistHops-probeHops)
+#else
+#define skiplistHop() skiplistMetricsAdd(hops,1)
+#define skiplistProbeEntry(op,sl,score)
+#define skiplistProbeReturn(op,sl,score)
+#endif
+
+skiplistNode *skiplistNewNode(skiplist *sl, int level, double score, void *obj);
+skiplistNode *skiplistTakeNode(skiplist *sl, int level, double score, void *obj);
+void skiplistFreeNode(skiplist *sl, skiplistNode *node);
+int skiplistRandomLevel(void);
+void skiplistIndexAdd(skiplist *sl, skiplistNode *x);
+void skiplistIndexDelete(skiplist *sl, skiplistNode *x);
+void skiplistForgetNode(skiplist *sl, skiplistNode *x);
+void skiplistLinkNode(skiplist *sl, skiplistNode *x, int level,
+                      skiplistNode **update, unsigned int *rank,
+                      double *psum);
+void skiplistDeleteNode(skiplist *sl, skiplistNode *x, skiplistNode **update);
+int skiplistNodeBefore(skiplist *sl, skiplistNode *a, skiplistNode *b);
+void skiplistMergeSortNodes(skiplist *sl, skiplistNode **nodes, skiplistNode **tmp, unsigned long n);
+void skiplistAppendNodes(skiplist *sl, skiplistNode **nodes, unsigned long n);
+
+#endif
+
+#ifdef SKIPLIST_NAME
+
+/* Compare the object of node x with obj, whose prefix is given: the
+ * prefixes cached in the nodes decide unless they are equal, so the object
+ * of x is only read on a tie. */
+static inline int SKIPLIST_NAME(CompareNode)(skiplist *sl, skiplistNode *x, const void *obj, uint64_t prefix) {
+    if (x->prefix != prefix) return x->prefix < prefix ? -1 : 1;
+    return SKIPLIST_COMPARE(sl,x->obj,obj);
+}
+
+/* Search the index for a node with a matching object. */
+static inline skiplistNode *SKIPLIST_NAME(IndexFind)(skiplist *sl, const void *obj) {
+    unsigned long j;
+    uint64_t prefix;
+
+    if (sl->indexsize == 0) return NULL;
+    j = SKIPLIST_HASH(sl,obj) & (sl->indexsize-1);
+
+    /* The prefix of a queue node is a sequence number, see
+     * skiplistEnableQueue(). */
+    if (sl->queue) {
+        while (sl->index[j]) {
+            if (SKIPLIST_COMPARE(sl,sl->index[j]->obj,obj) == 0)
+                return sl->index[j];
+            j = (j+1) & (sl->indexsize-1);
+        }
+        return NULL;
+    }
+
+    prefix = SKIPLIST_PREFIX(sl,obj);
+    while (sl->index[j]) {
+        if (SKIPLIST_NAME(CompareNode)(sl,sl->index[j],obj,prefix) == 0)
+            return sl->index[j];
+        j = (j+1) & (sl->indexsize-1);
+    }
+    return NULL;
+}
+
+/* Find the position where an element with the specified score/object
+ * should be inserted, storing the predecessors at every level in 'update'
+ * and the rank they are crossed at in 'rank'. When score sums are enabled,
+ * the sum of the scores crossed is stored in 'psum' the same way. Returns 0
+ * if the element is already inside. */
+static inline int SKIPLIST_NAME(FindInsertPosition)(skiplist *sl, double score, void *obj,
+                                      skiplistNode **update, unsigned int *rank,
+                                      double *psum) {
+    skiplistNode *x;
+    uint64_t prefix = SKIPLIST_PREFIX(sl,obj);
+    int i;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        /* store rank that is crossed to reach the insert position */
+        rank[i] = i == (sl->level-1) ? 0 : rank[i+1];
+        if (sl->sums) psum[i] = i == (sl->level-1) ? 0 : psum[i+1];
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+               (x->level[i].forward->score == score &&
+                SKIPLIST_NAME(CompareNode)(sl,x->level[i].forward,obj,prefix) < 0)))
+        {
+            rank[i] += x->level[i].span;
+            if (sl->sums) psum[i] += skiplistSum(x,i);
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+        update[i] = x;
+    }
+
+    /* we assume the key is not already inside, since we allow duplicated
+     * scores, and the re-insertion of score and redis object should never
+     * happen since the caller of slInsert() should test in the hash table
+     * if the element is already inside or not. */
+
+    /* If the element is already inside, return 0. */
+    return !(x->level[0].forward &&
+             SKIPLIST_NAME(CompareNode)(sl,x->level[0].forward,obj,prefix) == 0);
+}
+
+/* Insert the specified object, return NULL if the element already
+ * exists. When the member index is enabled, an object already inside
+ * with a different score is detected as well. */
+SKIPLIST_API skiplistNode *SKIPLIST_NAME(Insert)(skiplist *sl, double score, void *obj) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+    unsigned int rank[SKIPLIST_MAXLEVEL];
+    double psum[SKIPLIST_MAXLEVEL];
+    int level;
+    skiplistProbeEntry(insert,sl,score);
+
+    if ((sl->hash && SKIPLIST_NAME(IndexFind)(sl,obj)) ||
+        !SKIPLIST_NAME(FindInsertPosition)(sl,score,obj,update,rank,psum))
+    {
+        skiplistProbeReturn(insert,sl,score);
+        return NULL;
+    }
+
+    /* Add a new node with a random number of levels. */
+    level = skiplistRandomLevel();
+    x = skiplistTakeNode(sl,level,score,obj);
+    skiplistIndexAdd(sl,x);
+    skiplistLinkNode(sl,x,level,update,rank,psum);
+    skiplistProbeReturn(insert,sl,score);
+    return x;
+}
+
+/* Delete an element with matching score/object from the skiplist.
+ * 1 is returned, otherwise if the element was not there, 0 is returned. */
+SKIPLIST_API int SKIPLIST_NAME(Delete)(skiplist *sl, double score, void *obj) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+    uint64_t prefix = SKIPLIST_PREFIX(sl,obj);
+    int i;
+    skiplistProbeEntry(delete,sl,score);
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                 SKIPLIST_NAME(CompareNode)(sl,x->level[i].forward,obj,prefix) < 0)))
+        {
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+        update[i] = x;
+    }
+    x = x->level[0].forward;
+    if (x && score == x->score && SKIPLIST_NAME(CompareNode)(sl,x,obj,prefix) == 0) {
+        skiplistDeleteNode(sl,x,update);
+        skiplistForgetNode(sl,x);
+        skiplistFreeNode(sl,x);
+        skiplistProbeReturn(delete,sl,score);
+        return 1;
+    }
+    skiplistProbeReturn(delete,sl,score);
+    return 0; /* not found */
+}
+
+/* Update the score of an object inside the sorted set skiplist.
+ * Note that the object must exist and must match 'score', otherwise
+ * NULL is returned.
+ * This function does not update the score in the hash table side, the
+ * caller should take care of it.
+ *
+ * Note that this function attempts to just update the node, in case after
+ * the score update, the node would be exactly at the same position.
+ * Otherwise the node is unlinked and linked again at its new position,
+ * keeping its levels, so neither the node nor its object is reallocated.
+ *
+ * When 'rank' is not NULL, the 1-based rank of the element after the
+ * update is stored there.
+ *
+ * The function returns the updated object skiplist node pointer. */
+SKIPLIST_API skiplistNode *SKIPLIST_NAME(UpdateScoreRank)(skiplist *sl, double curscore, void *obj, double newscore, unsigned long *rank) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+    unsigned int newrank[SKIPLIST_MAXLEVEL];
+    double psum[SKIPLIST_MAXLEVEL];
+    unsigned long traversed = 0;
+    uint64_t prefix = SKIPLIST_PREFIX(sl,obj);
+    int i, level;
+    skiplistProbeEntry(update,sl,curscore);
+
+    /* We need to seek to object to update to start: this is useful anyway,
+     * we'll have to update or remove it. */
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+                (x->level[i].forward->score < curscore ||
+                    (x->level[i].forward->score == curscore &&
+                     SKIPLIST_NAME(CompareNode)(sl,x->level[i].forward,obj,prefix) < 0)))
+        {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+        update[i] = x;
+    }
+
+    /* Jump to our object. */
+    x = x->level[0].forward;
+    if (!x || curscore != x->score || SKIPLIST_NAME(CompareNode)(sl,x,obj,prefix) != 0) {
+        skiplistProbeReturn(update,sl,newscore);
+        return NULL;
+    }
+
+    /* If the node, after the score update, would be still exactly
+     * at the same position, we can just update the score without
+     * actually removing and re-inserting the object in the skiplist. */
+    if ((x->backward == NULL || x->backward->score < newscore) &&
+        (x->level[0].forward == NULL || x->level[0].forward->score > newscore))
+    {
+        /* Every level crosses the node, so every sum changes. */
+        if (sl->sums) {
+            for (i = 0; i < sl->level; i++)
+                skiplistSum(update[i],i) += newscore - x->score;
+        }
+        x->score = newscore;
+        if (rank) *rank = traversed+1;
+        skiplistProbeReturn(update,sl,newscore);
+        return x;
+    }
+
+    /* The node levels are the ones where its predecessor points to it. */
+    for (level = 1; level < sl->level; level++)
+        if (update[level]->level[level].forward != x) break;
+
+    /* Move the node itself to its new place. */
+    skiplistDeleteNode(sl,x,update);
+    x->score = newscore;
+    SKIPLIST_NAME(FindInsertPosition)(sl,newscore,x->obj,update,newrank,psum);
+    skiplistLinkNode(sl,x,level,update,newrank,psum);
+    if (rank) *rank = newrank[0]+1;
+    skiplistProbeReturn(update,sl,newscore);
+    return x;
+}
+
+SKIPLIST_API skiplistNode *SKIPLIST_NAME(UpdateScore)(skiplist *sl, double curscore, void *obj, double newscore) {
+    return SKIPLIST_NAME(UpdateScoreRank)(sl,curscore,obj,newscore,NULL);
+}
+
+/* Search for the element in the skip list, if found the
+ * node pointer is returned, otherwise NULL is returned. Without the member
+ * index the level zero list is scanned, since the skiplist is not ordered
+ * by object alone. */
+SKIPLIST_API void *SKIPLIST_NAME(Find)(skiplist *sl, void *obj) {
+    skiplistNode *x;
+    uint64_t prefix;
+
+    if (sl->hash) return SKIPLIST_NAME(IndexFind)(sl,obj);
+
+    prefix = SKIPLIST_PREFIX(sl,obj);
+    x = sl->header->level[0].forward;
+    while (x && SKIPLIST_NAME(CompareNode)(sl,x,obj,prefix) != 0)
+        x = x->level[0].forward;
+    return x;
+}
+
+/* Return 1 if an element with the given score/object would be evicted right
+ * after its insertion, because the skiplist is full and the element would
+ * become the new boundary. The check only looks at the head or the tail, so
+ * callers can reject such an insertion before allocating anything. */
+SKIPLIST_API int SKIPLIST_NAME(WouldEvict)(skiplist *sl, double score, void *obj) {
+    skiplistNode *x;
+
+    if (sl->maxlength == 0 || sl->length < sl->maxlength)
+        return 0;
+
+    if (sl->evict == SKIPLIST_EVICT_MIN) {
+        x = sl->header->level[0].forward;
+        return x && (score < x->score ||
+                     (score == x->score &&
+                      SKIPLIST_NAME(CompareNode)(sl,x,obj,SKIPLIST_PREFIX(sl,obj)) > 0));
+    } else {
+        x = sl->tail;
+        return x && (score > x->score ||
+                     (score == x->score &&
+                      SKIPLIST_NAME(CompareNode)(sl,x,obj,SKIPLIST_PREFIX(sl,obj)) < 0));
+    }
+}
+
+/* Remove up to 'budget' nodes whose expire time is not after 'now', in
+ * expire time order. The callback is optional, when given it is called for
+ * every element right before the element is released. Returns the number
+ * of removed elements. */
+SKIPLIST_API unsigned long SKIPLIST_NAME(ExpireStep)(skiplist *sl, double now, unsigned long budget, skiplistDeleteCb cb, void *ctx) {
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x, *y;
+    unsigned long removed = 0;
+    int i;
+
+    while (removed < budget && skiplistHasExpired(sl,now)) {
+        x = skiplistPopHead(sl->expires);
+
+        /* Seek the predecessors of the expired node. */
+        y = sl->header;
+        for (i = sl->level-1; i >= 0; i--) {
+            while (y->level[i].forward &&
+                (y->level[i].forward->score < x->score ||
+                    (y->level[i].forward->score == x->score &&
+                     SKIPLIST_NAME(CompareNode)(sl,y->level[i].forward,x->obj,x->prefix) < 0)))
+            {
+                y = y->level[i].forward;
+            }
+            update[i] = y;
+        }
+
+        skiplistDeleteNode(sl,x,update);
+        skiplistIndexDelete(sl,x);
+        if (cb) cb(ctx,x->obj);
+        skiplistFreeNode(sl,x);
+        removed++;
+    }
+    return removed;
+}
+
+/* Find the rank for an element by both score and key.
+ * Returns 0 when the element cannot be found, rank otherwise.
+ * Note that the rank is 1-based due to the span of sl->header to the
+ * first element. */
+SKIPLIST_API unsigned long SKIPLIST_NAME(GetRank)(skiplist *sl, double score, void *obj) {
+    skiplistNode *x;
+    unsigned long rank = 0;
+    uint64_t prefix = SKIPLIST_PREFIX(sl,obj);
+    int i;
+    skiplistProbeEntry(get_rank,sl,score);
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                 SKIPLIST_NAME(CompareNode)(sl,x->level[i].forward,obj,prefix) <= 0))) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+
+        /* x might be equal to sl->header, so test if obj is non-NULL */
+        if (x->obj && SKIPLIST_NAME(CompareNode)(sl,x,obj,prefix) == 0) {
+            skiplistProbeReturn(get_rank,sl,score);
+            return rank;
+        }
+    }
+    skiplistProbeReturn(get_rank,sl,score);
+    return 0;
+}
+
+/* Return the last node ordered before score/obj, sl->header if there is
+ * none. The element itself does not need to be in the skiplist, so a walk
+ * can resume from the last element it returned even if it was deleted. */
+SKIPLIST_API skiplistNode *SKIPLIST_NAME(LastBefore)(skiplist *sl, double score, void *obj) {
+    skiplistNode *x;
+    uint64_t prefix = SKIPLIST_PREFIX(sl,obj);
+    int i;
+
+    x = sl->header;
+    for (i = sl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                 SKIPLIST_NAME(CompareNode)(sl,x->level[i].forward,obj,prefix) < 0)))
+        {
+            x = x->level[i].forward;
+            skiplistHop();
+        }
+    }
+    return x;
+}
+
+/* Return 1 if node a comes before node b in the skiplist. */
+static inline int SKIPLIST_NAME(NodeLess)(skiplist *sl, skiplistNode *a, skiplistNode *b) {
+    return a->score < b->score ||
+        (a->score == b->score &&
+         SKIPLIST_NAME(CompareNode)(sl,a,b->obj,b->prefix) < 0);
+}
+
+/* Sort the n indexes of order[] by the position of the nodes they refer to,
+ * tmp is scratch space for n indexes. */
+static inline void SKIPLIST_NAME(SortNodes)(skiplist *sl, skiplistNode **nodes, unsigned long *order, unsigned long *tmp, unsigned long n) {
+    unsigned long mid = n/2, i = 0, j = mid, k = 0;
+
+    if (n < 2) return;
+    SKIPLIST_NAME(SortNodes)(sl,nodes,order,tmp,mid);
+    SKIPLIST_NAME(SortNodes)(sl,nodes,order+mid,tmp,n-mid);
+
+    while (i < mid && j < n) {
+        if (SKIPLIST_NAME(NodeLess)(sl,nodes[order[j]],nodes[order[i]]))
+            tmp[k++] = order[j++];
+        else
+            tmp[k++] = order[i++];
+    }
+    while (i < mid) tmp[k++] = order[i++];
+    while (j < n) tmp[k++] = order[j++];
+    memcpy(order,tmp,n*sizeof(*order));
+}
+
+/* Find the rank of several nodes at once, storing in ranks[k] the rank of
+ * nodes[k], or 0 when nodes[k] is NULL. The nodes are sorted by their
+ * position first, then every descent starts each level from the last node
+ * visited at that level by the previous one, so all the ranks are computed
+ * in a single forward traversal carrying the accumulated spans. */
+SKIPLIST_API void SKIPLIST_NAME(GetRanks)(skiplist *sl, skiplistNode **nodes, unsigned long *ranks, unsigned long n) {
+    skiplistNode *path[SKIPLIST_MAXLEVEL], *x, *target;
+    unsigned long pathrank[SKIPLIST_MAXLEVEL], traversed, *order, k, m = 0;
+    int i;
+
+    order = malloc(sizeof(*order)*n*2);
+    for (k = 0; k < n; k++) {
+        ranks[k] = 0;
+        if (nodes[k]) order[m++] = k;
+    }
+    SKIPLIST_NAME(SortNodes)(sl,nodes,order,order+n,m);
+
+    for (i = 0; i < sl->level; i++) {
+        path[i] = sl->header;
+        pathrank[i] = 0;
+    }
+
+    for (k = 0; k < m; k++) {
+        target = nodes[order[k]];
+        x = sl->header;
+        traversed = 0;
+        for (i = sl->level-1; i >= 0; i--) {
+            if (pathrank[i] > traversed) {
+                x = path[i];
+                traversed = pathrank[i];
+            }
+            while (x->level[i].forward &&
+                   !SKIPLIST_NAME(NodeLess)(sl,target,x->level[i].forward))
+            {
+                traversed += x->level[i].span;
+                x = x->level[i].forward;
+                skiplistHop();
+            }
+            path[i] = x;
+            pathrank[i] = traversed;
+            if (x == target) break;
+        }
+        ranks[order[k]] = traversed;
+    }
+
+    free(order);
+}
+
+#undef SKIPLIST_NAME
+#undef SKIPLIST_COMPARE
+#undef SKIPLIST_HASH
+#undef SKIPLIST_PREFIX
+#undef SKIPLIST_API
+
+#endif
@@ -0,0 +1,980 @@
+/* Sorted set sharded by score ranges, see skiplist_shard.h. */
+
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "skiplist_impl.h"
+#include "skiplist_shard.h"
+
+/* A fixed pool of threads running the jobs posted by skiplistWorkersRun(),
+ * the posting thread runs jobs as well until none is left. */
+struct skiplistWorkers {
+    pthread_mutex_t lock;
+    pthread_cond_t start; // signaled when jobs are posted or on stop
+    pthread_cond_t done; // signaled when the last job is finished
+    pthread_t *threads;
+    int count; // number of threads of the pool
+    void (*job)(void *arg, int i);
+    void *arg;
+    int next; // next job to run
+    int jobs; // number of jobs posted
+    int pending; // number of jobs not finished yet
+    int stop;
+};
+
+/* Run the posted jobs until none is left, called with the lock held. */
+static void skiplistWorkersDrain(skiplistWorkers *w) {
+    while (w->next < w->jobs) {
+        int i = w->next++;
+
+        pthread_mutex_unlock(&w->lock);
+        w->job(w->arg,i);
+        pthread_mutex_lock(&w->lock);
+        if (--w->pending == 0) pthread_cond_signal(&w->done);
+    }
+}
+
+static void *skiplistWorkersMain(void *arg) {
+    skiplistWorkers *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop) {
+        if (w->next < w->jobs)
+            skiplistWorkersDrain(w);
+        else
+            pthread_cond_wait(&w->start,&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* Create a pool running the jobs on 'threads' threads, the calling one
+ * included. NULL is returned for less than 2 threads, or if no thread can
+ * be started, the jobs then run in the calling thread. */
+skiplistWorkers *skiplistWorkersCreate(int threads) {
+    skiplistWorkers *w;
+    int i;
+
+    if (threads < 2) return NULL;
+    w = calloc(1,sizeof(*w));
+    pthread_mutex_init(&w->lock,NULL);
+    pthread_cond_init(&w->start,NULL);
+    pthread_cond_init(&w->done,NULL);
+    w->threads = malloc(sizeof(pthread_t)*(threads-1));
+    for (i = 0; i < threads-1; i++) {
+        if (pthread_create(&w->threads[w->count],NULL,skiplistWorkersMain,w) == 0)
+            w->count++;
+    }
+    if (w->count == 0) {
+        skiplistWorkersFree(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* Call job(arg,i) for every i in [0,n) and wait for all of them. The jobs
+ * run concurrently, each one on any thread of the pool. */
+void skiplistWorkersRun(skiplistWorkers *w, int n, void (*job)(void *arg, int i), void *arg) {
+    int i;
+
+    if (!w || n < 2) {
+        for (i = 0; i < n; i++) job(arg,i);
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->job = job;
+    w->arg = arg;
+    w->next = 0;
+    w->jobs = n;
+    w->pending = n;
+    pthread_cond_broadcast(&w->start);
+    skiplistWorkersDrain(w);
+    while (w->pending) pthread_cond_wait(&w->done,&w->lock);
+    w->next = w->jobs = 0;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Stop the threads and free the pool, NULL is accepted. */
+void skiplistWorkersFree(skiplistWorkers *w) {
+    int i;
+
+    if (!w) return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->start);
+    pthread_mutex_unlock(&w->lock);
+    for (i = 0; i < w->count; i++)
+        pthread_join(w->threads[i],NULL);
+
+    pthread_cond_destroy(&w->done);
+    pthread_cond_destroy(&w->start);
+    pthread_mutex_destroy(&w->lock);
+    free(w->threads);
+    free(w);
+}
+
+/* Skiplists handed to skiplistFreeLazy(), freed in that order by a single
+ * background thread started on first use. */
+typedef struct skiplistLazyJob {
+    skiplist *sl;
+    struct skiplistLazyJob *next;
+} skiplistLazyJob;
+
+static pthread_mutex_t skiplistLazyLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t skiplistLazyReady = PTHREAD_COND_INITIALIZER;
+static skiplistLazyJob *skiplistLazyHead, *skiplistLazyTail;
+static pthread_t skiplistLazyThread;
+static int skiplistLazyState; // 0 not started, 1 running, 2 stopping, -1 stopped or failed to start
+
+/* Below this number of nodes a skiplist is freed in the calling thread. */
+#define SKIPLIST_LAZYFREE_MIN 4096
+
+static void *skiplistLazyMain(void *arg) {
+    skiplistLazyJob *job;
+
+    (void)arg;
+    pthread_mutex_lock(&skiplistLazyLock);
+    while (1) {
+        while (!skiplistLazyHead && skiplistLazyState != 2)
+            pthread_cond_wait(&skiplistLazyReady,&skiplistLazyLock);
+        if (!skiplistLazyHead) break;
+        job = skiplistLazyHead;
+        skiplistLazyHead = job->next;
+        if (!skiplistLazyHead) skiplistLazyTail = NULL;
+        pthread_mutex_unlock(&skiplistLazyLock);
+        skiplistFree(job->sl);
+        free(job);
+        pthread_mutex_lock(&skiplistLazyLock);
+    }
+    pthread_mutex_unlock(&skiplistLazyLock);
+    return NULL;
+}
+
+/* Free sl, allocated by skiplistCreate() or malloc(), in the background
+ * thread. The caller only pays for queuing it, unless sl is small or the
+ * thread cannot be started. The callbacks of sl (release, objsize) run in
+ * the background thread. */
+void skiplistFreeLazy(skiplist *sl) {
+    skiplistLazyJob *job;
+
+    if (sl->length < SKIPLIST_LAZYFREE_MIN && !sl->pool) {
+        skiplistFree(sl);
+        return;
+    }
+
+    pthread_mutex_lock(&skiplistLazyLock);
+    if (skiplistLazyState == 0) {
+        skiplistLazyState =
+            pthread_create(&skiplistLazyThread,NULL,skiplistLazyMain,NULL) == 0 ? 1 : -1;
+    }
+    if (skiplistLazyState != 1) {
+        pthread_mutex_unlock(&skiplistLazyLock);
+        skiplistFree(sl);
+        return;
+    }
+
+    job = malloc(sizeof(*job));
+    job->sl = sl;
+    job->next = NULL;
+    if (skiplistLazyTail)
+        skiplistLazyTail->next = job;
+    else
+        skiplistLazyHead = job;
+    skiplistLazyTail = job;
+    pthread_cond_signal(&skiplistLazyReady);
+    pthread_mutex_unlock(&skiplistLazyLock);
+}
+
+/* Free the skiplists still queued and wait for the background thread to
+ * exit. skiplistFreeLazy() then frees in the calling thread, since the
+ * library may be unloaded at any time. */
+void skiplistFreeLazyStop(void) {
+    pthread_mutex_lock(&skiplistLazyLock);
+    if (skiplistLazyState != 1) {
+        pthread_mutex_unlock(&skiplistLazyLock);
+        return;
+    }
+    skiplistLazyState = 2;
+    pthread_cond_signal(&skiplistLazyReady);
+    pthread_mutex_unlock(&skiplistLazyLock);
+
+    pthread_join(skiplistLazyThread,NULL);
+
+    pthread_mutex_lock(&skiplistLazyLock);
+    skiplistLazyState = -1;
+    pthread_mutex_unlock(&skiplistLazyLock);
+}
+
+/* Same as skiplistFreeNodes() with skiplistFreeLazy(), for a skiplist
+ * embedded in something else: its content is moved to a copy first. */
+void skiplistFreeNodesLazy(skiplist *sl) {
+    skiplist *copy;
+
+    if (sl->length < SKIPLIST_LAZYFREE_MIN && !sl->pool) {
+        skiplistFreeNodes(sl);
+        return;
+    }
+    copy = malloc(sizeof(*copy));
+    *copy = *sl;
+    skiplistFreeLazy(copy);
+}
+
+/* Drop the objects already in the set ss, if given, or repeated in objs,
+ * keeping their first occurrence, with a hash table of positions using the
+ * hash function of the member index of ss, or of sl. Returns the positions
+ * of the objects kept. */
+static unsigned long *skiplistDistinct(skiplist *sl, skiplistShards *ss, unsigned long n, void **objs, unsigned long *kept) {
+    unsigned long *items = malloc(sizeof(unsigned long)*(n ? n : 1));
+    unsigned long *table = NULL, mask = 0, k, j, m = 0;
+    unsigned int (*hash)(const void *) = ss ? ss->hash : sl->hash;
+
+    if (hash) {
+        for (mask = 16; mask < n*2; mask *= 2);
+        table = calloc(mask,sizeof(unsigned long));
+        mask--;
+    }
+
+    for (k = 0; k < n; k++) {
+        int dup = ss && ss->length && skiplistShardsFind(ss,objs[k]);
+
+        if (table && !dup) {
+            j = hash(objs[k]) & mask;
+            while (table[j] && !(dup = sl->compare(objs[table[j]-1],objs[k]) == 0))
+                j = (j+1) & mask;
+            if (!dup) table[j] = k+1;
+        }
+        if (dup) {
+            if (sl->release) sl->release(objs[k]);
+        } else {
+            items[m++] = k;
+        }
+    }
+    free(table);
+    *kept = m;
+    return items;
+}
+
+/* A bulk build of an empty skiplist, a sample sort followed by the
+ * construction of one segment per bucket, see skiplistBuild(). The input
+ * is cut in 'parts' chunks and the sorted output in as many buckets. */
+typedef struct skiplistBuilder {
+    skiplist *sl;
+    unsigned long n;
+    const unsigned long *items; // positions of the objects in the input
+    const double *scores;
+    void **objs;
+    int parts;
+    unsigned int *seeds; // random seed of every chunk
+    skiplistNode **nodes; // nodes in input order, then scratch space
+    skiplistNode **sorted; // nodes grouped by bucket, then sorted
+    unsigned short *buckets; // bucket of every node
+    skiplistNode **splitters; // parts-1 nodes splitting the buckets
+    unsigned long *offsets; // position of bucket b of chunk c at c*parts+b
+    unsigned long *starts; // position of every bucket, plus the end
+    skiplist *segments; // the skiplist built from every bucket
+} skiplistBuilder;
+
+/* Like skiplistRandomLevel() with a generator of the calling job. */
+static int skiplistBuildLevel(unsigned int *seed) {
+    int level = 1;
+    while ((rand_r(seed)&0xFFFF) < (SKIPLIST_P * 0xFFFF))
+        level += 1;
+    return (level<SKIPLIST_MAXLEVEL) ? level : SKIPLIST_MAXLEVEL;
+}
+
+static void skiplistBuildChunk(skiplistBuilder *b, int i, unsigned long *from, unsigned long *to) {
+    *from = b->n*i/b->parts;
+    *to = b->n*(i+1)/b->parts;
+}
+
+static void skiplistBuildCreateJob(void *arg, int i) {
+    skiplistBuilder *b = arg;
+    unsigned long k, from, to, j;
+    int level;
+
+    skiplistBuildChunk(b,i,&from,&to);
+    for (k = from; k < to; k++) {
+        j = b->items ? b->items[k] : k;
+        level = skiplistBuildLevel(&b->seeds[i]);
+        b->nodes[k] = skiplistNewNode(b->sl,level,b->scores[j],b->objs[j]);
+        b->nodes[k]->level[0].span = level;
+    }
+}
+
+/* Find the bucket of every node of the chunk, the first one whose splitter
+ * comes after the node, so that equal elements share their bucket. */
+static void skiplistBuildClassifyJob(void *arg, int i) {
+    skiplistBuilder *b = arg;
+    unsigned long k, from, to;
+    int lo, hi, mid;
+
+    skiplistBuildChunk(b,i,&from,&to);
+    for (k = from; k < to; k++) {
+        lo = 0;
+        hi = b->parts-1;
+        while (lo < hi) {
+            mid = (lo+hi)/2;
+            if (skiplistNodeBefore(b->sl,b->nodes[k],b->splitters[mid]))
+                hi = mid;
+            else
+                lo = mid+1;
+        }
+        b->buckets[k] = lo;
+        b->offsets[(unsigned long)i*b->parts+lo]++;
+    }
+}
+
+/* Move the nodes of the chunk to their bucket, keeping their order. */
+static void skiplistBuildScatterJob(void *arg, int i) {
+    skiplistBuilder *b = arg;
+    unsigned long *offsets = b->offsets+(unsigned long)i*b->parts, k, from, to;
+
+    skiplistBuildChunk(b,i,&from,&to);
+    for (k = from; k < to; k++)
+        b->sorted[offsets[b->buckets[k]]++] = b->nodes[k];
+}
+
+/* Sort a bucket, drop the elements repeated in it, which are adjacent, and
+ * link the others into a segment. */
+static void skiplistBuildSegmentJob(void *arg, int i) {
+    skiplistBuilder *b = arg;
+    skiplistNode **run = b->sorted+b->starts[i];
+    skiplist *seg = &b->segments[i];
+    unsigned long n = b->starts[i+1]-b->starts[i], k, m = 0;
+
+    skiplistMergeSortNodes(b->sl,run,b->nodes+b->starts[i],n);
+    for (k = 0; k < n; k++) {
+        if (m && !skiplistNodeBefore(b->sl,run[m-1],run[k]))
+            skiplistFreeNode(b->sl,run[k]);
+        else
+            run[m++] = run[k];
+    }
+
+    /* The nodes are indexed when the segments are appended to sl. */
+    skiplistInitLike(seg,b->sl);
+    seg->hash = NULL;
+    skiplistAppendNodes(seg,run,m);
+}
+
+/* Build the empty skiplist sl from n objects with their scores, at the
+ * positions items[0..n-1] of the input, or 0..n-1 when items is NULL. The
+ * objects must have distinct members if sl has a member index, the other
+ * repeated elements are released keeping their first occurrence, like
+ * skiplistInsert() would do. Returns the number of elements of sl.
+ *
+ * The nodes are created in parallel, then sample sorted: sorted samples
+ * give parts-1 splitters, every chunk of the input finds the bucket of its
+ * nodes and moves them there, and every bucket is sorted and linked into a
+ * segment in parallel. The segments are then appended to sl in order,
+ * which relinks only their first and last node of every level. */
+static unsigned long skiplistBuild(skiplist *sl, skiplistWorkers *w, unsigned long n, const unsigned long *items, const double *scores, void **objs) {
+    skiplistBuilder b;
+    unsigned long samples, k, pos;
+    skiplistNode **sample;
+    int i, c;
+
+    b.sl = sl;
+    b.n = n;
+    b.items = items;
+    b.scores = scores;
+    b.objs = objs;
+    b.parts = w ? (w->count+1)*4 : 1;
+    if ((unsigned long)b.parts > n/1024) b.parts = n/1024;
+    if (b.parts < 1) b.parts = 1;
+
+    b.seeds = malloc(sizeof(unsigned int)*b.parts);
+    b.nodes = malloc(sizeof(skiplistNode *)*(n ? n : 1));
+    b.sorted = malloc(sizeof(skiplistNode *)*(n ? n : 1));
+    b.buckets = malloc(sizeof(unsigned short)*(n ? n : 1));
+    b.splitters = malloc(sizeof(skiplistNode *)*b.parts);
+    b.offsets = calloc((unsigned long)b.parts*b.parts,sizeof(unsigned long));
+    b.starts = malloc(sizeof(unsigned long)*(b.parts+1));
+    b.segments = malloc(sizeof(skiplist)*b.parts);
+
+    for (i = 0; i < b.parts; i++) b.seeds[i] = random();
+    skiplistWorkersRun(w,b.parts,skiplistBuildCreateJob,&b);
+
+    if (b.parts > 1) {
+        samples = (unsigned long)b.parts*64 < n ? (unsigned long)b.parts*64 : n;
+        sample = malloc(sizeof(skiplistNode *)*samples*2);
+        for (k = 0; k < samples; k++)
+            sample[k] = b.nodes[k*(n/samples)];
+        skiplistMergeSortNodes(sl,sample,sample+samples,samples);
+        for (i = 1; i < b.parts; i++)
+            b.splitters[i-1] = sample[i*samples/b.parts];
+        free(sample);
+    }
+    skiplistWorkersRun(w,b.parts,skiplistBuildClassifyJob,&b);
+
+    /* Every bucket gets the nodes of the chunks in order. */
+    for (i = 0, pos = 0; i < b.parts; i++) {
+        b.starts[i] = pos;
+        for (c = 0; c < b.parts; c++) {
+            k = b.offsets[(unsigned long)c*b.parts+i];
+            b.offsets[(unsigned long)c*b.parts+i] = pos;
+            pos += k;
+        }
+    }
+    b.starts[b.parts] = pos;
+    skiplistWorkersRun(w,b.parts,skiplistBuildScatterJob,&b);
+    skiplistWorkersRun(w,b.parts,skiplistBuildSegmentJob,&b);
+
+    for (i = 0; i < b.parts; i++) {
+        skiplistConcat(sl,&b.segments[i]);
+        skiplistFreeNodes(&b.segments[i]);
+    }
+
+    free(b.segments);
+    free(b.starts);
+    free(b.offsets);
+    free(b.splitters);
+    free(b.buckets);
+    free(b.sorted);
+    free(b.nodes);
+    free(b.seeds);
+    return sl->length;
+}
+
+/* Insert n objects with their scores into sl, taking the ownership of all
+ * of them: the objects already in sl, or repeated, are released. The
+ * result is the same as inserting them one by one in their order. An empty
+ * skiplist without capacity is built in parallel by the pool w, NULL
+ * meaning the calling thread, otherwise the objects are inserted one by
+ * one. Returns the number of inserted objects. */
+unsigned long skiplistLoad(skiplist *sl, skiplistWorkers *w, unsigned long n, const double *scores, void **objs) {
+    unsigned long *items, m, k, inserted = 0;
+
+    if (sl->length || sl->maxlength) {
+        for (k = 0; k < n; k++) {
+            if (skiplistInsert(sl,scores[k],objs[k]))
+                inserted++;
+            else if (sl->release)
+                sl->release(objs[k]);
+        }
+        return inserted;
+    }
+
+    items = skiplistDistinct(sl,NULL,n,objs,&m);
+    inserted = skiplistBuild(sl,w,m,items,scores,objs);
+    free(items);
+    return inserted;
+}
+
+/* The part of a bulk operation done by one shard. */
+typedef struct skiplistShardsJob {
+    skiplist *sl;
+    unsigned long start, end; // ranks in the shard, 1-based and inclusive
+    skiplistNode **nodes; // where range reads and loads store the nodes
+    unsigned long *items; // positions in the input of a load
+    unsigned long count; // number of positions in items
+    const double *scores;
+    void **objs;
+    unsigned long result; // number of nodes read, removed or inserted
+} skiplistShardsJob;
+
+/* Initialize a sharded set made of the empty skiplist 'first', which is
+ * owned by the set from now on. New shards are created like it. The member
+ * index of first, if enabled, becomes the one of the whole set. */
+void skiplistShardsInit(skiplistShards *ss, skiplist *first, unsigned long maxshard, int threads) {
+    ss->size = 4;
+    ss->shards = malloc(sizeof(skiplist *)*ss->size);
+    ss->bounds = malloc(sizeof(double)*ss->size);
+    ss->shards[0] = first;
+    ss->bounds[0] = -HUGE_VAL;
+    ss->count = 1;
+    ss->length = first->length;
+    ss->maxshard = maxshard < 2 ? 2 : maxshard;
+    ss->workers = skiplistWorkersCreate(threads);
+    ss->hash = first->hash;
+    ss->index = NULL;
+    ss->indexsize = 0;
+    first->hash = NULL;
+}
+
+/* Free the shards, the large ones in the background, and the worker
+ * threads, but not ss. */
+void skiplistShardsFreeShards(skiplistShards *ss) {
+    int i;
+
+    for (i = 0; i < ss->count; i++)
+        skiplistFreeLazy(ss->shards[i]);
+    skiplistWorkersFree(ss->workers);
+    free(ss->shards);
+    free(ss->bounds);
+    free(ss->index);
+}
+
+/* Return the index of the shard holding the given score. */
+int skiplistShardsIndex(skiplistShards *ss, double score) {
+    int lo = 0, hi = ss->count-1, mid;
+
+    while (lo < hi) {
+        mid = (lo+hi+1)/2;
+        if (ss->bounds[mid] <= score)
+            lo = mid;
+        else
+            hi = mid-1;
+    }
+    return lo;
+}
+
+/* Insert the shard sl at index i, holding the scores from 'bound'. */
+static void skiplistShardsAdd(skiplistShards *ss, int i, skiplist *sl, double bound) {
+    if (ss->count == ss->size) {
+        ss->size *= 2;
+        ss->shards = realloc(ss->shards,sizeof(skiplist *)*ss->size);
+        ss->bounds = realloc(ss->bounds,sizeof(double)*ss->size);
+    }
+    memmove(ss->shards+i+1,ss->shards+i,sizeof(skiplist *)*(ss->count-i));
+    memmove(ss->bounds+i+1,ss->bounds+i,sizeof(double)*(ss->count-i));
+    ss->shards[i] = sl;
+    ss->bounds[i] = bound;
+    ss->count++;
+}
+
+/* Split shard i in two halves, at a score boundary since the shards are
+ * partitioned by score. Returns 0 if all its elements have the same
+ * score. */
+static int skiplistShardsSplit(skiplistShards *ss, int i) {
+    skiplist *sl = ss->shards[i], *dst;
+    skiplistNode *x = skiplistGetNodeByRank(sl,sl->length/2+1);
+    unsigned long rank = skiplistGetScoreRank(sl,x->score,1);
+
+    if (rank == 0) rank = skiplistGetScoreRank(sl,x->score,0);
+    if (rank == sl->length) return 0;
+
+    dst = malloc(sizeof(*dst));
+    skiplistInitLike(dst,sl);
+    skiplistSplit(sl,rank,dst);
+    skiplistShardsAdd(ss,i+1,dst,dst->header->level[0].forward->score);
+    return 1;
+}
+
+/* Append shard i+1 to shard i. */
+static void skiplistShardsMerge(skiplistShards *ss, int i) {
+    skiplistConcat(ss->shards[i],ss->shards[i+1]);
+    skiplistFree(ss->shards[i+1]);
+    memmove(ss->shards+i+1,ss->shards+i+2,sizeof(skiplist *)*(ss->count-i-2));
+    memmove(ss->bounds+i+1,ss->bounds+i+2,sizeof(double)*(ss->count-i-2));
+    ss->count--;
+}
+
+/* Split shard i if it is too long, or merge it with its shortest neighbour
+ * if both fit in half a shard. */
+static void skiplistShardsBalance(skiplistShards *ss, int i) {
+    unsigned long len = ss->shards[i]->length, prev, next, half = ss->maxshard/2;
+
+    if (len > ss->maxshard) {
+        skiplistShardsSplit(ss,i);
+        return;
+    }
+    if (ss->count == 1 || len > half) return;
+
+    prev = i > 0 ? ss->shards[i-1]->length : ULONG_MAX;
+    next = i < ss->count-1 ? ss->shards[i+1]->length : ULONG_MAX;
+    if (prev <= next && prev <= half-len)
+        skiplistShardsMerge(ss,i-1);
+    else if (next < prev && next <= half-len)
+        skiplistShardsMerge(ss,i);
+}
+
+/* Balance all the shards after a bulk operation. */
+static void skiplistShardsBalanceAll(skiplistShards *ss) {
+    int i;
+
+    for (i = 0; i < ss->count; i++) {
+        while (ss->shards[i]->length > ss->maxshard && skiplistShardsSplit(ss,i));
+    }
+    for (i = 0; i < ss->count-1;) {
+        if (ss->shards[i]->length+ss->shards[i+1]->length <= ss->maxshard/2)
+            skiplistShardsMerge(ss,i);
+        else
+            i++;
+    }
+}
+
+/* The member index of a sharded set works like the one of a skiplist, see
+ * skiplistIndexAdd(), for the nodes of all the shards, which have no index
+ * of their own: a point operation probes a single table, and the nodes
+ * moved by a split or a merge stay indexed as they are. */
+
+static void skiplistShardsIndexResize(skiplistShards *ss, unsigned long size) {
+    skiplistNode **old = ss->index;
+    unsigned long oldsize = ss->indexsize, i, j;
+
+    ss->index = calloc(size,sizeof(skiplistNode *));
+    ss->indexsize = size;
+    for (i = 0; i < oldsize; i++) {
+        if (old[i] == NULL) continue;
+        j = ss->hash(old[i]->obj) & (size-1);
+        while (ss->index[j]) j = (j+1) & (size-1);
+        ss->index[j] = old[i];
+    }
+    free(old);
+}
+
+/* Add a node to the index, ss->length must not account for it yet. */
+static void skiplistShardsIndexAdd(skiplistShards *ss, skiplistNode *x) {
+    unsigned long j;
+
+    if (!ss->hash) return;
+    if ((ss->length+1)*2 > ss->indexsize)
+        skiplistShardsIndexResize(ss,ss->indexsize ? ss->indexsize*2 : 16);
+
+    j = ss->hash(x->obj) & (ss->indexsize-1);
+    while (ss->index[j]) j = (j+1) & (ss->indexsize-1);
+    ss->index[j] = x;
+}
+
+/* Remove a node from the index, before it is freed, like
+ * skiplistIndexDelete(). ss->length must not account for it anymore. */
+static void skiplistShardsIndexDelete(skiplistShards *ss, skiplistNode *x) {
+    unsigned long mask, i, j, k;
+
+    if (!ss->hash) return;
+    mask = ss->indexsize-1;
+    i = ss->hash(x->obj) & mask;
+    while (ss->index[i] != x) i = (i+1) & mask;
+    ss->index[i] = NULL;
+
+    for (j = (i+1) & mask; ss->index[j]; j = (j+1) & mask) {
+        k = ss->hash(ss->index[j]->obj) & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        ss->index[i] = ss->index[j];
+        ss->index[j] = NULL;
+        i = j;
+    }
+
+    if (ss->indexsize > 16 && ss->length*8 < ss->indexsize)
+        skiplistShardsIndexResize(ss,ss->indexsize/2);
+}
+
+/* Return the node of an object, searching the member index, or every
+ * shard without one. */
+skiplistNode *skiplistShardsFind(skiplistShards *ss, void *obj) {
+    skiplist *sl = ss->shards[0];
+    skiplistNode *x;
+    unsigned long j;
+    uint64_t prefix;
+    int i;
+
+    if (!ss->hash) {
+        for (i = 0; i < ss->count; i++) {
+            x = skiplistFind(ss->shards[i],obj);
+            if (x) return x;
+        }
+        return NULL;
+    }
+
+    if (ss->indexsize == 0) return NULL;
+    prefix = sl->prefix ? sl->prefix(obj) : 0;
+    j = ss->hash(obj) & (ss->indexsize-1);
+    while ((x = ss->index[j])) {
+        if (x->prefix == prefix && sl->compare(x->obj,obj) == 0) return x;
+        j = (j+1) & (ss->indexsize-1);
+    }
+    return NULL;
+}
+
+/* Insert the object into the shard of its score, NULL is returned if the
+ * object is already in some shard. */
+skiplistNode *skiplistShardsInsert(skiplistShards *ss, double score, void *obj) {
+    skiplistNode *x;
+    int i;
+
+    if (skiplistShardsFind(ss,obj)) return NULL;
+    i = skiplistShardsIndex(ss,score);
+    x = skiplistInsert(ss->shards[i],score,obj);
+    if (!x) return NULL;
+    skiplistShardsIndexAdd(ss,x);
+    ss->length++;
+    skiplistShardsBalance(ss,i);
+    return x;
+}
+
+int skiplistShardsDelete(skiplistShards *ss, double score, void *obj) {
+    int i = skiplistShardsIndex(ss,score);
+    skiplistNode *x;
+
+    if (ss->hash) {
+        /* The node leaves the member index before it is freed. */
+        x = skiplistShardsFind(ss,obj);
+        if (!x || x->score != score) return 0;
+        ss->length--;
+        skiplistShardsIndexDelete(ss,x);
+        skiplistDelete(ss->shards[i],score,obj);
+    } else {
+        if (!skiplistDelete(ss->shards[i],score,obj)) return 0;
+        ss->length--;
+    }
+    skiplistShardsBalance(ss,i);
+    return 1;
+}
+
+/* Update the score of an element, see skiplistUpdateScore(). An element
+ * whose new score falls in another shard has its node moved there, so the
+ * member index still points to it. Returns the node, or NULL if the
+ * element is not in the set. */
+skiplistNode *skiplistShardsUpdateScore(skiplistShards *ss, double curscore, void *obj, double newscore) {
+    int i = skiplistShardsIndex(ss,curscore), j = skiplistShardsIndex(ss,newscore);
+    skiplistNode *x;
+
+    if (i == j) return skiplistUpdateScore(ss->shards[i],curscore,obj,newscore);
+    x = skiplistMoveNode(ss->shards[i],curscore,obj,ss->shards[j],newscore);
+    if (!x) return NULL;
+
+    /* Balancing a shard only moves the ones after its left neighbour. */
+    skiplistShardsBalance(ss,i > j ? i : j);
+    skiplistShardsBalance(ss,i > j ? j : i);
+    return x;
+}
+
+/* Number of elements of the shards before shard i. */
+static unsigned long skiplistShardsBefore(skiplistShards *ss, int i) {
+    unsigned long rank = 0;
+    int j;
+
+    for (j = 0; j < i; j++) rank += ss->shards[j]->length;
+    return rank;
+}
+
+unsigned long skiplistShardsGetRank(skiplistShards *ss, double score, void *obj) {
+    int i = skiplistShardsIndex(ss,score);
+    unsigned long rank = skiplistGetRank(ss->shards[i],score,obj);
+
+    return rank ? skiplistShardsBefore(ss,i)+rank : 0;
+}
+
+unsigned long skiplistShardsGetScoreRank(skiplistShards *ss, double score, int ex) {
+    int i = skiplistShardsIndex(ss,score);
+
+    return skiplistShardsBefore(ss,i)+skiplistGetScoreRank(ss->shards[i],score,ex);
+}
+
+skiplistNode *skiplistShardsGetNodeByRank(skiplistShards *ss, unsigned long rank) {
+    int i;
+
+    if (rank == 0) return NULL;
+    for (i = 0; i < ss->count; i++) {
+        if (rank <= ss->shards[i]->length)
+            return skiplistGetNodeByRank(ss->shards[i],rank);
+        rank -= ss->shards[i]->length;
+    }
+    return NULL;
+}
+
+/* Fill a job for every shard holding some of the global ranks start to end,
+ * pointing at nodes+k for the global rank start+k. Returns the number of
+ * jobs. */
+static int skiplistShardsRangeJobs(skiplistShards *ss, unsigned long start, unsigned long end, skiplistNode **nodes, skiplistShardsJob *jobs) {
+    unsigned long base = 0, lo, hi;
+    int i, n = 0;
+
+    for (i = 0; i < ss->count && base < end; i++) {
+        skiplist *sl = ss->shards[i];
+
+        lo = start > base ? start : base+1;
+        hi = end < base+sl->length ? end : base+sl->length;
+        if (lo <= hi) {
+            jobs[n].sl = sl;
+            jobs[n].start = lo-base;
+            jobs[n].end = hi-base;
+            jobs[n].nodes = nodes ? nodes+(lo-start) : NULL;
+            jobs[n].result = 0;
+            n++;
+        }
+        base += sl->length;
+    }
+    return n;
+}
+
+static void skiplistShardsGetRangeJob(void *arg, int i) {
+    skiplistShardsJob *job = (skiplistShardsJob *)arg+i;
+    skiplistNode *x = skiplistGetNodeByRank(job->sl,job->start);
+    unsigned long k, n = job->end-job->start+1;
+
+    for (k = 0; k < n; k++) {
+        job->nodes[k] = x;
+        x = x->level[0].forward;
+    }
+    job->result = n;
+}
+
+/* Store in nodes the nodes with a global rank between start and end, both
+ * inclusive and 1-based, returning their number. nodes must have room for
+ * end-start+1 nodes. Every shard walks its part in parallel. */
+unsigned long skiplistShardsGetRange(skiplistShards *ss, unsigned long start, unsigned long end, skiplistNode **nodes) {
+    skiplistShardsJob *jobs;
+    int n;
+
+    if (start < 1) start = 1;
+    if (end > ss->length) end = ss->length;
+    if (start > end) return 0;
+
+    jobs = malloc(sizeof(*jobs)*ss->count);
+    n = skiplistShardsRangeJobs(ss,start,end,nodes,jobs);
+    skiplistWorkersRun(ss->workers,n,skiplistShardsGetRangeJob,jobs);
+    free(jobs);
+    return end-start+1;
+}
+
+static void skiplistShardsDeleteRangeJob(void *arg, int i) {
+    skiplistShardsJob *job = (skiplistShardsJob *)arg+i;
+
+    job->result = skiplistDeleteRangeByRank(job->sl,job->start,job->end,NULL,NULL);
+}
+
+/* Delete the elements with a global rank between start and end, both
+ * inclusive and 1-based. Every shard deletes its part in parallel. */
+unsigned long skiplistShardsDeleteRangeByRank(skiplistShards *ss, unsigned long start, unsigned long end) {
+    skiplistShardsJob *jobs;
+    unsigned long removed = 0;
+    int i, n;
+
+    if (start < 1) start = 1;
+    if (end > ss->length) end = ss->length;
+    if (start > end) return 0;
+
+    jobs = malloc(sizeof(*jobs)*ss->count);
+    n = skiplistShardsRangeJobs(ss,start,end,NULL,jobs);
+
+    /* The nodes leave the member index before the jobs free them. */
+    for (i = 0; ss->hash && i < n; i++) {
+        skiplistNode *x = skiplistGetNodeByRank(jobs[i].sl,jobs[i].start);
+        unsigned long k;
+
+        for (k = jobs[i].start; k <= jobs[i].end; k++) {
+            ss->length--;
+            removed++;
+            skiplistShardsIndexDelete(ss,x);
+            x = x->level[0].forward;
+        }
+    }
+    skiplistWorkersRun(ss->workers,n,skiplistShardsDeleteRangeJob,jobs);
+    if (!ss->hash) {
+        for (i = 0; i < n; i++) removed += jobs[i].result;
+        ss->length -= removed;
+    }
+    free(jobs);
+
+    skiplistShardsBalanceAll(ss);
+    return removed;
+}
+
+static int skiplistShardsCompareScore(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Replace the single empty shard by shards splitting the given scores in
+ * parts of about half a shard, the bounds being taken from a sorted sample
+ * of the scores. */
+static void skiplistShardsPartition(skiplistShards *ss, unsigned long n, const double *scores, const unsigned long *items) {
+    unsigned long parts = n/(ss->maxshard/2)+1, samples = parts*32, k;
+    double *sample;
+
+    if (parts < 2) return;
+    if (samples > n) samples = n;
+    sample = malloc(sizeof(double)*samples);
+    for (k = 0; k < samples; k++)
+        sample[k] = scores[items[k*(n/samples)]];
+    qsort(sample,samples,sizeof(double),skiplistShardsCompareScore);
+
+    for (k = 1; k < parts; k++) {
+        double bound = sample[k*samples/parts];
+        skiplist *sl;
+
+        if (bound <= ss->bounds[ss->count-1]) continue;
+        sl = malloc(sizeof(*sl));
+        skiplistInitLike(sl,ss->shards[0]);
+        skiplistShardsAdd(ss,ss->count,sl,bound);
+    }
+    free(sample);
+}
+
+/* Insert the objects of a shard, storing the new nodes in job->nodes. */
+static void skiplistShardsLoadJob(void *arg, int i) {
+    skiplistShardsJob *job = (skiplistShardsJob *)arg+i;
+    skiplistNode *x;
+    unsigned long k, j;
+
+    if (job->sl->length == 0 && job->sl->maxlength == 0) {
+        job->result = skiplistBuild(job->sl,NULL,job->count,job->items,job->scores,job->objs);
+        x = job->sl->header->level[0].forward;
+        for (k = 0; k < job->result; k++, x = x->level[0].forward)
+            job->nodes[k] = x;
+        return;
+    }
+    for (k = 0; k < job->count; k++) {
+        j = job->items[k];
+        x = skiplistInsert(job->sl,job->scores[j],job->objs[j]);
+        if (x)
+            job->nodes[job->result++] = x;
+        else if (job->sl->release)
+            job->sl->release(job->objs[j]);
+    }
+}
+
+/* Insert n objects with their scores, taking the ownership of all of them:
+ * the objects already in the set, or repeated, are released. The objects
+ * are routed to their shard, then every shard inserts its objects in
+ * parallel, an empty shard being built by skiplistBuild(). An empty set is
+ * first partitioned by a sample of the scores.
+ * Without member index the objects must be distinct. Returns the number of
+ * inserted objects. */
+unsigned long skiplistShardsLoad(skiplistShards *ss, unsigned long n, const double *scores, void **objs) {
+    skiplistShardsJob *jobs;
+    unsigned long *items, *routed, *shard, m, k, inserted = 0;
+    skiplistNode **nodes;
+    int i;
+
+    items = skiplistDistinct(ss->shards[0],ss,n,objs,&m);
+    if (ss->length == 0 && ss->count == 1 && m > ss->maxshard)
+        skiplistShardsPartition(ss,m,scores,items);
+
+    /* Counting sort of the positions by shard. */
+    jobs = calloc(ss->count,sizeof(*jobs));
+    shard = malloc(sizeof(unsigned long)*(m ? m : 1));
+    routed = malloc(sizeof(unsigned long)*(m ? m : 1));
+    nodes = malloc(sizeof(skiplistNode *)*(m ? m : 1));
+    for (k = 0; k < m; k++) {
+        shard[k] = skiplistShardsIndex(ss,scores[items[k]]);
+        jobs[shard[k]].count++;
+    }
+    for (i = 0, k = 0; i < ss->count; i++) {
+        jobs[i].sl = ss->shards[i];
+        jobs[i].items = routed+k;
+        jobs[i].nodes = nodes+k;
+        jobs[i].scores = scores;
+        jobs[i].objs = objs;
+        k += jobs[i].count;
+        jobs[i].count = 0;
+    }
+    for (k = 0; k < m; k++) {
+        skiplistShardsJob *job = &jobs[shard[k]];
+        job->items[job->count++] = items[k];
+    }
+
+    skiplistWorkersRun(ss->workers,ss->count,skiplistShardsLoadJob,jobs);
+    for (i = 0; i < ss->count; i++) {
+        for (k = 0; k < jobs[i].result; k++) {
+            skiplistShardsIndexAdd(ss,jobs[i].nodes[k]);
+            ss->length++;
+        }
+        inserted += jobs[i].result;
+    }
+
+    free(nodes);
+    free(routed);
+    free(shard);
+    free(items);
+    free(jobs);
+
+    skiplistShardsBalanceAll(ss);
+    return inserted;
+}
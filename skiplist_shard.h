@@ -0,0 +1,69 @@
+/* A sorted set made of several skiplists, the shards, partitioned by score
+ * ranges: shard i holds the elements with a score in [bounds[i],
+ * bounds[i+1]). The global rank of an element is its rank in its shard
+ * plus the lengths of the shards before it. A shard growing beyond
+ * maxshard elements is split in two with skiplistSplit(), and two
+ * neighbours holding together no more than maxshard/2 elements are merged
+ * with skiplistConcat().
+ *
+ * Point operations go to a single shard, found from the score, or from the
+ * member index that the set keeps for all its shards at once: the nodes
+ * must stay where they are, so the shards are not defragmented. Range
+ * reads, range deletions and bulk loads touching several shards run one job
+ * per shard on a pool of worker threads, so the callbacks of the shards
+ * (compare, hash, release, objsize) must be thread safe. Everything else,
+ * including the calls to the functions below, must happen in a single
+ * thread. The pool also bulk loads a single skiplist with skiplistLoad().
+ * The counters of SKIPLIST_METRICS are not atomic, they are approximate
+ * while jobs run.
+ *
+ * Large skiplists given to skiplistFreeLazy() are freed by another,
+ * single background thread, their release and objsize callbacks must be
+ * thread safe as well. A library unloaded while the thread runs would pull
+ * its code away: skiplistFreeLazyStop() must be called before. */
+
+#ifndef __SKIPLIST_SHARD_H
+#define __SKIPLIST_SHARD_H
+
+#include "skiplist.h"
+
+typedef struct skiplistWorkers skiplistWorkers;
+
+typedef struct skiplistShards {
+    skiplist **shards; // by increasing scores
+    double *bounds; // lowest score of each shard, bounds[0] is -inf
+    int count; // number of shards
+    int size; // slots allocated for shards and bounds
+    unsigned long length; // number of elements of all the shards
+    unsigned long maxshard; // a shard longer than this is split
+    skiplistWorkers *workers; // NULL when jobs run in the calling thread
+    unsigned int (*hash)(const void *); // member index hash, NULL if disabled
+    skiplistNode **index; // member index of all the shards
+    unsigned long indexsize; // number of slots of the member index
+} skiplistShards;
+
+skiplistWorkers *skiplistWorkersCreate(int threads);
+void skiplistWorkersRun(skiplistWorkers *w, int n, void (*job)(void *arg, int i), void *arg);
+void skiplistWorkersFree(skiplistWorkers *w);
+
+void skiplistFreeLazy(skiplist *sl);
+void skiplistFreeNodesLazy(skiplist *sl);
+void skiplistFreeLazyStop(void);
+
+unsigned long skiplistLoad(skiplist *sl, skiplistWorkers *w, unsigned long n, const double *scores, void **objs);
+
+void skiplistShardsInit(skiplistShards *ss, skiplist *first, unsigned long maxshard, int threads);
+void skiplistShardsFreeShards(skiplistShards *ss);
+int skiplistShardsIndex(skiplistShards *ss, double score);
+skiplistNode *skiplistShardsInsert(skiplistShards *ss, double score, void *obj);
+int skiplistShardsDelete(skiplistShards *ss, double score, void *obj);
+skiplistNode *skiplistShardsUpdateScore(skiplistShards *ss, double curscore, void *obj, double newscore);
+skiplistNode *skiplistShardsFind(skiplistShards *ss, void *obj);
+unsigned long skiplistShardsGetRank(skiplistShards *ss, double score, void *obj);
+unsigned long skiplistShardsGetScoreRank(skiplistShards *ss, double score, int ex);
+skiplistNode *skiplistShardsGetNodeByRank(skiplistShards *ss, unsigned long rank);
+unsigned long skiplistShardsGetRange(skiplistShards *ss, unsigned long start, unsigned long end, skiplistNode **nodes);
+unsigned long skiplistShardsDeleteRangeByRank(skiplistShards *ss, unsigned long start, unsigned long end);
+unsigned long skiplistShardsLoad(skiplistShards *ss, unsigned long n, const double *scores, void **objs);
+
+#endif
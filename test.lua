@@ -225,6 +225,554 @@ assert(zs:count() == 1)
 assert(zs:rank(10) == 1)
 
 
+print("test pop")
+zs = gen_zset(10)
+assert(equal(zs:pop_min(), { 1, 1 }))
+assert(equal(zs:pop_min(2), { 2, 2, 3, 3 }))
+assert(equal(zs:pop_max(2), { 10, 10, 9, 9 }))
+assert(zs:count() == 5)
+assert(zs:score(1) == nil and zs:score(10) == nil)
+assert(zs:rank(4) == 1 and zs:rank(8) == 5)
+assert(equal(zs:pop_max(100), { 8, 8, 7, 7, 6, 6, 5, 5, 4, 4 }))
+assert(zs:count() == 0)
+assert(equal(zs:pop_min(), {}))
+
+zs = zset_string()
+for i = 1, 100 do
+    zs:insert(i, tostring(i))
+end
+for i = 1, 50 do
+    local t = zs:pop_min()
+    assert(t[1] == i and t[2] == tostring(i))
+    t = zs:pop_max()
+    assert(t[1] == 101 - i and t[2] == tostring(101 - i))
+end
+assert(#zs == 0)
+
+
+print("test max size")
+zs = zset.new(zset.TYPE_NUMBER, { max_size = 3 })
+for i = 1, 10 do
+    zs:insert(i, i)
+end
+assert(zs:count() == 3)
+assert(equal(zs:get_range_by_rank(1, 3), { 8, 9, 10 }))
+assert(zs:score(7) == nil and zs:score(8) == 8)
+zs:insert(1, 1)
+assert(zs:count() == 3 and zs:score(1) == nil)
+zs:insert(9, 5)
+assert(equal(zs:get_range_by_rank(1, 3), { 5, 9, 10 }))
+assert(zs:score(8) == nil)
+
+zs = zset.new(zset.TYPE_STRING, { max_size = 3, evict = "max" })
+for i = 1, 10 do
+    zs:insert(i, tostring(i))
+end
+assert(equal(zs:get_range_by_rank(1, 3), { "1", "2", "3" }))
+assert(zs:score("4") == nil)
+
+zs = zset_string({ max_size = 2 })
+assert(zs:insert(1, "a") == true)
+assert(zs:insert(1, "a") == false)
+assert(zs:insert(2, "b") == true)
+assert(zs:insert(0, "c") == false)
+local ok, score, key = zs:insert(3, "c")
+assert(ok and score == 1 and key == "a")
+assert(#zs == 2)
+
+
+print("test incrby")
+zs = gen_zset(10)
+assert(zs:incrby(1, 0.5) == 1.5)
+assert(zs:rank(1) == 1)
+assert(select(2, zs:incrby(1, 10, true)) == 10)
+assert(zs:score(1) == 11.5 and zs:rank(1) == 10)
+assert(select(2, zs:incrby(10, -100, true)) == 1)
+assert(zs:incrby(11, 3) == 3 and zs:rank(11) == 4)
+assert(zs:count() == 11)
+
+zs = zset_string()
+zs:insert(1, "a")
+zs:insert(2, "b")
+assert(zs:score("a") == 1 and zs:score("c") == nil)
+assert(zs:insert(5, "a") == false)
+local score, rank = zs:incrby("a", 2, true)
+assert(score == 3 and rank == 2)
+assert(zs:get_rank(3, "a") == 2)
+assert(zs:incrby("c", -1) == -1)
+assert(equal(zs:get_range_by_rank(1, 3), { "c", "b", "a" }))
+
+
+print("test ttl")
+zs = zset_string()
+for i = 1, 10 do
+    zs:insert(i, tostring(i))
+end
+assert(zs:expire("3", 0) and zs:expire("5", -1) and zs:expire("7", 100))
+assert(not zs:expire("11", 1))
+assert(zs:ttl("1") == -1 and zs:ttl("7") > 99 and zs:ttl("3") == nil)
+assert(zs:score("3") == nil and zs:get_rank(5, "5") == nil)
+assert(equal(zs:get_range_by_rank(1, 6), { "1", "2", "4", "6" }))
+assert(equal(zs:get_range_by_score(6, 2), { "6", "4", "2" }))
+assert(#zs == 10)
+assert(zs:persist("7") and not zs:persist("7") and zs:ttl("7") == -1)
+assert(zs:expire_step(1) == 1 and #zs == 9)
+assert(zs:insert(30, "3") == true and zs:score("3") == 30)
+assert(#zs == 9 and zs:expire_step() == 0)
+
+zs = zset_string()
+for i = 1, 6 do
+    zs:insert(i, tostring(i))
+end
+zs:expire("1", 0)
+zs:expire("2", 0)
+assert(equal(zs:pop_min(1, function(m)
+    -- the popped range is already unlinked
+    assert(zs:delete(tonumber(m) + 3, tostring(tonumber(m) + 3)))
+    zs:insert(0, "x" .. m)
+end), { 3, "3" }))
+assert(equal(zs:get_range_by_rank(1, 10), { "x1", "x2", "6" }))
+
+zs = zset.new(zset.TYPE_NUMBER)
+for i = 1, 10 do
+    zs:insert(i, i)
+end
+zs:expire(1, 0)
+zs:expire(2, 0)
+zs:expire(3, 0)
+assert(zs:score(1) == nil and zs:rank(2) == nil)
+zs:insert(2, 2)
+assert(zs:score(2) == 2 and zs:rank(2) == 2)
+assert(equal(zs:pop_min(), { 2, 2 }))
+assert(zs._dict[1] == nil and zs:count() == 8)
+assert(zs:expire_step(10) == 1 and zs._dict[3] == nil)
+assert(zs:count() == 7)
+
+
+print("test sum")
+zs = zset.new(zset.TYPE_NUMBER, { sum = true })
+for i = 1, 100 do
+    zs:insert(i, i)
+end
+assert(equal({ zs:sum_by_rank(1, 100) }, { 5050, 100 }))
+assert(equal({ zs:sum_by_rank(10, 1) }, { 55, 10 }))
+assert(equal({ zs:sum_by_rank(95, 200) }, { 485, 6 }))
+assert(equal({ zs:sum_by_score(10.5, 20) }, { 165, 10 }))
+assert(zs:count_by_score(10.5, 20) == 10)
+zs:insert(1000, 1)
+zs:incrby(2, 0.5)
+zs:delete(3)
+zs:remove_gt(99)
+assert(equal({ zs:sum_by_rank(1, 3) }, { 4 + 5 + 2.5, 3 }))
+assert(equal({ zs:sum_by_score(0, 1000) }, { 5050 - 1 - 3 - 100 + 0.5, 97 }))
+zs = gen_zset(1)
+assert(not pcall(zs.sum_by_rank, zs, 1, 1))
+
+
+print("test at many")
+zs = zset.new(zset.TYPE_NUMBER)
+for i = 1, 100 do
+    zs:insert(i * 10, i)
+end
+assert(equal(zs:at_many({ 50, 3, 100, 3 }),
+             { 500, 50, 30, 3, 1000, 100, 30, 3 }))
+local t = zs:at_many({ 0, 2, 101 })
+assert(t[1] == nil and t[3] == 20 and t[4] == 2 and t[6] == nil)
+assert(equal(zs:quantiles({ 0.5, 0.9, 0.99, 0, 1 }),
+             { 500, 50, 900, 90, 990, 99, 10, 1, 1000, 100 }))
+assert(not pcall(zs.quantiles, zs, { 1.5 }))
+assert(next(zset.new(zset.TYPE_NUMBER):quantiles({ 0.5 })) == nil)
+
+
+print("test get ranks")
+zs = zset.new(zset.TYPE_STRING)
+for i = 1, 100 do
+    zs:insert(i % 10, tostring(i))
+end
+local keys = { "10", "missing", "99", "1", "10", 5 }
+t = zs:ranks(keys)
+for i = 1, #keys do
+    assert(t[i] == zs:rank(keys[i]))
+end
+assert(t[1] == 1 and t[2] == nil and t[3] == 100 and t[6] == nil)
+assert(next(zs:ranks({})) == nil)
+
+
+print("test around")
+zs = zset.new(zset.TYPE_NUMBER)
+for i = 1, 100 do
+    zs:insert(i, i)
+end
+rank, t = zs:around(50, 2, 1)
+assert(rank == 48 and equal(t, { 48, 48, 49, 49, 50, 50, 51, 51 }))
+rank, t = zs:around(2, 10, 10)
+assert(rank == 1 and #t == 24 and t[23] == 12)
+rank, t = zs:around(100, 1, 10)
+assert(rank == 99 and equal(t, { 99, 99, 100, 100 }))
+rank, t = zs:around(7)
+assert(rank == 7 and equal(t, { 7, 7 }))
+assert(zs:around(101, 1, 1) == nil)
+
+
+print("test stats")
+zs = zset_string()
+local stats = zs:stats()
+assert(stats.length == 0 and stats.node_bytes == 0 and stats.member_bytes == 0)
+for i = 1, 1000 do
+    zs:insert(i, tostring(i))
+end
+stats = zs:stats()
+local nodes = 0
+for _, n in ipairs(stats.levels) do
+    nodes = nodes + n
+end
+assert(stats.length == 1000 and nodes == 1000 and #stats.levels == stats.level)
+assert(stats.node_bytes > 0 and stats.overhead_bytes > 0)
+local member_bytes = stats.member_bytes
+zs:delete(1, "1")
+zs:delete_range_by_rank(1, 9, function() end)
+stats = zs:stats()
+assert(stats.length == 990 and stats.member_bytes < member_bytes)
+assert(stats.avg_search_path > 1)
+
+
+print("test metrics")
+zs = zset.new(zset.TYPE_STRING)
+zs:reset_metrics()
+local metrics = zs:metrics()
+if metrics then
+    for i = 1, 100 do
+        zs:insert(i, tostring(i))
+    end
+    assert(#zs:get_range_by_rank(1, 10) == 10)
+    metrics = zs:metrics()
+    assert(metrics.methods.insert.calls == 100)
+    assert(metrics.methods.get_range_by_rank.returned == 10)
+    assert(metrics.compares > 0 and metrics.hops > 0)
+    zs:reset_metrics()
+    assert(zs:metrics().methods.insert == nil)
+end
+
+
+if jit then
+    print("test ffi")
+    local lzset_ffi = require "lzset_ffi"
+    local ffi = require "ffi"
+
+    zs = lzset_ffi.string({ max_size = 3 })
+    assert(zs:insert(1, "a") and zs:insert(2, "b") and zs:insert(3, "c"))
+    assert(equal({ zs:insert(4, "d") }, { true, 1, "a" }))
+    assert(not zs:insert(5, "d") and #zs == 3)
+    assert(zs:score("c") == 3 and zs:get_rank(3, "c") == 2)
+    assert(equal(zs:get_range_by_rank(3, 1), { "d", "c", "b" }))
+    assert(equal(zs:get_range_by_score(2, 3), { "b", "c" }))
+    assert(equal({ zs:incrby("b", 10, true) }, { 12, 3 }))
+    assert(equal(zs:pop_min(), { 3, "c" }))
+    assert(equal(zs:get_ranks({ "d", "x", "b" }), { 1, nil, 2 }))
+
+    zs = lzset_ffi.number({ sum = true })
+    for i = 1, 100 do
+        zs:insert(i, i * 10)
+    end
+    local scores, members = ffi.new("double[10]"), ffi.new("double[10]")
+    assert(zs:get_range_by_rank_into(91, 200, scores, members) == 10)
+    assert(scores[0] == 91 and members[9] == 1000)
+    assert(zs:get_range_by_score_into(5, 1, 10, nil, members) == 5)
+    assert(members[0] == 50 and members[4] == 10)
+    assert(equal({ zs:sum_by_rank(1, 100) }, { 5050, 100 }))
+    assert(equal(zs:quantiles({ 0.5, 1 }), { 50, 500, 100, 1000 }))
+    assert(equal({ zs:around(500, 1, 1) }, { 49, { 49, 490, 50, 500, 51, 510 } }))
+    assert(zs:delete_range_by_rank(1, 10) == 10 and zs:at(1) == 11)
+
+    -- after a defrag pass neighbouring members are next to each other
+    local lib = ffi.load(package.searchpath("lzset", package.cpath))
+    zs = lzset_ffi.number()
+    for i = 1, 3000 do
+        zs:insert((i * 7919) % 3001, i)
+    end
+    for i = 1, 3000, 3 do
+        zs:delete((i * 7919) % 3001, i)
+    end
+    local ordered = zs:get_range_by_rank(1, #zs)
+    while not zs:defrag(100) do end
+    assert(equal(zs:get_range_by_rank(1, #zs), ordered))
+    local n, far = #zs, 0
+    local objs = ffi.new("void *[?]", n)
+    assert(lib.lzset_ffi_range_by_rank(zs.sl, 1, n, nil, objs) == n)
+    for i = 1, n - 1 do
+        local d = ffi.cast("char *", objs[i]) - ffi.cast("char *", objs[i - 1])
+        if d < 0 or d > 256 then
+            far = far + 1
+        end
+    end
+    assert(far <= n / 100)
+end
+
+
+print("test integer")
+local zset_integer = require "lzset.integer"
+zs = zset_integer({ max_size = 3 })
+assert(zs:insert(1, 30) and zs:insert(1, 10) and zs:insert(1, 20))
+assert(equal(zs:get_range_by_rank(1, 3), { 10, 20, 30 }))
+assert(equal({ zs:insert(2, 40) }, { true, 1, 10 }))
+assert(not pcall(zs.insert, zs, 3, 20.5))
+assert(zs:score(30) == 1 and zs:get_rank(1, 30) == 2)
+assert(equal({ zs:incrby(20, 5, true) }, { 6, 3 }))
+assert(equal(zs:get_ranks({ 40, 1.5, 30 }), { 2, nil, 1 }))
+assert(equal(zs:pop_max(), { 6, 20 }))
+
+local big
+if math.type then
+    big = math.maxinteger - 1
+elseif jit then
+    big = require("ffi").new("int64_t", 2 ^ 53) + 1
+end
+if big then
+    zs = zset_integer()
+    zs:insert(1, big)
+    zs:insert(1, big + 1)
+    zs:insert(1, big - 1)
+    assert(zs:score(big) == 1 and zs:get_rank(1, big) == 2)
+    local t = zs:get_range_by_rank(1, 3)
+    assert(t[1] == big - 1 and t[2] == big and t[3] == big + 1)
+    assert(zs:delete(1, big) and zs:score(big) == nil and #zs == 2)
+end
+if jit then
+    local ffi = require "ffi"
+    for _, v in ipairs({ ffi.new("int8_t", 1), ffi.new("double", 1),
+                         ffi.new("bool", true), ffi.new("void *") }) do
+        local ok, err = pcall(zs.insert, zs, 1, v)
+        assert(not ok and err:find("integer expected"))
+    end
+    local zf = require("lzset_ffi").integer()
+    local ok, err = pcall(zf.insert, zf, 1, ffi.new("double", 1))
+    assert(not ok and err:find("member must be an integer"))
+end
+
+
+print("test split concat")
+zs = zset_string({ sum = true })
+for i = 1, 100 do
+    zs:insert(i, "m" .. i)
+end
+zs:expire("m90", 1000)
+local tail = zs:split_at_rank(60)
+assert(#zs == 60 and #tail == 40)
+assert(zs:score("m61") == nil and tail:score("m61") == 61)
+assert(tail:get_rank(61, "m61") == 1 and tail:ttl("m90") > 0)
+assert(equal({ zs:sum_by_rank(1, 60) }, { 1830, 60 }))
+assert(equal({ tail:sum_by_rank(1, 40) }, { 3220, 40 }))
+local top = tail:split_at_score(90)
+assert(#tail == 30 and #top == 10 and top:at(1) == 91)
+assert(#tail:split_at_score(90, true) == 1 and #tail == 29)
+assert(not top:concat(zs) and #top == 10)
+assert(zs:concat(tail) and #tail == 0 and #zs == 89)
+assert(zs:concat(top) and #zs == 99 and zs:get_rank(100, "m100") == 99)
+assert(equal({ zs:sum_by_score(1, 100) }, { 5050 - 90, 99 }))
+assert(tail:insert(1, "x") and #tail == 1)
+assert(not pcall(zs.concat, zs, zset_string()))
+assert(not pcall(zs.concat, zs, zs))
+tail = zset_string({ sum = true })
+assert(tail:insert(200, "m1") and tail:insert(300, "y"))
+assert(not zs:concat(tail) and #tail == 2 and #zs == 99)
+assert(zs:score("m1") == 1 and tail:score("m1") == 200)
+assert(zs:delete(1, "m1") and zs:concat(tail) and zs:score("m1") == 200)
+
+
+print("test shards")
+zs = zset_string({ shard_size = 8, threads = 2 })
+for i = 1, 100 do
+    assert(zs:insert(i % 50, "m" .. i))
+end
+assert(not zs:insert(1, "m1") and #zs == 100 and #zs:shards() > 1)
+assert(zs:score("m7") == 7 and zs:get_rank(7, "m7") == 16)
+assert(equal({ zs:at(16) }, { 7, "m7" }))
+assert(zs:get_score_rank(7) == 16 and zs:get_score_rank(7, true) == 14)
+assert(equal(zs:get_range_by_score(7, 8), { "m57", "m7", "m58", "m8" }))
+assert(equal(zs:get_range_by_score(8, 7), { "m8", "m58", "m7", "m57" }))
+assert(equal(zs:get_range_by_rank(99, 100), { "m49", "m99" }))
+assert(equal(zs:get_range_by_rank(2, 1), { "m50", "m100" }))
+assert(zs:update(7, "m7", 100) and zs:get_rank(100, "m7") == 100)
+assert(zs:score("m7") == 100 and not zs:update(7, "m7", 1))
+assert(zs:update(100, "m7", 99) and zs:update(99, "m7", 100))
+assert(zs:delete(100, "m7") and not zs:delete(100, "m7") and #zs == 99)
+assert(zs:delete_range_by_rank(1, 60) == 60 and #zs == 39)
+local deleted = {}
+assert(zs:delete_range_by_rank(1, 10, function(m)
+    deleted[#deleted + 1] = m
+end) == 10 and #deleted == 10 and #zs == 29)
+assert(not pcall(zs.delete_range_by_rank, zs, 1, 2, function(m)
+    error(m)
+end) and #zs == 27 and #zs:get_range_by_rank(1, 27) == 27)
+assert(zs:delete_range_by_rank(1, 2, function(m)
+    assert(not zs:score(m) and zs:insert(1000, m))
+end) == 2 and #zs == 27 and zs:at(27) == 1000)
+for _, shard in ipairs(zs:shards()) do
+    assert(shard.count <= 8)
+end
+assert(zs:load({ 1, "a", 2, "b", 3, "a", 4, "m99" }) == 2 and #zs == 29)
+assert(zs:get_rank(1, "a") == 1 and zs:score("m99") == 49)
+assert(not pcall(zset_string, { shard_size = 8, max_size = 10 }))
+
+
+print("test load")
+local input = {}
+zs = zset_string({ sum = true })
+for i = 1, 3000 do
+    local score, member = (i * 7919) % 101, "m" .. (i * 31) % 2500
+    input[#input + 1] = score
+    input[#input + 1] = member
+    zs:insert(score, member)
+end
+local loaded = zset_string({ sum = true })
+assert(loaded:load(input, 2) == 2500 and #loaded == 2500)
+assert(equal(loaded:get_range_by_rank(1, 2500), zs:get_range_by_rank(1, 2500)))
+assert(loaded:sum_by_rank(1, 2500) == zs:sum_by_rank(1, 2500))
+assert(loaded:score("m31") == zs:score("m31"))
+assert(loaded:load({ 1, "m31", 5, "new" }) == 1 and #loaded == 2501)
+assert(not pcall(loaded.load, loaded, { "x", "a" }))
+local bounded = zset_string({ max_size = 10 })
+assert(not pcall(bounded.load, bounded, { 1, "a" }))
+
+
+print("test defrag")
+zs = zset_string({ sum = true })
+for i = 1, 1000 do
+    zs:insert(i % 97, "m" .. i)
+end
+for i = 1, 1000, 3 do
+    zs:delete(i % 97, "m" .. i)
+end
+zs:expire("m2", 100)
+local before = zs:get_range_by_rank(1, #zs)
+local steps = 1
+while not zs:defrag(50) do
+    steps = steps + 1
+end
+assert(steps == math.ceil(#zs / 50))
+assert(equal(zs:get_range_by_rank(1, #zs), before))
+assert(zs:score("m2") == 2 and zs:ttl("m2") > 99)
+assert(zs:sum_by_rank(1, #zs) == zs:sum_by_score(0, 96))
+assert(zs:defrag(0) == false and zs:defrag(#zs) == true)
+
+
+print("test step")
+zs = zset_string()
+for i = 1, 1000 do
+    zs:insert(i % 53, "m" .. i)
+end
+local all, got = zs:get_range_by_score(40, 5), {}
+local members, score, member = zs:get_range_by_score_step(40, 5, 64)
+while true do
+    for _, m in ipairs(members) do
+        got[#got + 1] = m
+    end
+    if score == nil then break end
+    zs:delete(score, member)
+    members, score, member = zs:get_range_by_score_step(40, 5, 64, score, member)
+end
+assert(equal(got, all))
+local removed, rest, steps = 0, #zs, 0
+while rest do
+    local n
+    n, rest = zs:delete_range_by_rank_step(101, rest, 150)
+    removed, steps = removed + n, steps + 1
+end
+assert(#zs == 100 and steps == math.ceil(removed / 150))
+assert(zs:delete_range_by_rank_step(1, 10, 100) == 10 and #zs == 90)
+local stepped = {}
+assert(zs:delete_range_by_rank_step(1, 10, 3, function(m)
+    stepped[#stepped + 1] = m
+    assert(not zs:score(m))
+end) == 3 and #stepped == 3 and #zs == 87)
+assert(not pcall(zs.delete_range_by_rank_step, zs, 1, 2, 2, error) and #zs == 85)
+assert(zs:dump_step(50) == 51 and zs:dump_step(50, 51) == nil)
+
+
+print("test clear")
+zs = zset_string({ sum = true })
+for round = 1, 3 do
+    for i = 1, 5000 do
+        zs:insert(i % 71, "m" .. (i + round))
+    end
+    zs:expire("m10", 100)
+    assert(#zs == 5000)
+    zs:clear()
+    assert(#zs == 0 and zs:score("m10") == nil and zs:ttl("m10") == nil)
+    assert(equal(zs:get_range_by_rank(1, 10), {}))
+end
+for i = 1, 100 do
+    zs:insert(i, "n" .. i)
+end
+assert(#zs == 100 and zs:sum_by_rank(1, 100) == 5050)
+assert(zs:get_rank(50, "n50") == 50 and zs:stats().length == 100)
+zs = nil
+collectgarbage()
+
+
+print("test compact")
+zs = zset_string()
+local zc = zset_string({ compact = true })
+for i = 1, 2000 do
+    zs:insert(i % 89, "m" .. i)
+    zc:insert(i % 89, "m" .. i)
+end
+assert(not zc:insert(5, "m1"))
+for i = 1, 2000, 3 do
+    assert(zc:delete(i % 89, "m" .. i) == zs:delete(i % 89, "m" .. i))
+end
+for i = 2, 2000, 5 do
+    assert(zc:update(i % 89, "m" .. i, i % 13) ==
+        zs:update(i % 89, "m" .. i, i % 13))
+end
+assert(not zc:update(1, "m1", 2))
+assert(#zc == #zs and zc:count() == zs:count())
+assert(equal(zc:get_range_by_rank(1, #zs), zs:get_range_by_rank(1, #zs)))
+assert(equal(zc:get_range_by_rank(30, 10), zs:get_range_by_rank(30, 10)))
+assert(equal(zc:get_range_by_score(40, 10), zs:get_range_by_score(40, 10)))
+assert(equal(zc:get_range_by_score(10, 40), zs:get_range_by_score(10, 40)))
+assert(zc:get_rank(zs:score("m2"), "m2") == zs:get_rank(zs:score("m2"), "m2"))
+assert(zc:get_score_rank(20) == zs:get_score_rank(20))
+assert(zc:score("m7") == zs:score("m7") and zc:score("m1") == nil)
+local score, member = zc:at(100)
+assert(score == zs:at(100) and member == select(2, zs:at(100)))
+local deleted = {}
+assert(zc:delete_range_by_rank(1, 10, function(m) deleted[#deleted + 1] = m end) == 10)
+assert(equal(deleted, zs:get_range_by_rank(1, 10)))
+assert(zc:stats().length == #zc)
+local small = zset_string({ compact = true })
+assert(small:insert(2, "b") and small:insert(1, "a"))
+small:dump()
+assert(not pcall(zset_string, { compact = true, sum = true }))
+
+
+print("test queue")
+local q = zset_string({ queue = true })
+for i = 1, 3000 do
+    assert(q:push(i % 7, "job" .. i))
+end
+assert(not q:push(1, "job1"))
+assert(#q == 3000 and q:count() == 3000)
+local due, job = q:peek()
+assert(due == 0 and job == "job7")
+assert(equal(q:get_range_by_rank(1, 3), { "job7", "job14", "job21" }))
+assert(q:cancel("job14") and not q:cancel("job14"))
+assert(q:score("job21") == 0 and q:score("job14") == nil)
+assert(equal(q:pop_due(0, 2), { 0, "job7", 0, "job21" }))
+assert(equal(q:pop_due(-1, 10), {}))
+local popped = q:pop_due(6, 3000)
+assert(#popped == 2 * 2997 and #q == 0 and q:peek() == nil)
+for i = 3, #popped, 2 do
+    assert(popped[i - 2] <= popped[i])
+end
+assert(q:push(5, "job1") and q:push(2, "job2") and q:push(5, "job3"))
+assert(equal(q:pop_due(10, 3), { 2, "job2", 5, "job1", 5, "job3" }))
+assert(q:stats().length == 0)
+assert(not pcall(zset_string, { queue = true, sum = true }))
+q = nil
+collectgarbage()
+
+
 print("test delete cb")
 zs = gen_zset(10)
 zs:limit_front(0, function(key) end)
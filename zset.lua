@@ -1,17 +1,29 @@
 local lzset_number = require "lzset.number"
 local lzset_string = require "lzset.string"
+local lzset_integer = require "lzset.integer"
 
 
 local setmetatable = setmetatable
 
 
-local _M = { TYPE_NUMBER = 0, TYPE_STRING = 1 }
+local _M = { TYPE_NUMBER = 0, TYPE_STRING = 1, TYPE_INTEGER = 2 }
 local _mt = { __index = _M }
 
 
-function _M.new(typ)
+local _new = {
+    [_M.TYPE_NUMBER] = lzset_number,
+    [_M.TYPE_STRING] = lzset_string,
+    [_M.TYPE_INTEGER] = lzset_integer,
+}
+
+
+-- opts: { max_size = n, evict = "min" | "max" }, see lzset.c
+--
+-- On LuaJIT, TYPE_INTEGER members beyond 2^53 are int64_t cdata, which are
+-- distinct table keys even when equal: use lzset.integer directly for them.
+function _M.new(typ, opts)
     local zset = {
-        _sl = typ == _M.TYPE_NUMBER and lzset_number() or lzset_string(),
+        _sl = (_new[typ] or lzset_string)(opts),
         _dict = {},
     }
 
@@ -23,6 +35,11 @@ end
 
 function _M.insert(self, score, key)
     local curscore = self._dict[key]
+    if curscore and self._ttl and not self._sl:score(key) then
+        -- expired, lzset replaces it on insert
+        curscore = nil
+    end
+
     if curscore then
         if curscore ~= score then
             self._sl:update(curscore, key, score)
@@ -31,8 +48,32 @@ function _M.insert(self, score, key)
         return
     end
 
-    self._sl:insert(score, key)
+    local ok, _, evicted = self._sl:insert(score, key)
+    if not ok then
+        return
+    end
+
     self._dict[key] = score
+    if evicted ~= nil then
+        self._dict[evicted] = nil
+    end
+end
+
+
+-- add delta to the score of key (inserting it when missing), return the
+-- new score and, when with_rank is true, the new rank
+function _M.incrby(self, key, delta, with_rank)
+    local score, rank, _, evicted = self._sl:incrby(key, delta, with_rank)
+    if score == nil then
+        return
+    end
+
+    self._dict[key] = score
+    if evicted ~= nil then
+        self._dict[evicted] = nil
+    end
+
+    return score, rank
 end
 
 
@@ -50,6 +91,13 @@ function _M.count(self)
 end
 
 
+-- remove all the keys, the memory is kept for the next insertions
+function _M.clear(self)
+    self._sl:clear()
+    self._dict = {}
+end
+
+
 -- remove [from, to]
 function _M._remove_helper(self, from, to, cb)
     local delete_cb = function(key)
@@ -129,6 +177,34 @@ function _M.limit_back(self, n, cb)
 end
 
 
+function _M._forget_cb(self)
+    local dict = self._dict
+    return function(key)
+        dict[key] = nil
+    end
+end
+
+
+-- pop n elements with the lowest scores, return { score1, key1, ... }
+function _M.pop_min(self, n)
+    local t = self._sl:pop_min(n or 1, self._ttl and self:_forget_cb())
+    for i = 2, #t, 2 do
+        self._dict[t[i]] = nil
+    end
+    return t
+end
+
+
+-- pop n elements with the highest scores, return { score1, key1, ... }
+function _M.pop_max(self, n)
+    local t = self._sl:pop_max(n or 1, self._ttl and self:_forget_cb())
+    for i = 2, #t, 2 do
+        self._dict[t[i]] = nil
+    end
+    return t
+end
+
+
 function _M.get_range_by_rank(self, r1, r2)
     if r1 < 1 then r1 = 1 end
     if r2 < 1 then r2 = 1 end
@@ -142,6 +218,32 @@ function _M.get_range_by_score(self, s1, s2)
 end
 
 
+-- same as get_range_by_score, visiting at most budget keys, return the keys
+-- and, when the range goes on, the score and key to resume after
+function _M.get_range_by_score_step(self, s1, s2, budget, after, key)
+    return self._sl:get_range_by_score_step(s1, s2, budget, after, key)
+end
+
+
+-- return the sum of the scores and the count of the ranks [r1, r2],
+-- the zset must be created with { sum = true }
+function _M.sum_by_rank(self, r1, r2)
+    return self._sl:sum_by_rank(r1, r2)
+end
+
+
+-- return the sum of the scores and the count of the scores [s1, s2],
+-- the zset must be created with { sum = true }
+function _M.sum_by_score(self, s1, s2)
+    return self._sl:sum_by_score(s1, s2)
+end
+
+
+function _M.count_by_score(self, s1, s2)
+    return self._sl:count_by_score(s1, s2)
+end
+
+
 function _M.rank(self, key)
     local score = self._dict[key]
     if not score then
@@ -152,11 +254,61 @@ function _M.rank(self, key)
 end
 
 
+-- return the ranks of the keys in the list, nil for the missing ones
+function _M.ranks(self, keys)
+    return self._sl:get_ranks(keys)
+end
+
+
+-- return the rank of the first row and { score1, key1, ... } of key with
+-- up to before keys above it and after keys below it, nil if key is missing
+function _M.around(self, key, before, after)
+    return self._sl:around(key, before, after)
+end
+
+
 function _M.score(self, key)
+    if self._ttl then
+        return self._sl:score(key)
+    end
+
     return self._dict[key]
 end
 
 
+-- set the time to live of key in seconds, return false if key is missing
+function _M.expire(self, key, ttl)
+    if not self._dict[key] then
+        return false
+    end
+
+    self._ttl = true
+
+    return self._sl:expire(key, ttl)
+end
+
+
+-- return the remaining time to live of key, -1 if it has none
+function _M.ttl(self, key)
+    return self._sl:ttl(key)
+end
+
+
+function _M.persist(self, key)
+    return self._sl:persist(key)
+end
+
+
+-- reclaim at most budget expired keys, return the number reclaimed
+function _M.expire_step(self, budget, cb)
+    local dict = self._dict
+    return self._sl:expire_step(budget, function(key)
+        dict[key] = nil
+        if cb then cb(key) end
+    end)
+end
+
+
 -- return score and key
 function _M.at(self, rank)
     if rank <= 0 or rank > #self._sl then
@@ -167,14 +319,60 @@ function _M.at(self, rank)
 end
 
 
+-- return { score1, key1, ... } of the ranks in the list, in the order of the
+-- list, a rank out of range leaves a nil hole
+function _M.at_many(self, ranks)
+    return self._sl:at_many(ranks)
+end
+
+
+-- same as at_many with the nearest ranks of the quantiles, e.g.
+-- { 0.5, 0.9, 0.99 }
+function _M.quantiles(self, qs)
+    return self._sl:quantiles(qs)
+end
+
+
 function _M.reverse_rank(self, rank)
     return #self._sl - rank + 1
 end
 
 
+-- return { length, level, levels, node_bytes, member_bytes, overhead_bytes,
+-- avg_search_path }, see lzset.c
+function _M.stats(self)
+    return self._sl:stats()
+end
+
+
+-- move at most budget elements to contiguous memory in rank order, return
+-- true when a pass over the whole set is done
+function _M.defrag(self, budget)
+    return self._sl:defrag(budget)
+end
+
+
+-- return the counters of all the sets when lzset is built with METRICS=1,
+-- nil otherwise
+function _M.metrics(self)
+    return self._sl:metrics()
+end
+
+
+function _M.reset_metrics(self)
+    self._sl:reset_metrics()
+end
+
+
 function _M.dump(self)
     self._sl:dump()
 end
 
 
+-- print at most budget keys from rank, return the rank to resume from
+function _M.dump_step(self, budget, rank)
+    return self._sl:dump_step(budget, rank)
+end
+
+
 return _M